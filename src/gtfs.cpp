@@ -1,17 +1,84 @@
 #include "gtfs.hpp"
 #include <cstring>
+#include <cerrno>
 #include <fstream>
 #include <algorithm>
+#include <array>
+#include <map>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <shared_mutex>
+#include <fcntl.h>
 #include <sys/file.h>
+#include <sys/stat.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 #define VERBOSE_PRINT(verbose, str...) do { \
     if (verbose) cout << "VERBOSE: "<< __FILE__ << ":" << __LINE__ << " " << __func__ << "(): " << str; \
 } while(0)
 
+#define SHARED_LOG_NAME ".gtfs.wal"
+#define DIRTY_MANIFEST_NAME ".gtfs.dirty"
+#define DIRTY_MANIFEST_MAGIC "gtfs-dirty\n"
+
 int do_verbose;
 
 unordered_map<string, gtfs_t*> gtfs_map;
 
+/** Table driven CRC32C (Castagnoli, reflected polynomial 0x82F63B78) for CPUs without the SSE4.2 crc32 instruction */
+static uint32_t crc32c_software(uint32_t crc, const char* data, size_t length) {
+    static const auto table = [] {
+        array<uint32_t, 256> table{};
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t value = i;
+            for (int bit = 0; bit < 8; ++bit) {
+                value = (value >> 1) ^ ((value & 1) ? 0x82F63B78 : 0);
+            }
+            table[i] = value;
+        }
+        return table;
+    }();
+    while (length--) {
+        crc = table[(crc ^ static_cast<uint8_t>(*data++)) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+/** CRC32C using the SSE4.2 crc32 instruction, 8 bytes per step */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hardware(uint32_t crc, const char* data, size_t length) {
+    uint64_t crc64 = crc;
+    for (; length >= 8; data += 8, length -= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = static_cast<uint32_t>(crc64);
+    while (length--) {
+        crc = _mm_crc32_u8(crc, static_cast<uint8_t>(*data++));
+    }
+    return crc;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const char* data, size_t length) {
+    crc = ~crc;
+#if defined(__x86_64__)
+    static const bool hasHardwareCrc = __builtin_cpu_supports("sse4.2");
+    if (hasHardwareCrc) {
+        return ~crc32c_hardware(crc, data, length);
+    }
+#endif
+    return ~crc32c_software(crc, data, length);
+}
+
 gtfs_t* gtfs_init(string directory, int verbose_flag) {
     do_verbose = verbose_flag;
     gtfs_t *gtfs = nullptr;
@@ -36,486 +103,4523 @@ gtfs_t* gtfs_init(string directory, int verbose_flag) {
 
     gtfs = new gtfs_t;
     gtfs->dirname = gtfs_dir.string();
+    gtfs->directoryFd = open(gtfs->dirname.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (gtfs->directoryFd == -1) {
+        VERBOSE_PRINT(do_verbose, "Failed to open directory, returning nullptr\n");
+        delete gtfs;
+        return nullptr;
+    }
+    gtfs->memoryBudget = make_shared<MemoryBudget>();
+    gtfs->replicator = make_shared<Replicator>();
+    gtfs->cleaner = make_shared<Cleaner>();
     gtfs_map[gtfs_dir.string()] = gtfs;
 
     VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns non NULL.
     return gtfs;
 }
 
-/**
- * Processes the transactions in given log file, optionally truncating the processing to n bytes.
- * Applies the transactions to the original file and deletes the log file.
- * Called from gtfs_clean() and gtfs_clean_n_bytes().
- */ 
-int clean_n_bytes(const fs::path& logFilePath, int bytes = -1) {
-    auto transactions = LogManager::getTransactionsInLog(logFilePath);
-    if (bytes >= 0) {
-        auto it = transactions.begin();
-        for (; it != transactions.end(); ++it) {
-            if (it->newData.size() > bytes) {
-                break;
-            }
-            bytes -= it->newData.size();
-            if (bytes == 0) {
-                ++it;
-                break;
-            }
-        }
-        // Remove rest of the transactions
-        transactions.erase(it, transactions.end());
-        if (bytes > 0) {
-            VERBOSE_PRINT(do_verbose, "Not enough transactions to clean " << bytes << " bytes in log file " << logFilePath << "\n");
-        }
-        VERBOSE_PRINT(do_verbose, "Cleaning " << transactions.size() << " transactions in log file " << logFilePath << "\n");
+AlignedBufferPool alignedBufferPool;
+BufferCache bufferCache;
+OpenFiles openFiles;
+
+/** Bytes written by the process, see gtfs_get_write_stats() */
+struct WriteCounters {
+    atomic<uint64_t> committedBytes{0};
+    atomic<uint64_t> logBytes{0};
+    atomic<uint64_t> checkpointBytes{0};
+    atomic<uint64_t> compactedBytes{0};
+};
+WriteCounters writeCounters;
+
+// Commits in progress in the process, the background cleaner holds its chunks back while there are any
+atomic<int> foregroundCommits{0};
+// Held shared by commits, and exclusively by the background cleaner while it drops logs or segments commits append to
+shared_mutex logAppendGate;
+
+/** Counts a commit in foregroundCommits and holds logAppendGate for its duration */
+struct ForegroundCommit {
+    shared_lock<shared_mutex> appending{logAppendGate};
+
+    ForegroundCommit() {
+        foregroundCommits++;
     }
-    fs::path originalFilePath = logFilePath.string().substr(0, logFilePath.string().length() - 4);
-    
-    // Read the current file contents of the actual file on disk
-    ifstream originalFile(originalFilePath);
-    vector<char> originalFileBuffer((istreambuf_iterator<char>(originalFile)), istreambuf_iterator<char>());
-    originalFile.close();
-
-    // Replay all log transactions on the buffer
-    BaseTransactionManager transactionManager(move(originalFileBuffer));
-    transactionManager.replayTransactions(transactions);
-
-    // Overwrite the updated buffer (transactionManager.getVMBase()) into the original file
-    ofstream originalFileWrite(originalFilePath);
-    auto updatedBuffer = transactionManager.getVMBase();
-    originalFileWrite.write(updatedBuffer.data(), updatedBuffer.size());
-    originalFileWrite.close();
-
-    // Delete the log file
-    if (!fs::remove(logFilePath)) {
-        VERBOSE_PRINT(do_verbose, "Failed to delete log file " << logFilePath << "\n");
-        return -1;
+    ~ForegroundCommit() {
+        foregroundCommits--;
     }
-    return 0;
-}
+};
 
-int gtfs_clean(gtfs_t *gtfs) {
-    int ret = -1;
-    if (gtfs) {
-        VERBOSE_PRINT(do_verbose, "Cleaning up GTFileSystem inside directory " << gtfs->dirname << "\n");
-    } else {
-        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
-        return ret;
+/** Opens a file for direct I/O (O_DIRECT), creating it if needed. Returns -1 if that fails, e.g. on file systems without direct I/O */
+static int open_direct(const fs::path& path) {
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_DIRECT, 0644);
+    if (fd == -1) {
+        VERBOSE_PRINT(do_verbose, "Direct I/O not available for " << path << ", falling back to buffered I/O\n");
     }
+    return fd;
+}
 
-    // Iterate through each log file in the directory and apply the transactions to the corresponding actual file
-    for (auto& p: fs::directory_iterator(gtfs->dirname)) {
-        if (fs::is_regular_file(p) && p.path().extension() == ".log") {
-            if (clean_n_bytes(p.path(), -1) != 0) {
-                ret = -2;
-            }
-        }
+/**
+ * Writes `length` bytes at `offset` of an O_DIRECT descriptor through pooled aligned buffers and sets the file size to offset + length.
+ * Direct I/O only transfers whole aligned blocks, so the bytes of the block `offset` falls in are read back and rewritten unchanged,
+ * and the zero padding of the last block is cut off again by the final ftruncate.
+ */
+static int write_direct(int fd, uint64_t offset, const char* data, size_t length) {
+    const size_t alignment = AlignedBufferPool::ALIGNMENT;
+    const size_t maxChunkSize = 1 << 20;
+    uint64_t blockOffset = offset & ~static_cast<uint64_t>(alignment - 1);
+    size_t head = offset - blockOffset;
+    auto buffer = alignedBufferPool.acquire(min(head + length, maxChunkSize));
+    if (head > 0 && pread(fd, buffer.data(), alignment, blockOffset) < static_cast<ssize_t>(head)) {
+        return -1;
     }
-
-    if (ret != -2) {
-        ret = 0;
+    for (size_t done = 0; done < length;) {
+        size_t chunk = min(length - done, buffer.capacity() - head);
+        memcpy(buffer.data() + head, data + done, chunk);
+        size_t filled = head + chunk;
+        size_t padded = (filled + alignment - 1) & ~(alignment - 1);
+        memset(buffer.data() + filled, 0, padded - filled);
+        if (pwrite(fd, buffer.data(), padded, blockOffset) != static_cast<ssize_t>(padded)) {
+            return -1;
+        }
+        // Every chunk but the last fills the buffer, so the next one starts block aligned
+        blockOffset += filled;
+        head = 0;
+        done += chunk;
     }
+    return ftruncate(fd, offset + length);
+}
 
-    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
-    return ret;
+/** Returns the path of the data file a log, log manifest or log segment belongs to */
+static fs::path original_file_path(const fs::path& logFilePath) {
+    auto logPath = logFilePath.string();
+    return logPath.substr(0, logPath.rfind(".log"));
 }
 
-file_t* gtfs_open_file(gtfs_t* gtfs, string filename, int fileLength) {
-    file_t *fl = NULL;
-    if (gtfs) {
-        VERBOSE_PRINT(do_verbose, "Opening file " << filename << " inside directory " << gtfs->dirname << "\n");
-    } else {
-        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
-        return NULL;
-    }
-    
-    if (filename.length() == 0) {
-        VERBOSE_PRINT(do_verbose, "Filename is empty, returning nullptr\n");
-        return fl;
-    }
-    auto file_path = fs::path(gtfs->dirname) / filename;
-    if (!fs::exists(file_path)) {
-        VERBOSE_PRINT(do_verbose, "File does not exist, creating it\n");
-        ofstream file(file_path);
-        file.close();
-    } else if (!fs::is_regular_file(file_path)) {
-        VERBOSE_PRINT(do_verbose, "File name exists but is not a regular file, returning nullptr\n");
-        return fl;
+/** Redo bytes a partial clean may apply: leading transactions are taken as long as their redo data fits (all of them if -1) */
+struct RedoBudget {
+    int64_t bytes;
+
+    /** Takes the next transaction of the log. Returns false if it does not fit, the clean then stops before it */
+    bool take(const Transaction& transaction) {
+        if (bytes < 0) {
+            return true;
+        }
+        if (transaction.redoSize() > static_cast<VMSizeT>(bytes)) {
+            return false;
+        }
+        bytes -= transaction.redoSize();
+        return true;
     }
 
-    // Get size of file at file_path
-    auto file_size = fs::file_size(file_path);
-    if (fileLength < file_size) {
-        VERBOSE_PRINT(do_verbose, "File length is less than the size of the file, not allowed!\n");
-        return fl;
-    } else if (fileLength > file_size) {
-        VERBOSE_PRINT(do_verbose, "File length is greater than the size of the file, extending file\n");
-        // Extend file to fileLength
-        fs::resize_file(file_path, fileLength);
+    /** Returns true once the budget is used up, the clean then stops after the last transaction taken */
+    bool exhausted() const {
+        return bytes == 0;
     }
+};
 
-    // Lock file at path file_path using flock
-    int fileDescriptor = open(file_path.c_str(), O_RDWR);
-    if (fileDescriptor == -1) {
-        VERBOSE_PRINT(do_verbose, "Failed to open file\n");
-        return fl;
+/** Keeps only the leading transactions whose redo data adds up to at most `bytes` (all of them if `bytes` is -1) */
+static void truncate_to_bytes(vector<Transaction>& transactions, int64_t bytes, const fs::path& logFilePath) {
+    RedoBudget budget{bytes};
+    auto it = transactions.begin();
+    while (it != transactions.end() && !budget.exhausted() && budget.take(*it)) {
+        ++it;
     }
-    if (flock(fileDescriptor, LOCK_EX | LOCK_NB) == -1) {
-        VERBOSE_PRINT(do_verbose, "Failed to lock file\n");
-        close(fileDescriptor);
-        return fl;
+    // Remove rest of the transactions
+    transactions.erase(it, transactions.end());
+    if (budget.bytes > 0) {
+        VERBOSE_PRINT(do_verbose, "Not enough transactions to clean " << budget.bytes << " bytes in log file " << logFilePath << "\n");
     }
+    VERBOSE_PRINT(do_verbose, "Cleaning " << transactions.size() << " transactions in log file " << logFilePath << "\n");
+}
 
-    // Read fd into buffer
-    vector<char> buffer(fileLength);
-    if (read(fileDescriptor, buffer.data(), fileLength) == -1) {
-        VERBOSE_PRINT(do_verbose, "Failed to read file\n");
-        close(fileDescriptor);
-        return fl;
+/** Reads up to `length` bytes at `offset`, fewer only at the end of the file. Returns -1 on error */
+static ssize_t pread_full(int fd, char* buffer, size_t length, off_t offset) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = pread(fd, buffer + done, length - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
     }
-    
-    fl = new file_t;
-    fl->filename = filename;
-    fl->fileLength = fileLength;
-    fl->fileDescriptor = fileDescriptor;
-    fl->transactionManager = make_unique<TransactionManager>(file_path, move(buffer));
-    fl->transactionManager->replayTransactions(LogManager::getTransactionsInLog(fl->transactionManager->getLogFilePath()));
+    return done;
+}
 
-    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns non NULL.
-    return fl;
+/** Writes `length` bytes at `offset`. Returns -1 on error */
+static int pwrite_full(int fd, const char* buffer, size_t length, off_t offset) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = pwrite(fd, buffer + done, length - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
 }
 
-int gtfs_close_file(gtfs_t* gtfs, file_t* fl) {
-    int ret = -1;
-    if (gtfs and fl) {
-        VERBOSE_PRINT(do_verbose, "Closing file " << fl->filename << " inside directory " << gtfs->dirname << "\n");
-    } else {
-        VERBOSE_PRINT(do_verbose, "GTFileSystem or file does not exist\n");
-        return ret;
+/**
+ * Non-overlapping extents of a file by file offset, each holding the bytes found `position` bytes into its `source`.
+ * Placing an extent cuts the range it covers out of the extents placed before it, so the map tells where the latest
+ * bytes of each range are.
+ */
+template<typename Source>
+class ExtentMap {
+public:
+    struct Extent {
+        VMSizeT length;
+        Source source;
+        VMSizeT position;
+    };
+
+    void place(VMSizeT offset, VMSizeT length, const Source& source, VMSizeT position) {
+        cut(offset, length);
+        if (length > 0) {
+            extents[offset] = {length, source, position};
+        }
     }
 
-    if (fl->fileDescriptor == -1) {
-        VERBOSE_PRINT(do_verbose, "File is not open\n");
-        return ret;
+    /** Places the ranges the redo data of the transaction writes, the first of its redo bytes being at `position` */
+    void place(const Transaction& transaction, const Source& source, VMSizeT position = 0) {
+        if (transaction.deltaRuns.empty()) {
+            place(transaction.offset, transaction.redoSize(), source, position);
+        }
+        for (const auto& run: transaction.deltaRuns) {
+            place(transaction.offset + run.first, run.second, source, position);
+            position += run.second;
+        }
     }
-    
-    // Close the locked file, flock's lock gets dropped automatically on close
-    ret = close(fl->fileDescriptor);
-    // Also destruct remaining properties to avoid mem leaks and check whether file is open in other ops
-    fl->fileDescriptor = -1;
-    fl->fileLength = 0;
-    fl->transactionManager = nullptr;
 
-    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
-    return ret;
-}
+    void cut(VMSizeT offset, VMSizeT length) {
+        VMSizeT end = offset + length;
+        auto it = extents.lower_bound(offset);
+        if (it != extents.begin() && prev(it)->first + prev(it)->second.length > offset) {
+            --it;
+        }
+        while (length > 0 && it != extents.end() && it->first < end) {
+            VMSizeT start = it->first;
+            Extent extent = it->second;
+            it = extents.erase(it);
+            if (start < offset) {
+                extents[start] = {offset - start, extent.source, extent.position};
+            }
+            if (start + extent.length > end) {
+                extents[end] = {start + extent.length - end, extent.source, extent.position + (end - start)};
+                break;
+            }
+        }
+    }
 
-int gtfs_remove_file(gtfs_t* gtfs, file_t* fl) {
-    int ret = -1;
-    if (gtfs and fl) {
-        VERBOSE_PRINT(do_verbose, "Removing file " << fl->filename << " inside directory " << gtfs->dirname << "\n");
-    } else {
-        VERBOSE_PRINT(do_verbose, "GTFileSystem or file does not exist\n");
-        return ret;
+    /** Cuts the ranges the redo data of the transaction writes */
+    void cut(const Transaction& transaction) {
+        if (transaction.deltaRuns.empty()) {
+            cut(transaction.offset, transaction.redoSize());
+        }
+        for (const auto& run: transaction.deltaRuns) {
+            cut(transaction.offset + run.first, run.second);
+        }
     }
 
-    if (fl->fileDescriptor != -1) {
-        VERBOSE_PRINT(do_verbose, "File is still open, close it before removing!\n");
-        return ret;
+    const map<VMSizeT, Extent>& get() const {
+        return extents;
     }
-    // Delete both the actual file and the log file
-    auto file_path = fs::path(gtfs->dirname) / fl->filename;
-    auto log_path = fs::path(gtfs->dirname) / (fl->filename + ".log");
-    ret = fs::remove(file_path);
-    // Log file may not have been created if no writes were synced, so ignore error
-    fs::remove(log_path);
 
-    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
-    return ret;
-}
+private:
+    map<VMSizeT, Extent> extents;
+};
 
-char* gtfs_read_file(gtfs_t* gtfs, file_t* fl, int offset, int length) {
-    char* ret_data = NULL;
-    if (gtfs and fl) {
-        VERBOSE_PRINT(do_verbose, "Reading " << length << " bytes starting from offset " << offset << " inside file " << fl->filename << "\n");
-    } else {
-        VERBOSE_PRINT(do_verbose, "GTFileSystem or file does not exist\n");
-        return NULL;
-    }
+// Extents of a checkpoint that are to be copied from the sidecar file of the log, positioned at sidecar offsets
+struct SidecarFile {};
 
-    if (fl->fileDescriptor == -1) {
-        VERBOSE_PRINT(do_verbose, "File is not open\n");
-        return ret_data;
-    }
-    
-    // Copy data from transaction manager's managed virtual memory segment into a string
-    // TransactionManager contains the most up-to-date data: synced writes before file open, and all synced and unsynced writes after file open
-    string data;
-    const auto vmBaseIt = fl->transactionManager->getVMBase().begin();
-    if (offset < fl->transactionManager->getVMBase().size()) {
-        auto vmIt = vmBaseIt + offset;
-        while (length-- && vmIt != fl->transactionManager->getVMBase().end()) {
-            data.push_back(*vmIt++);
+/** Copies the extents from the sidecar into the data file, inside the kernel where possible. Returns the bytes copied, or -1 */
+static ssize_t copy_sidecar_extents(const ExtentMap<SidecarFile>& extents, int sidecarFd, int dataFd) {
+    vector<char> buffer;
+    ssize_t copiedBytes = 0;
+    for (const auto& extent: extents.get()) {
+        loff_t from = extent.second.position, to = extent.first;
+        VMSizeT remaining = extent.second.length;
+        copiedBytes += remaining;
+        while (remaining > 0) {
+            ssize_t copied = copy_file_range(sidecarFd, &from, dataFd, &to, remaining, 0);
+            if (copied > 0) {
+                remaining -= copied;
+                continue;
+            }
+            if (copied == 0) {
+                return -1;
+            }
+            if (errno != ENOSYS && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP) {
+                return -1;
+            }
+            // No kernel copy between these files, go through user space
+            buffer.resize(min<VMSizeT>(remaining, 1 << 20));
+            ssize_t length = pread_full(sidecarFd, buffer.data(), min<VMSizeT>(remaining, buffer.size()), from);
+            if (length <= 0 || pwrite_full(dataFd, buffer.data(), length, to) != 0) {
+                return -1;
+            }
+            from += length;
+            to += length;
+            remaining -= length;
         }
     }
-    // Duplicate the string into a char* to return, string would be destructed on return. Caller is responsible for freeing the returned char*
-    ret_data = strdup(data.c_str());
-
-    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns pointer to data read.
-    return ret_data;
+    return copiedBytes;
 }
 
-write_t* gtfs_write_file(gtfs_t* gtfs, file_t* fl, int offset, int length, const char* data) {
-    write_t *write_id = NULL;
-    if (gtfs and fl) {
-        VERBOSE_PRINT(do_verbose, "Writting " << length << " bytes starting from offset " << offset << " inside file " << fl->filename << "\n");
-    } else {
-        VERBOSE_PRINT(do_verbose, "GTFileSystem or file does not exist\n");
-        return NULL;
-    }
+/** Feeds the transactions of a log, in log order, to the function it is given until that function returns false */
+using TransactionSource = function<void(const function<bool(const Transaction&)>&)>;
 
-    if (fl->fileDescriptor == -1) {
-        VERBOSE_PRINT(do_verbose, "File is not open\n");
-        return write_id;
+/**
+ * Replays the transactions on top of the data file contents and overwrites the data file with the result. Redo data kept
+ * in the sidecar file of the log is not read, its extents get copied from the sidecar into the data file instead.
+ * Returns -1 if the data file may not hold all the transactions, the log must then be kept
+ */
+static int checkpoint_file(const fs::path& originalFilePath, const TransactionSource& transactions, const gtfs_options_t& options) {
+    int fd = open(originalFilePath.c_str(), O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        VERBOSE_PRINT(do_verbose, "Failed to open " << originalFilePath << " for checkpoint\n");
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
     }
 
-    // Create a transaction in the transaction manager and attach the transactionId to the returned write_t
-    auto transactionId = fl->transactionManager->createTransaction(offset, length, data);
-    write_id = new write_t;
-    write_id->filename = fl->filename;
-    write_id->offset = offset;
-    write_id->length = length;
-    write_id->file = fl;
-    write_id->transactionId = transactionId;
-    
-    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns non NULL.
-    return write_id;
-}
-
-int gtfs_sync_write_file(write_t* write_id) {
-    int ret = -1;
-    if (write_id) {
-        VERBOSE_PRINT(do_verbose, "Persisting write of " << write_id->length << " bytes starting from offset " << write_id->offset << " inside file " << write_id->filename << "\n");
-    } else {
-        VERBOSE_PRINT(do_verbose, "Write operation does not exist\n");
-        return ret;
+    // Replay all log transactions on top of the actual file on disk, only the pages they touch get read
+    BaseTransactionManager transactionManager(fd, st.st_size);
+    ExtentMap<SidecarFile> extents;
+    int ret = 0;
+    transactions([&](const Transaction& transaction) {
+        if (transaction.external.length == 0) {
+            extents.cut(transaction);
+            ret = transactionManager.replayTransaction(transaction);
+            return ret == 0;
+        }
+        // Only make room for the extent in the segment
+        auto& segment = transactionManager.getVMSegment();
+        if (transaction.redoEnd() > segment.size() && segment.resize(transaction.redoEnd()) == -1) {
+            ret = -1;
+            return false;
+        }
+        extents.place(transaction, SidecarFile(), transaction.external.sidecarOffset);
+        return true;
+    });
+    if (ret != 0) {
+        VERBOSE_PRINT(do_verbose, "Failed to apply the log to checkpoint " << originalFilePath << "\n");
+        close(fd);
+        return -1;
     }
 
-    // Use the transactionId and commit the transaction to log file via transaction manager
-    if (write_id-> file == nullptr || write_id->file->transactionManager == nullptr) {
-        VERBOSE_PRINT(do_verbose, "File is not open\n");
-        return ret;
+    auto& updated = transactionManager.getVMSegment();
+    int directFd = options.directIO ? open_direct(originalFilePath) : -1;
+    // Only the pages the log changed get overwritten, through aligned buffers with direct I/O
+    ssize_t written = updated.writeBack(directFd);
+    if (directFd != -1) {
+        close(directFd);
     }
-    ret = write_id->file->transactionManager->commitTransaction(write_id->transactionId);
-
-    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns number of bytes written.
-    return ret;
-}
-
-int gtfs_abort_write_file(write_t* write_id) {
-    int ret = -1;
-    if (write_id) {
-        VERBOSE_PRINT(do_verbose, "Aborting write of " << write_id->length << " bytes starting from offset " << write_id->offset << " inside file " << write_id->filename << "\n");
+    if (written == -1) {
+        VERBOSE_PRINT(do_verbose, "Write of checkpoint " << originalFilePath << " failed\n");
+        ret = -1;
     } else {
-        VERBOSE_PRINT(do_verbose, "Write operation does not exist\n");
-        return ret;
+        writeCounters.checkpointBytes += written;
     }
-
-    // Abort the transaction via transaction manager (works if transaction is not committed yet)
-    if (write_id-> file == nullptr || write_id->file->transactionManager == nullptr) {
-        VERBOSE_PRINT(do_verbose, "File is not open\n");
-        return ret;
+    if (ret == 0 && !extents.get().empty()) {
+        int sidecarFd = open(LogManager::getSidecarPath(originalFilePath.string() + ".log").c_str(), O_RDONLY | O_CLOEXEC);
+        ssize_t copied = sidecarFd == -1 ? -1 : copy_sidecar_extents(extents, sidecarFd, fd);
+        if (copied == -1) {
+            VERBOSE_PRINT(do_verbose, "Copy of sidecar extents into checkpoint " << originalFilePath << " failed\n");
+            ret = -1;
+        } else {
+            writeCounters.checkpointBytes += copied;
+        }
+        if (sidecarFd != -1) {
+            close(sidecarFd);
+        }
     }
-    ret = write_id->file->transactionManager->abortTransaction(write_id->transactionId);
-
-    VERBOSE_PRINT(do_verbose, "Success.\n"); //On success returns 0.
+    close(fd);
     return ret;
 }
 
-// BONUS: Implement below API calls to get bonus credits
-
-int gtfs_clean_n_bytes(gtfs_t *gtfs, int bytes){
-    int ret = -1;
-    if (gtfs) {
-        VERBOSE_PRINT(do_verbose, "Cleaning up [ " << bytes << " bytes ] GTFileSystem inside directory " << gtfs->dirname << "\n");
-    } else {
-        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
-        return ret;
-    }
+static int checkpoint_file(const fs::path& originalFilePath, const vector<Transaction>& transactions, const gtfs_options_t& options) {
+    return checkpoint_file(originalFilePath, [&](const function<bool(const Transaction&)>& apply) {
+        for (const auto& transaction: transactions) {
+            if (!apply(transaction)) {
+                break;
+            }
+        }
+    }, options);
+}
 
-    // Iterate through each log file in the directory and apply the transactions to the corresponding actual file
-    // Pass the number of bytes to clean: will clean `bytes` bytes from each log file, not just the first one
-    for (auto& p: fs::directory_iterator(gtfs->dirname)) {
-        if (fs::is_regular_file(p) && p.path().extension() == ".log") {
-            if (clean_n_bytes(p.path(), bytes) != 0) {
-                ret = -2;
+/**
+ * Segmented log flavour of clean_n_bytes(): applies whole segments, oldest first, as long as their redo bytes fit in `bytes`
+ * (all segments if `bytes` is -1). Applied segments are dropped by advancing the manifest, the rest of the log is kept.
+ */
+static int clean_segments(const fs::path& logFilePath, uint64_t firstSegment, uint64_t lastSegment, int64_t bytes, const gtfs_options_t& options) {
+    vector<Transaction> transactions;
+    uint64_t segment = firstSegment;
+    for (; segment <= lastSegment; ++segment) {
+        // Sidecar extents get copied by the checkpoint, they are not loaded
+        vector<Transaction> segmentTransactions;
+        if (!LogManager::forEachTransaction(LogManager::getSegmentPath(logFilePath, segment), [&](Transaction& transaction) {
+            segmentTransactions.push_back(move(transaction));
+            return true;
+        }, false, false)) {
+            // Segments from a damaged one on are kept, with it, for gtfs_verify() to report
+            VERBOSE_PRINT(do_verbose, "Segment " << segment << " of log file " << logFilePath << " could not be read or is corrupted\n");
+            break;
+        }
+        VMSizeT segmentBytes = 0;
+        for (const auto& transaction: segmentTransactions) {
+            segmentBytes += transaction.redoSize();
+        }
+        if (bytes >= 0) {
+            if (segmentBytes > static_cast<VMSizeT>(bytes)) {
+                break;
             }
+            bytes -= segmentBytes;
         }
+        move(segmentTransactions.begin(), segmentTransactions.end(), back_inserter(transactions));
     }
-
-    if (ret != -2) {
-        ret = 0;
+    VERBOSE_PRINT(do_verbose, "Cleaning " << segment - firstSegment << " of " << lastSegment - firstSegment + 1 << " segments of log file " << logFilePath << "\n");
+    if (segment == firstSegment) {
+        return 0;
+    }
+    if (checkpoint_file(original_file_path(logFilePath), transactions, options) != 0) {
+        VERBOSE_PRINT(do_verbose, "Checkpoint failed, keeping the segments of log file " << logFilePath << "\n");
+        return -1;
+    }
+
+    if (segment > lastSegment) {
+        if (!LogManager::removeLog(logFilePath)) {
+            return -1;
+        }
+        openFiles.checkpointed(original_file_path(logFilePath).string());
+        return 0;
+    }
+    // Advance the manifest first, so a crash leaves at most orphaned segment files and never a manifest pointing at missing ones
+    if (LogManager::writeSegmentManifest(logFilePath, segment, lastSegment) != 0) {
+        VERBOSE_PRINT(do_verbose, "Failed to update segment manifest " << logFilePath << "\n");
+        return -1;
+    }
+    for (uint64_t dropped = firstSegment; dropped < segment; ++dropped) {
+        fs::remove(LogManager::getSegmentPath(logFilePath, dropped));
+    }
+    return 0;
+}
+
+// Position of a record in a segmented log: its segment and its index among the records of that segment
+using RecordLocation = pair<uint64_t, uint64_t>;
+
+/**
+ * Log-structured flavour of clean_n_bytes(), see gtfs_options_t::logStructured. Builds the extent index of the log, i.e.
+ * which record holds the latest bytes of each range, then compacts segments oldest first while the live bytes make up
+ * less than options.compactionLiveRatio of the redo bytes in the log, and their size fits in `bytes` (-1 for no limit).
+ * The live bytes of the compacted segments get appended to the log as new records before the segments are dropped,
+ * the data file is left alone. The active segment is never compacted.
+ */
+static int compact_segments(const fs::path& logFilePath, uint64_t firstSegment, uint64_t lastSegment, int64_t bytes, const gtfs_options_t& options) {
+    ExtentMap<RecordLocation> index;
+    unordered_map<uint64_t, VMSizeT> segmentBytes, liveBytes;
+    VMSizeT totalBytes = 0, totalLiveBytes = 0;
+    for (uint64_t segment = firstSegment; segment <= lastSegment; ++segment) {
+        uint64_t record = 0;
+        // Which bytes are live cannot be told without the whole log
+        if (!LogManager::forEachTransaction(LogManager::getSegmentPath(logFilePath, segment), [&](Transaction& transaction) {
+            index.place(transaction, {segment, record++});
+            segmentBytes[segment] += transaction.redoSize();
+            totalBytes += transaction.redoSize();
+            return true;
+        }, false, false)) {
+            VERBOSE_PRINT(do_verbose, "Segment " << segment << " of log file " << logFilePath << " could not be read or is corrupted\n");
+            return -1;
+        }
+    }
+    for (const auto& extent: index.get()) {
+        liveBytes[extent.second.source.first] += extent.second.length;
+        totalLiveBytes += extent.second.length;
+    }
+
+    // Moving the live bytes of a segment leaves only its dead bytes out of the log
+    uint64_t segment = firstSegment;
+    for (; segment < lastSegment && totalLiveBytes < options.compactionLiveRatio * totalBytes; ++segment) {
+        if (bytes >= 0) {
+            if (segmentBytes[segment] > static_cast<VMSizeT>(bytes)) {
+                break;
+            }
+            bytes -= segmentBytes[segment];
+        }
+        totalBytes -= segmentBytes[segment] - liveBytes[segment];
+    }
+    VERBOSE_PRINT(do_verbose, "Compacting " << segment - firstSegment << " of " << lastSegment - firstSegment + 1 << " segments of log file "
+        << logFilePath << "\n");
+    if (segment == firstSegment) {
+        return 0;
+    }
+
+    // Extents still live in the compacted segments, by the record holding their bytes
+    map<RecordLocation, vector<pair<VMSizeT, ExtentMap<RecordLocation>::Extent>>> liveExtents;
+    for (const auto& extent: index.get()) {
+        if (extent.second.source.first < segment) {
+            liveExtents[extent.second.source].push_back(extent);
+        }
+    }
+    vector<Transaction> moved;
+    bool complete = true;
+    for (uint64_t compacted = firstSegment; compacted < segment && complete; ++compacted) {
+        uint64_t record = 0;
+        complete = LogManager::forEachTransaction(LogManager::getSegmentPath(logFilePath, compacted), [&](Transaction& transaction) {
+            auto extents = liveExtents.find({compacted, record++});
+            if (extents == liveExtents.end()) {
+                return true;
+            }
+            for (const auto& extent: extents->second) {
+                Transaction live;
+                live.transactionId = transaction.transactionId;
+                live.offset = extent.first;
+                auto data = transaction.newData.begin() + extent.second.position;
+                live.newData.assign(data, data + extent.second.length);
+                moved.push_back(move(live));
+            }
+            return true;
+        });
+    }
+    VMSizeT movedBytes = 0;
+    for (const auto& transaction: moved) {
+        movedBytes += transaction.newData.size();
+    }
+    if (!complete || LogManager::writeTransactions(logFilePath, moved, options) != 0) {
+        VERBOSE_PRINT(do_verbose, "Failed to move the live bytes of log file " << logFilePath << "\n");
+        return -1;
+    }
+    writeCounters.compactedBytes += movedBytes;
+
+    // The appends may have started new segments. Once the manifest moves past the compacted segments they are unreachable
+    if (!LogManager::readSegmentManifest(logFilePath, firstSegment, lastSegment)
+        || LogManager::writeSegmentManifest(logFilePath, segment, lastSegment) != 0) {
+        VERBOSE_PRINT(do_verbose, "Failed to update segment manifest " << logFilePath << "\n");
+        return -1;
+    }
+    for (uint64_t dropped = firstSegment; dropped < segment; ++dropped) {
+        fs::remove(LogManager::getSegmentPath(logFilePath, dropped));
+    }
+    return 0;
+}
+
+/**
+ * Processes the transactions in given log file, optionally truncating the processing to n bytes.
+ * Applies the transactions to the original file and deletes the log file.
+ * Segmented logs only drop the segments that were applied, see clean_segments(), or get compacted if options.logStructured
+ * is set, see compact_segments().
+ * Called from gtfs_clean() and gtfs_clean_n_bytes().
+ */ 
+int clean_n_bytes(const fs::path& logFilePath, int64_t bytes = -1, const gtfs_options_t& options = gtfs_options_t()) {
+    uint64_t firstSegment, lastSegment;
+    if (LogManager::readSegmentManifest(logFilePath, firstSegment, lastSegment)) {
+        return options.logStructured ? compact_segments(logFilePath, firstSegment, lastSegment, bytes, options)
+            : clean_segments(logFilePath, firstSegment, lastSegment, bytes, options);
+    }
+    // Apply the records as the log gets read, without holding them all in memory
+    RedoBudget budget{bytes};
+    uint64_t cleaned = 0;
+    bool intact = true, cutOff = false;
+    int checkpointed = checkpoint_file(original_file_path(logFilePath), [&](const function<bool(const Transaction&)>& apply) {
+        intact = LogManager::forEachTransaction(logFilePath, [&](Transaction& transaction) {
+            if (budget.exhausted() || !budget.take(transaction)) {
+                cutOff = true;
+                return false;
+            }
+            cleaned++;
+            return apply(transaction);
+        }, false, false);
+    }, options);
+    if (budget.bytes > 0) {
+        VERBOSE_PRINT(do_verbose, "Not enough transactions to clean " << budget.bytes << " bytes in log file " << logFilePath << "\n");
+    }
+    VERBOSE_PRINT(do_verbose, "Cleaning " << cleaned << " transactions in log file " << logFilePath << "\n");
+    if (!intact) {
+        // The records past the damage were not applied, the log stays for gtfs_verify() to report
+        VERBOSE_PRINT(do_verbose, "Log file " << logFilePath << " could not be read or has a corrupted record, keeping it\n");
+        return -1;
+    }
+    if (checkpointed != 0) {
+        VERBOSE_PRINT(do_verbose, "Checkpoint failed, keeping log file " << logFilePath << "\n");
+        return -1;
+    }
+
+    // Delete the log file, along with its sidecar file
+    if (!LogManager::removeLog(logFilePath)) {
+        VERBOSE_PRINT(do_verbose, "Failed to delete log file " << logFilePath << "\n");
+        return -1;
+    }
+    // The records left out by `bytes` are dropped, the data file lacks them
+    if (!cutOff) {
+        openFiles.checkpointed(original_file_path(logFilePath).string());
+    }
+    return 0;
+}
+
+/*
+ * The dirty file manifest (.gtfs.dirty) lists the data files that may have a log, one name per line, so that cleans visit
+ * those instead of scanning the directory. A file is listed before its log gets created and unlisted once a clean removed
+ * its log. Updates are serialized by a lock on the directory, held by a commit until the log it starts exists.
+ */
+
+/** Takes the lock on the dirty file manifest of `dirname`. Returns the locked descriptor, to close to release it, or -1 */
+static int lock_dirty_manifest(const fs::path& dirname) {
+    int fd = open(dirname.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd != -1 && flock(fd, LOCK_EX) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/** Replaces the dirty file manifest of `dirname`, through a temporary file renamed over it */
+static int write_dirty_manifest(const fs::path& dirname, const vector<string>& fileNames) {
+    fs::path manifestPath = dirname / DIRTY_MANIFEST_NAME;
+    fs::path tempPath = manifestPath.string() + ".tmp";
+    ofstream manifest(tempPath, ios::binary | ios::trunc);
+    if (!manifest.is_open()) {
+        return -1;
+    }
+    manifest << DIRTY_MANIFEST_MAGIC;
+    for (const auto& fileName: fileNames) {
+        manifest << fileName << "\n";
+    }
+    manifest.close();
+    error_code ec;
+    fs::rename(tempPath, manifestPath, ec);
+    return ec ? -1 : 0;
+}
+
+/**
+ * Reads the dirty file manifest of `dirname` into `fileNames`, without duplicates. A missing manifest (a directory written
+ * before manifests existed, or a lost one) is rebuilt by scanning the directory for logs. The caller holds the manifest lock.
+ */
+static int read_dirty_manifest(const fs::path& dirname, vector<string>& fileNames) {
+    fileNames.clear();
+    ifstream manifest(dirname / DIRTY_MANIFEST_NAME, ios::binary);
+    if (!manifest.is_open()) {
+        VERBOSE_PRINT(do_verbose, "Rebuilding dirty file manifest of " << dirname << "\n");
+        for (auto& p: fs::directory_iterator(dirname)) {
+            if (fs::is_regular_file(p) && p.path().extension() == ".log") {
+                fileNames.push_back(p.path().stem().string());
+            }
+        }
+        return write_dirty_manifest(dirname, fileNames);
+    }
+    string line;
+    getline(manifest, line);
+    // A torn last line names no file with a log, reading it does no harm
+    while (getline(manifest, line)) {
+        if (!line.empty()) {
+            fileNames.push_back(line);
+        }
+    }
+    sort(fileNames.begin(), fileNames.end());
+    fileNames.erase(unique(fileNames.begin(), fileNames.end()), fileNames.end());
+    return 0;
+}
+
+/** Lists `fileName` in the dirty file manifest of `dirname`. The caller holds the manifest lock */
+static int list_dirty_file(const fs::path& dirname, const string& fileName) {
+    fs::path manifestPath = dirname / DIRTY_MANIFEST_NAME;
+    if (!fs::exists(manifestPath)) {
+        vector<string> fileNames;
+        if (read_dirty_manifest(dirname, fileNames) != 0) {
+            return -1;
+        }
+    }
+    int fd = open(manifestPath.c_str(), O_RDWR | O_APPEND);
+    if (fd == -1) {
+        return -1;
+    }
+    // Start a new line if a crash tore the last one
+    string line = fileName + "\n";
+    char last;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0 && pread(fd, &last, 1, st.st_size - 1) == 1 && last != '\n') {
+        line = "\n" + line;
+    }
+    int ret = write(fd, line.data(), line.size()) == static_cast<ssize_t>(line.size()) ? 0 : -1;
+    close(fd);
+    return ret;
+}
+
+/** Returns the files of the directory that may have a log to clean */
+static vector<string> get_dirty_files(const fs::path& dirname) {
+    vector<string> fileNames;
+    int lockFd = lock_dirty_manifest(dirname);
+    if (lockFd == -1 || read_dirty_manifest(dirname, fileNames) != 0) {
+        VERBOSE_PRINT(do_verbose, "Failed to read dirty file manifest of " << dirname << "\n");
+    }
+    if (lockFd != -1) {
+        close(lockFd);
+    }
+    return fileNames;
+}
+
+/** Unlists the files among `cleaned` whose log is gone. Files committed to since they got cleaned have a log again and stay */
+static int prune_dirty_files(const fs::path& dirname, const vector<string>& cleaned) {
+    int lockFd = lock_dirty_manifest(dirname);
+    if (lockFd == -1) {
+        return -1;
+    }
+    vector<string> fileNames, kept;
+    int ret = read_dirty_manifest(dirname, fileNames);
+    if (ret == 0) {
+        for (const auto& fileName: fileNames) {
+            if (!binary_search(cleaned.begin(), cleaned.end(), fileName) || fs::exists(dirname / (fileName + ".log"))) {
+                kept.push_back(fileName);
+            }
+        }
+        if (kept.size() != fileNames.size()) {
+            ret = write_dirty_manifest(dirname, kept);
+        }
+    }
+    close(lockFd);
+    return ret;
+}
+
+/** Cleans the logs of the files listed in the dirty file manifest, see clean_n_bytes() */
+static int clean_dirty_files(gtfs_t* gtfs, int64_t bytes) {
+    int ret = 0;
+    auto dirtyFiles = get_dirty_files(gtfs->dirname);
+    for (const auto& fileName: dirtyFiles) {
+        auto logFilePath = fs::path(gtfs->dirname) / (fileName + ".log");
+        if (fs::exists(logFilePath) && clean_n_bytes(logFilePath, bytes, gtfs->options) != 0) {
+            ret = -1;
+        }
+    }
+    if (prune_dirty_files(gtfs->dirname, dirtyFiles) != 0) {
+        VERBOSE_PRINT(do_verbose, "Failed to update dirty file manifest of " << gtfs->dirname << "\n");
+        ret = -1;
+    }
+    return ret;
+}
+
+/** Returns the shared log of the directory, setting it up on first use */
+static shared_ptr<SharedLog> get_shared_log(gtfs_t* gtfs) {
+    if (!gtfs->sharedLog) {
+        gtfs->sharedLog = make_shared<SharedLog>(gtfs->dirname);
+    }
+    return gtfs->sharedLog;
+}
+
+/** Checkpoints the shared log if the directory has one, even if options.sharedLog was switched off since */
+static int clean_shared_log(gtfs_t* gtfs, int64_t bytes) {
+    if (!fs::exists(fs::path(gtfs->dirname) / SHARED_LOG_NAME)) {
+        return 0;
+    }
+    return get_shared_log(gtfs)->clean(bytes, gtfs->options);
+}
+
+/** Returns a token identifying the state of a file, changing whenever it is modified */
+static string stat_version(const struct stat& st) {
+    return to_string(st.st_dev) + ":" + to_string(st.st_ino) + ":" + to_string(st.st_size) + ":" + to_string(st.st_mtim.tv_sec) + "." + to_string(st.st_mtim.tv_nsec)
+        + ":" + to_string(st.st_ctim.tv_sec) + "." + to_string(st.st_ctim.tv_nsec);
+}
+
+static string path_version(const fs::path& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? stat_version(st) : "-";
+}
+
+/** Returns the version of an open data file and of the log records it has, to validate its cached contents with */
+static string cache_version(gtfs_t* gtfs, const fs::path& filePath, int fileDescriptor) {
+    struct stat st;
+    if (fstat(fileDescriptor, &st) == -1) {
+        return "";
+    }
+    auto logFilePath = filePath.string() + ".log";
+    string version = stat_version(st) + "|" + path_version(logFilePath);
+    uint64_t firstSegment, lastSegment;
+    if (LogManager::readSegmentManifest(logFilePath, firstSegment, lastSegment)) {
+        version += "|" + path_version(LogManager::getSegmentPath(logFilePath, lastSegment));
+    }
+    if (gtfs->options.sharedLog) {
+        version += "|" + get_shared_log(gtfs)->getPosition(filePath.filename().string());
+    }
+    return version;
+}
+
+int gtfs_clean(gtfs_t *gtfs) {
+    int ret = -1;
+    if (gtfs) {
+        VERBOSE_PRINT(do_verbose, "Cleaning up GTFileSystem inside directory " << gtfs->dirname << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
+        return ret;
+    }
+
+    // Apply the transactions of each log file to the corresponding actual file, visiting only the files listed as dirty
+    auto cleanerSuspended = gtfs->cleaner->suspend();
+    if (clean_dirty_files(gtfs, -1) != 0) {
+        ret = -2;
+    }
+    // The shared log goes last, its records are newer than those of per-file logs left from before it was enabled
+    if (clean_shared_log(gtfs, -1) != 0) {
+        ret = -2;
+    }
+
+    if (ret != -2) {
+        ret = 0;
     }
 
     VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
     return ret;
 }
 
-int gtfs_sync_write_file_n_bytes(write_t* write_id, int bytes){
+/**
+ * Rewrites a log written before records had checksums in the current format, so that its records get checked from now on
+ * and a torn append can no longer pass for a legacy record. The caller holds the file lock
+ */
+static void upgrade_legacy_log(const fs::path& logFilePath) {
+    int fd = open(logFilePath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return;
+    }
+    bool legacy = LogManager::isLegacyLog(fd);
+    close(fd);
+    if (!legacy) {
+        return;
+    }
+    string records;
+    if (!LogManager::forEachTransaction(logFilePath, [&](Transaction& transaction) {
+        records += LogManager::encodeTransaction(transaction);
+        return true;
+    })) {
+        return;
+    }
+    fs::path tempPath = logFilePath.string() + ".tmp";
+    ofstream log(tempPath, ios::binary | ios::trunc);
+    if (!log.is_open() || !log.write(records.data(), records.size())) {
+        VERBOSE_PRINT(do_verbose, "Failed to upgrade legacy log " << logFilePath << "\n");
+        return;
+    }
+    log.close();
+    error_code ec;
+    fs::rename(tempPath, logFilePath, ec);
+    VERBOSE_PRINT(do_verbose, (ec ? "Failed to upgrade" : "Upgraded") << " legacy log " << logFilePath << "\n");
+}
+
+// Redo bytes of the log records replayed together when a file gets opened
+#define REPLAY_BATCH_BYTES (64 << 20)
+
+file_t* gtfs_open_file(gtfs_t* gtfs, string filename, int fileLength) {
+    return gtfs_open_file64(gtfs, filename, fileLength);
+}
+
+file_t* gtfs_open_file64(gtfs_t* gtfs, string filename, off_t fileLength) {
+    file_t *fl = NULL;
+    if (gtfs) {
+        VERBOSE_PRINT(do_verbose, "Opening file " << filename << " inside directory " << gtfs->dirname << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
+        return NULL;
+    }
+    
+    if (filename.length() == 0) {
+        VERBOSE_PRINT(do_verbose, "Filename is empty, returning nullptr\n");
+        return fl;
+    }
+    auto file_path = fs::path(gtfs->dirname) / filename;
+    // Open (creating it if it does not exist) relative to the directory, without blocking on special files
+    int fileDescriptor = openat(gtfs->directoryFd, filename.c_str(), O_RDWR | O_CREAT | O_NONBLOCK | O_CLOEXEC, 0644);
+    if (fileDescriptor == -1) {
+        VERBOSE_PRINT(do_verbose, "Failed to open file\n");
+        return fl;
+    }
+    struct stat st;
+    if (fstat(fileDescriptor, &st) == -1 || !S_ISREG(st.st_mode)) {
+        VERBOSE_PRINT(do_verbose, "File name exists but is not a regular file, returning nullptr\n");
+        close(fileDescriptor);
+        return fl;
+    }
+    // Lock file using flock, before looking at its size so that no other process changes it in between
+    if (flock(fileDescriptor, LOCK_EX | LOCK_NB) == -1) {
+        VERBOSE_PRINT(do_verbose, "Failed to lock file\n");
+        close(fileDescriptor);
+        return fl;
+    }
+
+    if (fileLength < st.st_size) {
+        VERBOSE_PRINT(do_verbose, "File length is less than the size of the file, not allowed!\n");
+        close(fileDescriptor);
+        return fl;
+    } else if (fileLength > st.st_size) {
+        VERBOSE_PRINT(do_verbose, "File length is greater than the size of the file, extending file\n");
+        // Extend file to fileLength, the extension is a hole unless the blocks are to be preallocated
+        bool preallocated = gtfs->options.preallocate && fallocate(fileDescriptor, 0, st.st_size, fileLength - st.st_size) == 0;
+        if (!preallocated && ftruncate(fileDescriptor, fileLength) == -1) {
+            VERBOSE_PRINT(do_verbose, "Failed to extend file\n");
+            close(fileDescriptor);
+            return fl;
+        }
+    }
+
+    fl = new file_t;
+    fl->filename = filename;
+    fl->fileLength = fileLength;
+    fl->fileDescriptor = fileDescriptor;
+    // Log-structured files keep their commits in their own log segments
+    auto sharedLog = gtfs->options.sharedLog && !gtfs->options.logStructured ? get_shared_log(gtfs) : nullptr;
+    gtfs->memoryBudget->setLimit(gtfs->options.memoryBudget);
+    // The file contents get read page by page as they are accessed
+    fl->transactionManager = make_unique<TransactionManager>(file_path, fileDescriptor, fileLength, gtfs->options, sharedLog, gtfs->memoryBudget,
+        gtfs->replicator);
+    // Reuse the contents the file had when it was last closed if neither the file nor its logs changed since
+    bool cached = bufferCache.isEnabled()
+        && bufferCache.take(file_path.string(), cache_version(gtfs, file_path, fileDescriptor), fl->transactionManager->getVMSegment());
+    if (cached) {
+        VERBOSE_PRINT(do_verbose, "Using cached contents, skipping read and replay\n");
+        // The cached contents may have grown past the length the file is opened with through commits
+        fl->transactionManager->adoptSegmentSize();
+    } else {
+        // Drop a torn tail left by a crash mid-append (we hold the exclusive lock), otherwise records appended after it would be unreachable
+        // Records get replayed in batches, each applied by several threads if large enough, see replayTransactions()
+        auto& transactionManager = *fl->transactionManager;
+        vector<Transaction> batch;
+        VMSizeT batchBytes = 0;
+        bool replayed = true;
+        bool intact = LogManager::forEachTransaction(transactionManager.getLogFilePath(), [&](Transaction& transaction) {
+            batchBytes += transaction.newData.size();
+            batch.push_back(move(transaction));
+            if (batchBytes >= REPLAY_BATCH_BYTES) {
+                replayed = transactionManager.replayTransactions(batch) == 0;
+                batch.clear();
+                batchBytes = 0;
+            }
+            return replayed;
+        }, true);
+        if (!intact) {
+            // Opening would hide the records past the damage, and the next commit would append after them
+            VERBOSE_PRINT(do_verbose, "Log of file " << filename << " could not be read or has a corrupted record, see gtfs_verify()\n");
+            close(fileDescriptor);
+            delete fl;
+            return NULL;
+        }
+        replayed = replayed && transactionManager.replayTransactions(batch) == 0
+            && (!sharedLog || transactionManager.replayTransactions(sharedLog->getTransactions(filename)) == 0);
+        if (!replayed) {
+            // Same as a damaged log, the file would miss records the next commit appends after
+            VERBOSE_PRINT(do_verbose, "Failed to replay the log of file " << filename << "\n");
+            close(fileDescriptor);
+            delete fl;
+            return NULL;
+        }
+        upgrade_legacy_log(transactionManager.getLogFilePath());
+    }
+    openFiles.add(file_path.string(), fl->transactionManager.get());
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns non NULL.
+    return fl;
+}
+
+// Logs are read in chunks of this size, the next chunk being read on an I/O thread while the previous one gets applied
+#define READ_AHEAD_CHUNK_SIZE (4 << 20)
+// Room in front of each chunk for the start of a record left over from the previous chunk
+#define READ_AHEAD_CARRY_ROOM (64 << 10)
+
+/** Loads redo data kept in the sidecar file of the log into the transaction, which then holds it like any other record */
+static bool load_external_redo(const fs::path& logFilePath, Transaction& transaction) {
+    int fd = open(LogManager::getSidecarPath(logFilePath).c_str(), O_RDONLY | O_CLOEXEC);
+    transaction.newData.resize(transaction.external.length);
+    bool loaded = fd != -1
+        && pread_full(fd, transaction.newData.data(), transaction.newData.size(), transaction.external.sidecarOffset) == static_cast<ssize_t>(transaction.newData.size())
+        && crc32c(0, transaction.newData.data(), transaction.newData.size()) == transaction.external.checksum;
+    if (fd != -1) {
+        close(fd);
+    }
+    if (!loaded) {
+        VERBOSE_PRINT(do_verbose, "Sidecar redo data of a record of " << logFilePath << " is missing or corrupted\n");
+        return false;
+    }
+    transaction.external = ExternalRedo();
+    return true;
+}
+
+/**
+ * Reads `fd` sequentially from `offset` on and hands it to `consume` chunk by chunk, with READ_AHEAD_CARRY_ROOM bytes
+ * of the buffer in front of each chunk free for its use. While `consume` works on a chunk, an I/O thread reads the next
+ * one into a second buffer and asks the kernel for the one after (files of a single chunk are read inline). `consume`
+ * returns false to stop early. Returns false on a read error.
+ */
+static bool read_ahead(int fd, off_t offset, const function<bool(char*, size_t)>& consume) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        return false;
+    }
+    posix_fadvise(fd, offset, 0, POSIX_FADV_SEQUENTIAL);
+    if (st.st_size - offset <= READ_AHEAD_CHUNK_SIZE) {
+        vector<char> buffer(READ_AHEAD_CARRY_ROOM + max<off_t>(st.st_size - offset, 0));
+        ssize_t length = pread_full(fd, buffer.data() + READ_AHEAD_CARRY_ROOM, buffer.size() - READ_AHEAD_CARRY_ROOM, offset);
+        if (length > 0) {
+            consume(buffer.data() + READ_AHEAD_CARRY_ROOM, length);
+        }
+        return length != -1;
+    }
+
+    // Each buffer goes back and forth between the I/O thread (not filled) and the consumer (filled, length 0 at the end)
+    struct Buffer {
+        vector<char> data = vector<char>(READ_AHEAD_CARRY_ROOM + READ_AHEAD_CHUNK_SIZE);
+        size_t length = 0;
+        bool filled = false;
+    } buffers[2];
+    mutex bufferMutex;
+    condition_variable bufferChanged;
+    bool stopped = false, failed = false;
+    thread reader([&]() {
+        for (int i = 0;; i ^= 1) {
+            unique_lock<mutex> lock(bufferMutex);
+            bufferChanged.wait(lock, [&]() { return stopped || !buffers[i].filled; });
+            if (stopped) {
+                return;
+            }
+            lock.unlock();
+            posix_fadvise(fd, offset + READ_AHEAD_CHUNK_SIZE, READ_AHEAD_CHUNK_SIZE, POSIX_FADV_WILLNEED);
+            ssize_t length = pread_full(fd, buffers[i].data.data() + READ_AHEAD_CARRY_ROOM, READ_AHEAD_CHUNK_SIZE, offset);
+            lock.lock();
+            failed = length == -1;
+            buffers[i].length = max<ssize_t>(length, 0);
+            buffers[i].filled = true;
+            bufferChanged.notify_all();
+            if (length <= 0) {
+                return;
+            }
+            offset += length;
+        }
+    });
+    for (int i = 0;; i ^= 1) {
+        unique_lock<mutex> lock(bufferMutex);
+        bufferChanged.wait(lock, [&]() { return buffers[i].filled; });
+        size_t length = buffers[i].length;
+        lock.unlock();
+        bool more = length > 0 && consume(buffers[i].data.data() + READ_AHEAD_CARRY_ROOM, length);
+        lock.lock();
+        buffers[i].filled = false;
+        stopped = !more;
+        bufferChanged.notify_all();
+        if (stopped) {
+            break;
+        }
+    }
+    reader.join();
+    return !failed;
+}
+
+/** How a replay of a single log file ended, see replay_log_file() */
+enum class ReplayEnd { COMPLETE, TORN_TAIL, CORRUPTED, STOPPED, READ_ERROR };
+
+/**
+ * Decodes the record at `data` like LogManager::decodeTransaction(), falling back to the record format without checksums
+ * in `legacy` logs (their old records, followed by the ones appended since). `atEnd` tells whether the log ends with `data`
+ */
+static size_t decode_log_record(const char* data, size_t size, bool legacy, bool atEnd, Transaction& transaction, size_t* minimumSize = nullptr) {
+    size_t recordSize = LogManager::decodeTransaction(data, size, transaction, 0, minimumSize);
+    if (!legacy || (recordSize != 0 && recordSize != LogManager::CORRUPT_RECORD)) {
+        return recordSize;
+    }
+    size_t legacySize = LogManager::decodeLegacyTransaction(data, size, atEnd, transaction);
+    // A record with a checksum cut short is incomplete, even if it does not parse as a legacy one
+    return recordSize == 0 && legacySize == LogManager::CORRUPT_RECORD ? 0 : legacySize;
+}
+
+/**
+ * Tells whether the log at `fd` goes on after the corrupted record at `offset`. A crash mid-append leaves a record without
+ * its terminating newline, possibly followed by zeros where blocks did not get written, which is not worth keeping
+ */
+static bool log_continues_after(int fd, off_t offset) {
+    vector<char> buffer(64 << 10);
+    bool terminated = false;
+    ssize_t length;
+    while ((length = pread(fd, buffer.data(), buffer.size(), offset)) > 0) {
+        for (ssize_t i = 0; i < length; ++i) {
+            if (terminated && buffer[i] != '\0') {
+                return true;
+            }
+            terminated = terminated || buffer[i] == '\n';
+        }
+        offset += length;
+    }
+    // Do not risk dropping records that could not be read
+    return length == -1;
+}
+
+/**
+ * Decodes the records of the log file at `logFilePath` from byte `fromOffset` on and hands them to `apply` as the read-ahead
+ * delivers them, moving `fromOffset` past each record applied. A tail that cannot be a complete record (a torn append) is
+ * truncated with `dropTornTail`. A corrupted record that more of the log follows ends the replay with CORRUPTED and is
+ * left in place. Sets `logInode`, if given, to the inode of the file read (0 if there is none).
+ */
+static ReplayEnd replay_log_file(const fs::path& logFilePath, uint64_t& fromOffset, const function<bool(Transaction&)>& apply, bool dropTornTail,
+    uint64_t* logInode = nullptr) {
+    int fd = open(logFilePath.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (logInode) {
+        *logInode = fd != -1 && fstat(fd, &st) == 0 ? st.st_ino : 0;
+    }
+    if (fd == -1) {
+        return errno == ENOENT ? ReplayEnd::COMPLETE : ReplayEnd::READ_ERROR;
+    }
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return ReplayEnd::READ_ERROR;
+    }
+    bool legacy = LogManager::isLegacyLog(fd);
+    // Bytes of a record cut by the end of a chunk, put back in front of the next chunk. Those of a record larger than the
+    // room there get gathered in `carry` itself, which is sized for the whole record once its header is in
+    vector<char> carry;
+    Transaction transaction;
+    bool stopped = false, corrupted = false;
+    uint64_t readOffset = fromOffset;
+    bool readOk = read_ahead(fd, fromOffset, [&](char* chunk, size_t length) {
+        char* data = chunk;
+        size_t size = length;
+        readOffset += length;
+        bool gathering = carry.size() > READ_AHEAD_CARRY_ROOM;
+        if (gathering) {
+            carry.insert(carry.end(), chunk, chunk + length);
+            data = carry.data();
+            size = carry.size();
+        } else if (!carry.empty()) {
+            data = chunk - carry.size();
+            memcpy(data, carry.data(), carry.size());
+            size += carry.size();
+        }
+        bool atEnd = readOffset >= static_cast<uint64_t>(st.st_size);
+        size_t position = 0, minimumSize = 0;
+        while (position < size) {
+            size_t recordSize = decode_log_record(data + position, size - position, legacy, atEnd, transaction, &minimumSize);
+            if (recordSize == LogManager::CORRUPT_RECORD) {
+                corrupted = true;
+                break;
+            }
+            if (recordSize == 0) {
+                break;
+            }
+            position += recordSize;
+            fromOffset += recordSize;
+            minimumSize = 0;
+            if (!apply(transaction)) {
+                stopped = true;
+                return false;
+            }
+        }
+        if (corrupted) {
+            return false;
+        }
+        // Only the bytes past the last whole record are kept, the gathered ones stay where they are
+        if (gathering) {
+            carry.erase(carry.begin(), carry.begin() + position);
+        } else {
+            carry.assign(data + position, data + size);
+        }
+        // A corrupted size must not make us reserve more than the file holds
+        if (minimumSize > carry.size()) {
+            carry.reserve(min<uint64_t>(minimumSize, max<uint64_t>(st.st_size, readOffset) - fromOffset));
+        }
+        return true;
+    });
+    bool tail = corrupted || !carry.empty();
+    // Legacy records have no terminator to tell a torn append from a corrupted record by, keep them all
+    corrupted = corrupted && (legacy || log_continues_after(fd, fromOffset));
+    close(fd);
+    if (stopped) {
+        return ReplayEnd::STOPPED;
+    }
+    if (!readOk) {
+        return ReplayEnd::READ_ERROR;
+    }
+    if (corrupted) {
+        VERBOSE_PRINT(do_verbose, "Corrupted record at offset " << fromOffset << " in " << logFilePath << ", followed by "
+            << st.st_size - fromOffset << " more bytes of log\n");
+        return ReplayEnd::CORRUPTED;
+    }
+    if (tail) {
+        VERBOSE_PRINT(do_verbose, "Ignoring torn log tail of " << readOffset - fromOffset << " bytes at offset " << fromOffset << " in " << logFilePath << "\n");
+        if (dropTornTail) {
+            fs::resize_file(logFilePath, fromOffset);
+        }
+        return ReplayEnd::TORN_TAIL;
+    }
+    return ReplayEnd::COMPLETE;
+}
+
+/**
+ * Replays the intact records of the log at `logFilePath` from byte `fromOffset` on, and moves `fromOffset` past them.
+ * Sets `logInode` to the log's (0 if there is none). Returns -1 on failure
+ */
+static int replay_log_from(TransactionManager& transactionManager, const fs::path& logFilePath, uint64_t& logInode, uint64_t& fromOffset) {
+    // A record still being appended looks like a torn tail, it is left for the next refresh
+    bool replayed = true;
+    auto end = replay_log_file(logFilePath, fromOffset, [&](Transaction& transaction) {
+        replayed = (transaction.external.length == 0 || load_external_redo(logFilePath, transaction))
+            && transactionManager.replayTransaction(transaction) == 0;
+        return replayed;
+    }, false, &logInode);
+    return end == ReplayEnd::READ_ERROR || end == ReplayEnd::CORRUPTED || !replayed ? -1 : 0;
+}
+
+/** Builds the view of a read-only file from its data file and logs, see build_readonly_view() */
+static int load_readonly_view(gtfs_t* gtfs, file_t* fl) {
+    struct stat st;
+    if (fstat(fl->fileDescriptor, &st) == -1) {
+        return -1;
+    }
+    auto file_path = fs::path(gtfs->dirname) / fl->filename;
+    fl->fileLength = st.st_size;
+    fl->dataVersion = stat_version(st);
+    fl->transactionManager = make_unique<TransactionManager>(file_path, fl->fileDescriptor, st.st_size, gtfs->options, nullptr, gtfs->memoryBudget);
+    // A writer's clean rewrites the data file in place, pages must not be read from it past that point
+    fl->transactionManager->getVMSegment().pinDataVersion(fl->dataVersion);
+    fl->logOffset = 0;
+    auto logFilePath = fl->transactionManager->getLogFilePath();
+    uint64_t firstSegment, lastSegment;
+    // Segmented and shared logs are read whole, only a plain log can be followed from where the last read stopped
+    bool hasSharedLog = gtfs->options.sharedLog || fs::exists(fs::path(gtfs->dirname) / SHARED_LOG_NAME);
+    fl->incrementalRefresh = !hasSharedLog && !LogManager::readSegmentManifest(logFilePath, firstSegment, lastSegment);
+    if (!fl->incrementalRefresh) {
+        fl->transactionManager->replayTransactions(LogManager::getTransactionsInLog(logFilePath));
+        if (hasSharedLog) {
+            fl->transactionManager->replayTransactions(get_shared_log(gtfs)->getTransactions(fl->filename));
+        }
+        return 0;
+    }
+    return replay_log_from(*fl->transactionManager, logFilePath, fl->logInode, fl->logOffset);
+}
+
+// Loads of a read-only view made before giving up on a data file that keeps changing meanwhile
+#define READONLY_VIEW_ATTEMPTS 3
+
+/**
+ * (Re)builds the view of a read-only file from its data file and logs. A clean may checkpoint the data file and drop
+ * the log while they are read, the view then gets loaded again from the new data file
+ */
+static int build_readonly_view(gtfs_t* gtfs, file_t* fl) {
+    for (int attempt = 1;; ++attempt) {
+        int ret = load_readonly_view(gtfs, fl);
+        struct stat st;
+        if (ret != 0 || attempt == READONLY_VIEW_ATTEMPTS || (fstat(fl->fileDescriptor, &st) == 0 && stat_version(st) == fl->dataVersion)) {
+            return ret;
+        }
+        VERBOSE_PRINT(do_verbose, "Data file changed while loading the view, loading it again\n");
+    }
+}
+
+file_t* gtfs_open_file_readonly(gtfs_t* gtfs, string filename) {
+    file_t *fl = NULL;
+    if (gtfs) {
+        VERBOSE_PRINT(do_verbose, "Opening file " << filename << " read-only inside directory " << gtfs->dirname << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
+        return NULL;
+    }
+
+    // No lock: the file may be open for writing in another process, and stays writable for it
+    int fileDescriptor = openat(gtfs->directoryFd, filename.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fileDescriptor == -1) {
+        VERBOSE_PRINT(do_verbose, "Failed to open file\n");
+        return fl;
+    }
+    struct stat st;
+    if (fstat(fileDescriptor, &st) == -1 || !S_ISREG(st.st_mode)) {
+        VERBOSE_PRINT(do_verbose, "File name exists but is not a regular file, returning nullptr\n");
+        close(fileDescriptor);
+        return fl;
+    }
+
+    fl = new file_t;
+    fl->filename = filename;
+    fl->fileDescriptor = fileDescriptor;
+    fl->readOnly = true;
+    gtfs->memoryBudget->setLimit(gtfs->options.memoryBudget);
+    if (build_readonly_view(gtfs, fl) != 0) {
+        VERBOSE_PRINT(do_verbose, "Failed to read log\n");
+        close(fileDescriptor);
+        delete fl;
+        return NULL;
+    }
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns non NULL.
+    return fl;
+}
+
+int gtfs_refresh_file(gtfs_t* gtfs, file_t* fl) {
+    int ret = -1;
+    if (gtfs and fl) {
+        VERBOSE_PRINT(do_verbose, "Refreshing file " << fl->filename << " inside directory " << gtfs->dirname << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem or file does not exist\n");
+        return ret;
+    }
+    if (fl->fileDescriptor == -1 || !fl->readOnly) {
+        VERBOSE_PRINT(do_verbose, "File is not open read-only\n");
+        return ret;
+    }
+
+    // A changed data file means a clean checkpointed records (or the writer extended it), the view starts over
+    struct stat st;
+    if (fstat(fl->fileDescriptor, &st) == -1) {
+        return ret;
+    }
+    if (!fl->incrementalRefresh || stat_version(st) != fl->dataVersion) {
+        VERBOSE_PRINT(do_verbose, "Rebuilding view\n");
+        ret = build_readonly_view(gtfs, fl);
+    } else {
+        // So does a log that was replaced or truncated since
+        uint64_t logInode = fl->logInode, logOffset = fl->logOffset;
+        ret = replay_log_from(*fl->transactionManager, fl->transactionManager->getLogFilePath(), logInode, logOffset);
+        if (ret == 0 && ((fl->logInode != 0 && logInode != fl->logInode) || logOffset < fl->logOffset)) {
+            VERBOSE_PRINT(do_verbose, "Rebuilding view\n");
+            ret = build_readonly_view(gtfs, fl);
+        } else {
+            fl->logInode = logInode;
+            fl->logOffset = logOffset;
+        }
+    }
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
+
+vector<file_t*> gtfs_open_files(gtfs_t* gtfs, const vector<string>& filenames, const vector<int>& fileLengths) {
+    return gtfs_open_files64(gtfs, filenames, vector<off_t>(fileLengths.begin(), fileLengths.end()));
+}
+
+vector<file_t*> gtfs_open_files64(gtfs_t* gtfs, const vector<string>& filenames, const vector<off_t>& fileLengths) {
+    vector<file_t*> files(filenames.size(), nullptr);
+    if (gtfs) {
+        VERBOSE_PRINT(do_verbose, "Opening " << filenames.size() << " files inside directory " << gtfs->dirname << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
+        return files;
+    }
+    if (fileLengths.size() != filenames.size()) {
+        VERBOSE_PRINT(do_verbose, "Got " << fileLengths.size() << " file lengths for " << filenames.size() << " files\n");
+        return files;
+    }
+
+    // Set up the state the opens share before they race for it
+    if (gtfs->options.sharedLog) {
+        get_shared_log(gtfs);
+    }
+    // Open the files in parallel, each worker picks the next unopened file
+    atomic<size_t> nextFile{0};
+    auto worker = [&]() {
+        for (size_t i = nextFile++; i < filenames.size(); i = nextFile++) {
+            files[i] = gtfs_open_file64(gtfs, filenames[i], fileLengths[i]);
+        }
+    };
+    size_t threadCount = min<size_t>(max(1u, thread::hardware_concurrency()), filenames.size());
+    vector<thread> workers;
+    for (size_t i = 1; i < threadCount; ++i) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto& t: workers) {
+        t.join();
+    }
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns one file per name, NULL where the open failed.
+    return files;
+}
+
+int gtfs_close_file(gtfs_t* gtfs, file_t* fl) {
+    int ret = -1;
+    if (gtfs and fl) {
+        VERBOSE_PRINT(do_verbose, "Closing file " << fl->filename << " inside directory " << gtfs->dirname << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem or file does not exist\n");
+        return ret;
+    }
+
+    if (fl->fileDescriptor == -1) {
+        VERBOSE_PRINT(do_verbose, "File is not open\n");
+        return ret;
+    }
+    
+    // Keep the committed contents around for a later reopen, versioned while we still hold the lock (read-only files hold none)
+    auto file_path = fs::path(gtfs->dirname) / fl->filename;
+    auto version = bufferCache.isEnabled() && !fl->readOnly ? cache_version(gtfs, file_path, fl->fileDescriptor) : "";
+    if (!version.empty() && fl->transactionManager->undoUncommitted()) {
+        bufferCache.insert(file_path.string(), version, fl->transactionManager->getVMSegment());
+    }
+
+    // Checkpoints must not reach the segment once its data file is closed
+    openFiles.remove(fl->transactionManager.get());
+    // Close the locked file, flock's lock gets dropped automatically on close
+    ret = close(fl->fileDescriptor);
+    // Also destruct remaining properties to avoid mem leaks and check whether file is open in other ops
+    fl->fileDescriptor = -1;
+    fl->fileLength = 0;
+    fl->transactionManager = nullptr;
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
+
+int gtfs_remove_file(gtfs_t* gtfs, file_t* fl) {
+    int ret = -1;
+    if (gtfs and fl) {
+        VERBOSE_PRINT(do_verbose, "Removing file " << fl->filename << " inside directory " << gtfs->dirname << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem or file does not exist\n");
+        return ret;
+    }
+
+    if (fl->fileDescriptor != -1) {
+        VERBOSE_PRINT(do_verbose, "File is still open, close it before removing!\n");
+        return ret;
+    }
+    // Delete both the actual file and the log file
+    auto cleanerSuspended = gtfs->cleaner->suspend();
+    auto file_path = fs::path(gtfs->dirname) / fl->filename;
+    bufferCache.invalidate(file_path.string());
+    auto log_path = fs::path(gtfs->dirname) / (fl->filename + ".log");
+    ret = fs::remove(file_path);
+    // Log file may not have been created if no writes were synced, so ignore error
+    LogManager::removeLog(log_path);
+    // Records in the shared log cannot be removed in place, mark them as discarded instead
+    if (gtfs->options.sharedLog) {
+        get_shared_log(gtfs)->appendRemoval(fl->filename);
+    }
+    if (gtfs->replicator->isActive()) {
+        gtfs->replicator->shipRemoval(fl->filename);
+    }
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
+
+char* gtfs_read_file(gtfs_t* gtfs, file_t* fl, int offset, int length) {
+    if (offset < 0 || length < 0) {
+        VERBOSE_PRINT(do_verbose, "Negative offset or length\n");
+        return NULL;
+    }
+    return gtfs_read_file64(gtfs, fl, offset, length);
+}
+
+char* gtfs_read_file64(gtfs_t* gtfs, file_t* fl, off_t offset, size_t length) {
+    char* ret_data = NULL;
+    if (gtfs and fl) {
+        VERBOSE_PRINT(do_verbose, "Reading " << length << " bytes starting from offset " << offset << " inside file " << fl->filename << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem or file does not exist\n");
+        return NULL;
+    }
+
+    if (fl->fileDescriptor == -1) {
+        VERBOSE_PRINT(do_verbose, "File is not open\n");
+        return ret_data;
+    }
+    if (offset < 0) {
+        VERBOSE_PRINT(do_verbose, "Negative offset\n");
+        return ret_data;
+    }
+    
+    // Copy data from transaction manager's managed virtual memory segment into a string
+    // TransactionManager contains the most up-to-date data: synced writes before file open, and all synced and unsynced writes after file open
+    string data;
+    auto& vmSegment = fl->transactionManager->getVMSegment();
+    VMSizeT segmentSize = vmSegment.size();
+    if (static_cast<VMSizeT>(offset) < segmentSize) {
+        data.resize(min(length, segmentSize - offset));
+        if (vmSegment.read(offset, data.size(), &data[0]) == -1) {
+            VERBOSE_PRINT(do_verbose, "Failed to read file\n");
+            return ret_data;
+        }
+    }
+    // Duplicate the string into a char* to return, string would be destructed on return. Caller is responsible for freeing the returned char*
+    ret_data = strdup(data.c_str());
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns pointer to data read.
+    return ret_data;
+}
+
+write_t* gtfs_write_file(gtfs_t* gtfs, file_t* fl, int offset, int length, const char* data) {
+    if (offset < 0 || length < 0) {
+        VERBOSE_PRINT(do_verbose, "Negative offset or length\n");
+        return NULL;
+    }
+    return gtfs_write_file64(gtfs, fl, offset, length, data);
+}
+
+write_t* gtfs_write_file64(gtfs_t* gtfs, file_t* fl, off_t offset, size_t length, const char* data) {
+    auto handle = gtfs_write_file_handle(gtfs, fl, offset, length, data);
+    if (handle.generation == 0) {
+        return NULL;
+    }
+    write_t *write_id = new write_t;
+    write_id->filename = fl->filename;
+    write_id->offset = offset;
+    write_id->length = length;
+    write_id->file = fl;
+    write_id->transactionId = fl->writes.lookup(handle);
+    write_id->handle = handle;
+    return write_id;
+}
+
+gtfs_write_handle_t gtfs_write_file_handle(gtfs_t* gtfs, file_t* fl, off_t offset, size_t length, const char* data) {
+    gtfs_write_handle_t handle;
+    if (gtfs and fl) {
+        VERBOSE_PRINT(do_verbose, "Writting " << length << " bytes starting from offset " << offset << " inside file " << fl->filename << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem or file does not exist\n");
+        return handle;
+    }
+
+    if (fl->fileDescriptor == -1) {
+        VERBOSE_PRINT(do_verbose, "File is not open\n");
+        return handle;
+    }
+    if (fl->readOnly) {
+        VERBOSE_PRINT(do_verbose, "File is open read-only\n");
+        return handle;
+    }
+    if (offset < 0) {
+        VERBOSE_PRINT(do_verbose, "Negative offset\n");
+        return handle;
+    }
+
+    // Create a transaction in the transaction manager and hand out a slot of the file's slab for it
+    auto transactionId = fl->transactionManager->createTransaction(offset, length, data);
+    if (transactionId == INVALID_TRANSACTION_ID) {
+        VERBOSE_PRINT(do_verbose, "Failed to read file\n");
+        return handle;
+    }
+    handle = fl->writes.acquire(transactionId);
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns a valid handle.
+    return handle;
+}
+
+/** Returns the transaction of the write handle of `fl`, or INVALID_TRANSACTION_ID if the file is not open or the handle is stale */
+static TransactionID write_handle_transaction(file_t* fl, gtfs_write_handle_t handle) {
+    if (fl == nullptr || fl->transactionManager == nullptr) {
+        VERBOSE_PRINT(do_verbose, "File is not open\n");
+        return INVALID_TRANSACTION_ID;
+    }
+    auto transactionId = fl->writes.lookup(handle);
+    if (transactionId == INVALID_TRANSACTION_ID) {
+        VERBOSE_PRINT(do_verbose, "Write handle is invalid or was released\n");
+    }
+    return transactionId;
+}
+
+int gtfs_sync_write_handle(file_t* fl, gtfs_write_handle_t handle, int64_t bytes) {
+    // Use the transactionId and commit the transaction to log file via transaction manager
+    auto transactionId = write_handle_transaction(fl, handle);
+    if (transactionId == INVALID_TRANSACTION_ID) {
+        return -1;
+    }
+    int ret = fl->transactionManager->commitTransaction(transactionId, bytes);
+
+    VERBOSE_PRINT(do_verbose, (ret == 0 ? "Success\n" : "Failed to persist write\n")); //On success returns 0.
+    return ret;
+}
+
+int gtfs_abort_write_handle(file_t* fl, gtfs_write_handle_t handle) {
+    // Abort the transaction via transaction manager (works if transaction is not committed yet)
+    auto transactionId = write_handle_transaction(fl, handle);
+    if (transactionId == INVALID_TRANSACTION_ID) {
+        return -1;
+    }
+    int ret = fl->transactionManager->abortTransaction(transactionId);
+
+    VERBOSE_PRINT(do_verbose, (ret == 0 ? "Success\n" : "Failed to abort write\n")); //On success returns 0.
+    return ret;
+}
+
+int gtfs_release_write_handle(file_t* fl, gtfs_write_handle_t handle) {
+    if (fl == nullptr) {
+        VERBOSE_PRINT(do_verbose, "File does not exist\n");
+        return -1;
+    }
+    return fl->writes.release(handle);
+}
+
+int gtfs_sync_write_file(write_t* write_id) {
+    if (write_id) {
+        VERBOSE_PRINT(do_verbose, "Persisting write of " << write_id->length << " bytes starting from offset " << write_id->offset << " inside file " << write_id->filename << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "Write operation does not exist\n");
+        return -1;
+    }
+    return gtfs_sync_write_handle(write_id->file, write_id->handle);
+}
+
+int gtfs_sync_file(gtfs_t* gtfs, file_t* fl) {
+    int ret = -1;
+    if (gtfs and fl) {
+        VERBOSE_PRINT(do_verbose, "Persisting all writes inside file " << fl->filename << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem or file does not exist\n");
+        return ret;
+    }
+
+    if (fl->fileDescriptor == -1 || fl->transactionManager == nullptr) {
+        VERBOSE_PRINT(do_verbose, "File is not open\n");
+        return ret;
+    }
+    if (fl->readOnly) {
+        VERBOSE_PRINT(do_verbose, "File is open read-only\n");
+        return ret;
+    }
+    // Commit all uncommitted transactions in one log append via transaction manager
+    ret = fl->transactionManager->commitAll();
+
+    VERBOSE_PRINT(do_verbose, (ret == 0 ? "Success\n" : "Failed to persist writes\n")); //On success returns 0.
+    return ret;
+}
+
+int gtfs_abort_write_file(write_t* write_id) {
+    if (write_id) {
+        VERBOSE_PRINT(do_verbose, "Aborting write of " << write_id->length << " bytes starting from offset " << write_id->offset << " inside file " << write_id->filename << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "Write operation does not exist\n");
+        return -1;
+    }
+    return gtfs_abort_write_handle(write_id->file, write_id->handle);
+}
+
+int gtfs_release_write_file(write_t* write_id) {
+    if (!write_id) {
+        VERBOSE_PRINT(do_verbose, "Write operation does not exist\n");
+        return -1;
+    }
+    // The file of a hand-made write_t may have no slot for it, the write_t gets deleted all the same
+    int ret = gtfs_release_write_handle(write_id->file, write_id->handle);
+    delete write_id;
+    return ret;
+}
+
+// BONUS: Implement below API calls to get bonus credits
+
+int gtfs_clean_n_bytes(gtfs_t *gtfs, int bytes){
+    return gtfs_clean_n_bytes64(gtfs, bytes);
+}
+
+int gtfs_clean_n_bytes64(gtfs_t *gtfs, int64_t bytes){
+    int ret = -1;
+    if (gtfs) {
+        VERBOSE_PRINT(do_verbose, "Cleaning up [ " << bytes << " bytes ] GTFileSystem inside directory " << gtfs->dirname << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
+        return ret;
+    }
+
+    // Apply the transactions of each log file listed as dirty to the corresponding actual file
+    // Pass the number of bytes to clean: will clean `bytes` bytes from each log file, not just the first one
+    auto cleanerSuspended = gtfs->cleaner->suspend();
+    if (clean_dirty_files(gtfs, bytes) != 0) {
+        ret = -2;
+    }
+    if (clean_shared_log(gtfs, bytes) != 0) {
+        ret = -2;
+    }
+
+    if (ret != -2) {
+        ret = 0;
+    }
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
+
+int gtfs_sync_write_file_n_bytes(write_t* write_id, int bytes){
+    if (bytes < 0) {
+        VERBOSE_PRINT(do_verbose, "Negative number of bytes to sync\n");
+        return -1;
+    }
+    return gtfs_sync_write_file_n_bytes64(write_id, bytes);
+}
+
+int gtfs_sync_write_file_n_bytes64(write_t* write_id, size_t bytes){
+    int ret = -1;
+    if (write_id) {
+        VERBOSE_PRINT(do_verbose, "Persisting [ " << bytes << " bytes ] write of " << write_id->length << " bytes starting from offset " << write_id->offset << " inside file " << write_id->filename << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "Write operation does not exist\n");
+        return ret;
+    }
+
+    // Counts past INT64_MAX would turn into -1 (the whole write) or another negative count once passed on
+    if (bytes > static_cast<size_t>(INT64_MAX)) {
+        VERBOSE_PRINT(do_verbose, "Number of bytes to sync was more than the bytes written in write_id\n");
+        return ret;
+    }
+
+    // Commit only the first `bytes` bytes of the transaction to the log file
+    ret = gtfs_sync_write_handle(write_id->file, write_id->handle, bytes);
+    if (ret == -1) {
+        VERBOSE_PRINT(do_verbose, "Number of bytes to sync was more than the bytes written in write_id\n");
+        return ret;
+    }
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
+
+/** Scans one log (record framing and checksums) or data file (checksum of the contents) for gtfs_verify() */
+static gtfs_verify_result_t verify_file(const fs::path& path, bool isLog, bool isSharedLog, bool repair) {
+    gtfs_verify_result_t result;
+    result.filename = path.string();
+    result.isLog = isLog;
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        result.ioError = true;
+        return result;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    // Stream the file in large chunks, keeping a partial log record around until its remaining bytes arrive
+    vector<char> buffer;
+    size_t pending = 0;
+    const size_t chunkSize = 1 << 20;
+    Transaction transaction;
+    string fileName;
+    bool isRemoval;
+    // A shared log starts with its header, the rest of it is records like any other log
+    bool needsHeader = isSharedLog;
+    bool legacy = isLog && !isSharedLog && LogManager::isLegacyLog(fd);
+    bool torn = false;
+    ssize_t bytesRead;
+    do {
+        buffer.resize(pending + chunkSize);
+        bytesRead = read(fd, buffer.data() + pending, chunkSize);
+        if (bytesRead < 0) {
+            result.ioError = true;
+            break;
+        }
+        result.size += bytesRead;
+        pending += bytesRead;
+        if (!isLog) {
+            result.checksum = crc32c(result.checksum, buffer.data(), pending);
+            pending = 0;
+            continue;
+        }
+        size_t position = 0;
+        while (!torn && position < pending) {
+            size_t recordSize;
+            bool isHeader = needsHeader;
+            if (isHeader) {
+                recordSize = SharedLog::decodeHeader(buffer.data() + position, pending - position, fileName);
+                needsHeader = recordSize == 0;
+            } else if (isSharedLog) {
+                recordSize = SharedLog::decodeRecord(buffer.data() + position, pending - position, fileName, transaction, isRemoval);
+            } else {
+                recordSize = decode_log_record(buffer.data() + position, pending - position, legacy, bytesRead == 0, transaction);
+            }
+            if (recordSize == LogManager::CORRUPT_RECORD) {
+                // Nothing past a corrupted record is part of the intact prefix, whether it is a tail or not is settled below
+                torn = true;
+                result.corrupted = legacy || log_continues_after(fd, result.validBytes);
+                break;
+            }
+            if (recordSize == 0) {
+                // Either the record continues in the next chunk, or this is the torn/corrupted tail at EOF
+                torn = bytesRead == 0;
+                break;
+            }
+            result.checksum = crc32c(result.checksum, buffer.data() + position, recordSize);
+            result.validBytes += recordSize;
+            result.records += isHeader ? 0 : 1;
+            position += recordSize;
+        }
+        memmove(buffer.data(), buffer.data() + position, pending - position);
+        pending -= position;
+    } while (bytesRead > 0 && !torn);
+    // The scan stops at a corrupted record, before the end of the file
+    struct stat st;
+    if (torn && fstat(fd, &st) == 0) {
+        result.size = st.st_size;
+    }
+    close(fd);
+    if (!isLog) {
+        result.validBytes = result.size;
+    }
+
+    if (repair && isLog && !result.ioError && result.validBytes < result.size && !result.corrupted) {
+        // Only truncate when no writer has the file open, it could be in the middle of appending that tail.
+        // Writers of the shared log only lock the log itself, for the duration of an append
+        fs::path originalFilePath = isSharedLog ? path : original_file_path(path);
+        int originalFd = open(originalFilePath.c_str(), O_RDONLY);
+        if (originalFd != -1 && flock(originalFd, LOCK_EX | LOCK_NB) == 0) {
+            error_code ec;
+            if (result.validBytes == 0) {
+                fs::remove(path, ec);
+            } else {
+                fs::resize_file(path, result.validBytes, ec);
+            }
+            result.repaired = !ec;
+        } else {
+            VERBOSE_PRINT(do_verbose, "Not repairing " << path << ", its file is open by a writer\n");
+        }
+        if (originalFd != -1) {
+            close(originalFd);
+        }
+    }
+    return result;
+}
+
+int gtfs_verify(gtfs_t* gtfs, bool repair, vector<gtfs_verify_result_t>& results) {
+    int ret = -1;
+    if (gtfs) {
+        VERBOSE_PRINT(do_verbose, "Verifying GTFileSystem inside directory " << gtfs->dirname << (repair ? " with repair" : "") << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
+        return ret;
+    }
+
+    vector<fs::path> paths;
+    for (auto& p: fs::directory_iterator(gtfs->dirname)) {
+        uint64_t firstSegment, lastSegment;
+        // Segment manifests are checked through their segments, which are logs of their own
+        if (fs::is_regular_file(p) && p.path().filename() != DIRTY_MANIFEST_NAME
+            && !LogManager::readSegmentManifest(p.path(), firstSegment, lastSegment)) {
+            paths.push_back(p.path());
+        }
+    }
+    // Scan the files in parallel, each worker picks the next unscanned file
+    results.assign(paths.size(), gtfs_verify_result_t());
+    atomic<size_t> nextPath{0};
+    auto worker = [&]() {
+        for (size_t i = nextPath++; i < paths.size(); i = nextPath++) {
+            bool isSharedLog = paths[i].filename() == SHARED_LOG_NAME;
+            // Sidecar files hold raw redo bytes, checked through the records pointing into them
+            bool isLog = isSharedLog || paths[i].extension() == ".log"
+                || (paths[i].stem().extension() == ".log" && paths[i].extension() != ".ext");
+            results[i] = verify_file(paths[i], isLog, isSharedLog, repair);
+        }
+    };
+    size_t threadCount = min<size_t>(max(1u, thread::hardware_concurrency()), paths.size());
+    vector<thread> workers;
+    for (size_t i = 1; i < threadCount; ++i) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    for (auto& t: workers) {
+        t.join();
+    }
+
+    ret = 0;
+    for (const auto& result: results) {
+        if (result.ioError || (result.validBytes < result.size && !result.repaired)) {
+            VERBOSE_PRINT(do_verbose, "Damaged: " << result.filename << ", " << result.size - result.validBytes << " bad bytes\n");
+            ret++;
+        }
+    }
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns number of damaged files.
+    return ret;
+}
+
+void gtfs_set_buffer_cache_budget(size_t bytes) {
+    VERBOSE_PRINT(do_verbose, "Setting buffer cache budget to " << bytes << " bytes\n");
+    bufferCache.setBudget(bytes);
+}
+
+gtfs_buffer_cache_stats_t gtfs_get_buffer_cache_stats() {
+    return bufferCache.getStats();
+}
+
+gtfs_write_stats_t gtfs_get_write_stats() {
+    gtfs_write_stats_t stats;
+    stats.committedBytes = writeCounters.committedBytes;
+    stats.logBytes = writeCounters.logBytes;
+    stats.checkpointBytes = writeCounters.checkpointBytes;
+    stats.compactedBytes = writeCounters.compactedBytes;
+    return stats;
+}
+
+/** Returns true if the `length` bytes at `data` are all zeros */
+static bool is_zero(const char* data, VMSizeT length) {
+    VMSizeT i = 0;
+#if defined(__SSE2__)
+    // OR 64 bytes at a time together, then check the accumulated bits once per block
+    for (; i + 64 <= length; i += 64) {
+        __m128i bits = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 16))),
+            _mm_or_si128(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 32)), _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 48))));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(bits, _mm_setzero_si128())) != 0xFFFF) {
+            return false;
+        }
+    }
+#endif
+    for (; i < length; ++i) {
+        if (data[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+gtfs_write_handle_t WriteSlab::acquire(TransactionID transactionId) {
+    uint32_t slot;
+    if (freeSlots.empty()) {
+        slot = slots.size();
+        slots.emplace_back();
+    } else {
+        slot = freeSlots.back();
+        freeSlots.pop_back();
+    }
+    slots[slot].transactionId = transactionId;
+    slots[slot].generation++;
+    gtfs_write_handle_t handle;
+    handle.slot = slot;
+    handle.generation = slots[slot].generation;
+    return handle;
+}
+
+TransactionID WriteSlab::lookup(gtfs_write_handle_t handle) const {
+    if (handle.slot >= slots.size() || handle.generation % 2 == 0 || slots[handle.slot].generation != handle.generation) {
+        return INVALID_TRANSACTION_ID;
+    }
+    return slots[handle.slot].transactionId;
+}
+
+int WriteSlab::release(gtfs_write_handle_t handle) {
+    if (lookup(handle) == INVALID_TRANSACTION_ID) {
+        return -1;
+    }
+    slots[handle.slot].transactionId = INVALID_TRANSACTION_ID;
+    slots[handle.slot].generation++;
+    freeSlots.push_back(handle.slot);
+    return 0;
+}
+
+VMSegment::VMSegment(vector<char>&& contents, shared_ptr<MemoryBudget> memoryBudget): memoryBudget(memoryBudget) {
+    if (memoryBudget) {
+        memoryBudget->registerSegment(this);
+    }
+    // Without a data file behind them, all pages are dirty
+    write(0, contents.size(), contents.data());
+}
+
+VMSegment::VMSegment(int fileDescriptor, VMSizeT size, shared_ptr<MemoryBudget> memoryBudget)
+    : fileDescriptor(fileDescriptor), backedSize(size), segmentSize(size), pages((size + PAGE_SIZE - 1) / PAGE_SIZE),
+      pageFlags(pages.size(), 0), memoryBudget(memoryBudget) {
+    if (memoryBudget) {
+        memoryBudget->registerSegment(this);
+    }
+    findDataExtents();
+}
+
+VMSegment::~VMSegment() {
+    if (memoryBudget) {
+        memoryBudget->unregisterSegment(this);
+        memoryBudget->chargePages(-static_cast<long>(residentBytes));
+    }
+}
+
+VMSizeT VMSegment::size() {
+    lock_guard<mutex> guard(segmentMutex);
+    return segmentSize;
+}
+
+int VMSegment::resize(VMSizeT newSize) {
+    unique_lock<mutex> lock(segmentMutex);
+    int ret = resizeLocked(newSize);
+    settle(lock);
+    return ret;
+}
+
+int VMSegment::resizeLocked(VMSizeT newSize) {
+    VMSizeT pageCount = (newSize + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (newSize < segmentSize) {
+        // Bytes past the end must read as zeros if the segment grows again
+        if (newSize % PAGE_SIZE != 0) {
+            char* page = getPage(newSize / PAGE_SIZE, false);
+            if (page == nullptr) {
+                return -1;
+            }
+            memset(page + newSize % PAGE_SIZE, 0, PAGE_SIZE - newSize % PAGE_SIZE);
+            pageFlags[newSize / PAGE_SIZE] |= DIRTY;
+        }
+        for (VMSizeT pageIndex = pageCount; pageIndex < pages.size(); ++pageIndex) {
+            if (pages[pageIndex]) {
+                charge(-static_cast<long>(PAGE_SIZE));
+            }
+        }
+        backedSize = min(backedSize, newSize);
+    }
+    // Pages added at the end are not resident, they read as zeros
+    pages.resize(pageCount);
+    pageFlags.resize(pageCount, 0);
+    segmentSize = newSize;
+    return 0;
+}
+
+int VMSegment::read(VMSizeT offset, VMSizeT length, char* data) {
+    unique_lock<mutex> lock(segmentMutex);
+    int ret = offset + length <= segmentSize ? 0 : -1;
+    for (VMSizeT done = 0; ret == 0 && done < length;) {
+        VMSizeT position = offset + done;
+        VMSizeT chunk = min(length - done, PAGE_SIZE - position % PAGE_SIZE);
+        const char* page = getPage(position / PAGE_SIZE, false);
+        if (page == nullptr) {
+            ret = -1;
+            break;
+        }
+        memcpy(data + done, page + position % PAGE_SIZE, chunk);
+        done += chunk;
+    }
+    settle(lock);
+    return ret;
+}
+
+int VMSegment::write(VMSizeT offset, VMSizeT length, const char* data) {
+    unique_lock<mutex> lock(segmentMutex);
+    if (offset + length > segmentSize) {
+        resizeLocked(offset + length);
+    }
+    int ret = writeLocked(offset, length, data);
+    settle(lock);
+    return ret;
+}
+
+// Page-aligned ranges writeParallel() cuts the segment into, per thread
+#define PARALLEL_WRITE_RANGES_PER_THREAD 4
+
+int VMSegment::writeParallel(const vector<SegmentWrite>& writes, unsigned threads) {
+    unique_lock<mutex> lock(segmentMutex);
+    VMSizeT begin = SIZE_MAX, end = 0;
+    for (const auto& write: writes) {
+        if (write.length > 0) {
+            begin = min(begin, write.offset);
+            end = max(end, write.offset + write.length);
+        }
+    }
+    if (end > segmentSize) {
+        resizeLocked(end);
+    }
+    VMSizeT pages = begin < end ? (end - 1) / PAGE_SIZE - begin / PAGE_SIZE + 1 : 0;
+    if (threads <= 1 || pages <= 1) {
+        int ret = 0;
+        for (auto it = writes.begin(); ret == 0 && it != writes.end(); ++it) {
+            ret = writeLocked(it->offset, it->length, it->data);
+        }
+        settle(lock);
+        return ret;
+    }
+
+    // Several ranges per thread, so threads done early take over ranges of those with more to write
+    VMSizeT firstPage = begin / PAGE_SIZE;
+    VMSizeT rangePages = (pages + threads * PARALLEL_WRITE_RANGES_PER_THREAD - 1) / (threads * PARALLEL_WRITE_RANGES_PER_THREAD);
+    vector<vector<SegmentWrite>> ranges((pages + rangePages - 1) / rangePages);
+    for (const auto& write: writes) {
+        for (VMSizeT position = write.offset, writeEnd = write.offset + write.length; position < writeEnd;) {
+            VMSizeT range = (position / PAGE_SIZE - firstPage) / rangePages;
+            VMSizeT length = min(writeEnd, (firstPage + (range + 1) * rangePages) * PAGE_SIZE) - position;
+            ranges[range].push_back(SegmentWrite{position, length, write.data + (position - write.offset)});
+            position += length;
+        }
+    }
+    atomic<size_t> nextRange{0};
+    atomic<bool> failed{false};
+    auto writeRanges = [&]() {
+        for (size_t range = nextRange++; range < ranges.size() && !failed; range = nextRange++) {
+            for (const auto& part: ranges[range]) {
+                if (writeLocked(part.offset, part.length, part.data) == -1) {
+                    failed = true;
+                    break;
+                }
+            }
+        }
+    };
+    vector<thread> helpers;
+    for (size_t helper = 1; helper < min<size_t>(threads, ranges.size()); ++helper) {
+        helpers.emplace_back(writeRanges);
+    }
+    writeRanges();
+    for (auto& helper: helpers) {
+        helper.join();
+    }
+    settle(lock);
+    return failed ? -1 : 0;
+}
+
+int VMSegment::writeLocked(VMSizeT offset, VMSizeT length, const char* data) {
+    int ret = 0;
+    // Read in the partly overwritten pages at both ends first, so a failed read leaves the segment untouched
+    VMSizeT end = offset + length;
+    if (length > 0 && ((offset % PAGE_SIZE != 0 && getPage(offset / PAGE_SIZE, false) == nullptr)
+        || (end % PAGE_SIZE != 0 && getPage(end / PAGE_SIZE, false) == nullptr))) {
+        ret = -1;
+    }
+    for (VMSizeT done = 0; ret == 0 && done < length;) {
+        VMSizeT position = offset + done;
+        VMSizeT chunk = min(length - done, PAGE_SIZE - position % PAGE_SIZE);
+        char* page = getPage(position / PAGE_SIZE, chunk == PAGE_SIZE);
+        if (page == nullptr) {
+            ret = -1;
+            break;
+        }
+        memcpy(page + position % PAGE_SIZE, data + done, chunk);
+        pageFlags[position / PAGE_SIZE] = (pageFlags[position / PAGE_SIZE] & ~LOGGED) | DIRTY;
+        done += chunk;
+    }
+    return ret;
+}
+
+ssize_t VMSegment::writeBack(int directFd) {
+    lock_guard<mutex> guard(segmentMutex);
+    if (fileDescriptor == -1) {
+        return -1;
+    }
+    ssize_t written = 0;
+    // Writes a run of consecutive dirty pages. Direct writes copy the run into pooled aligned buffers chunk by chunk,
+    // pages are block aligned and a partial last page of the segment gets zero padded, cut off again by the final ftruncate
+    auto writeRun = [&](const vector<VMSizeT>& run) {
+        if (directFd == -1) {
+            for (VMSizeT pageIndex: run) {
+                VMSizeT pageOffset = pageIndex * PAGE_SIZE;
+                VMSizeT bytes = min(PAGE_SIZE, segmentSize - pageOffset);
+                if (pwrite(fileDescriptor, pages[pageIndex].get(), bytes, pageOffset) != static_cast<ssize_t>(bytes)) {
+                    return -1;
+                }
+                written += bytes;
+            }
+            return 0;
+        }
+        const size_t maxChunkSize = 1 << 20;
+        auto buffer = alignedBufferPool.acquire(min<size_t>(run.size() * PAGE_SIZE, maxChunkSize));
+        const size_t chunkPages = buffer.capacity() / PAGE_SIZE;
+        for (size_t done = 0; done < run.size();) {
+            size_t count = min(run.size() - done, chunkPages);
+            VMSizeT chunkOffset = run[done] * PAGE_SIZE;
+            size_t filled = 0;
+            for (size_t page = done; page < done + count; ++page) {
+                VMSizeT bytes = min(PAGE_SIZE, segmentSize - run[page] * PAGE_SIZE);
+                memcpy(buffer.data() + filled, pages[run[page]].get(), bytes);
+                memset(buffer.data() + filled + bytes, 0, PAGE_SIZE - bytes);
+                filled += PAGE_SIZE;
+                written += bytes;
+            }
+            if (pwrite(directFd, buffer.data(), filled, chunkOffset) != static_cast<ssize_t>(filled)) {
+                return -1;
+            }
+            done += count;
+        }
+        return 0;
+    };
+    vector<VMSizeT> dataRun;
+    auto flushDataRun = [&]() {
+        if (dataRun.empty()) {
+            return 0;
+        }
+        if (writeRun(dataRun) == -1) {
+            return -1;
+        }
+        for (VMSizeT pageIndex: dataRun) {
+            pageFlags[pageIndex] &= ~DIRTY;
+        }
+        dataRun.clear();
+        return 0;
+    };
+    // Dirty pages that are all zeros get punched out of the file instead of written, consecutive ones in a single call.
+    // File systems that cannot punch holes get the zeros written
+    vector<VMSizeT> zeroRun;
+    auto flushZeroRun = [&]() {
+        if (zeroRun.empty()) {
+            return 0;
+        }
+        VMSizeT start = zeroRun.front() * PAGE_SIZE;
+        VMSizeT end = min((zeroRun.back() + 1) * PAGE_SIZE, segmentSize);
+        bool punched = fallocate(fileDescriptor, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, end - start) == 0;
+        if (!punched && writeRun(zeroRun) == -1) {
+            return -1;
+        }
+        for (VMSizeT pageIndex: zeroRun) {
+            pageFlags[pageIndex] &= ~DIRTY;
+        }
+        zeroRun.clear();
+        return 0;
+    };
+    for (VMSizeT pageIndex = 0; pageIndex < pages.size(); ++pageIndex) {
+        if (!pages[pageIndex] || !(pageFlags[pageIndex] & DIRTY)) {
+            if (flushDataRun() == -1 || flushZeroRun() == -1) {
+                return -1;
+            }
+            continue;
+        }
+        if (is_zero(pages[pageIndex].get(), min(PAGE_SIZE, segmentSize - pageIndex * PAGE_SIZE))) {
+            if (flushDataRun() == -1) {
+                return -1;
+            }
+            zeroRun.push_back(pageIndex);
+            continue;
+        }
+        if (flushZeroRun() == -1) {
+            return -1;
+        }
+        dataRun.push_back(pageIndex);
+    }
+    if (flushDataRun() == -1 || flushZeroRun() == -1) {
+        return -1;
+    }
+    // Pages past the old end of the data file that were never written are zeros, as the extension is
+    if (ftruncate(fileDescriptor, segmentSize) == -1) {
+        return -1;
+    }
+    backedSize = segmentSize;
+    // Holes got written into and punched
+    findDataExtents();
+    return written;
+}
+
+void VMSegment::findDataExtents() {
+    dataExtents.clear();
+    for (off_t data = 0; static_cast<VMSizeT>(data) < backedSize;) {
+        data = lseek(fileDescriptor, data, SEEK_DATA);
+        off_t hole = data == -1 ? -1 : lseek(fileDescriptor, data, SEEK_HOLE);
+        if (data == -1 && errno == ENXIO) {
+            // Nothing but a hole up to the end of the file
+            break;
+        }
+        if (hole == -1) {
+            dataExtents.assign(1, make_pair(VMSizeT{0}, backedSize));
+            return;
+        }
+        dataExtents.emplace_back(data, min(static_cast<VMSizeT>(hole), backedSize));
+        data = hole;
+    }
+}
+
+bool VMSegment::isHole(VMSizeT offset, VMSizeT length) const {
+    // First extent ending past offset, the range is a hole unless that extent starts before the range ends
+    auto it = upper_bound(dataExtents.begin(), dataExtents.end(), offset, [](VMSizeT value, const pair<VMSizeT, VMSizeT>& extent) {
+        return value < extent.second;
+    });
+    return it == dataExtents.end() || it->first >= offset + length;
+}
+
+VMSizeT VMSegment::pageCount() {
+    lock_guard<mutex> guard(segmentMutex);
+    return pages.size();
+}
+
+bool VMSegment::copyPage(VMSizeT pageIndex, vector<char>& data, bool& dirty) {
+    lock_guard<mutex> guard(segmentMutex);
+    if (!pages[pageIndex]) {
+        return false;
+    }
+    data.assign(pages[pageIndex].get(), pages[pageIndex].get() + min(PAGE_SIZE, segmentSize - pageIndex * PAGE_SIZE));
+    dirty = pageFlags[pageIndex] & DIRTY;
+    return true;
+}
+
+void VMSegment::adoptPage(VMSizeT pageIndex, vector<char>&& data, bool dirty) {
+    unique_lock<mutex> lock(segmentMutex);
+    char* page = getPage(pageIndex, true);
+    memcpy(page, data.data(), data.size());
+    memset(page + data.size(), 0, PAGE_SIZE - data.size());
+    pageFlags[pageIndex] = dirty ? DIRTY : 0;
+    settle(lock);
+}
+
+size_t VMSegment::evictClean(size_t bytes) {
+    size_t evicted = 0;
+    // Two sweeps at most, the first one may only clear reference bits
+    for (size_t step = 0; step < 2 * pages.size() && evicted < bytes; ++step) {
+        clockHand = clockHand >= pages.size() ? 0 : clockHand;
+        uint8_t& flags = pageFlags[clockHand];
+        if (pages[clockHand] && !(flags & DIRTY)) {
+            if (flags & REFERENCED) {
+                flags &= ~REFERENCED;
+            } else {
+                pages[clockHand].reset();
+                residentBytes -= PAGE_SIZE;
+                evicted += PAGE_SIZE;
+            }
+        }
+        clockHand++;
+    }
+    return evicted;
+}
+
+mutex& VMSegment::getMutex() {
+    return segmentMutex;
+}
+
+void VMSegment::markLogged(VMSizeT firstPage, VMSizeT count) {
+    lock_guard<mutex> guard(segmentMutex);
+    for (VMSizeT pageIndex = firstPage; pageIndex < min(firstPage + count, pages.size()); ++pageIndex) {
+        if (pageFlags[pageIndex] & DIRTY) {
+            pageFlags[pageIndex] |= LOGGED;
+        }
+    }
+}
+
+void VMSegment::markCheckpointed(const function<bool()>& upToDate) {
+    lock_guard<mutex> guard(segmentMutex);
+    struct stat st;
+    if (fileDescriptor == -1 || !upToDate() || fstat(fileDescriptor, &st) == -1) {
+        return;
+    }
+    for (auto& flags: pageFlags) {
+        if (flags & LOGGED) {
+            flags &= ~(DIRTY | LOGGED);
+        }
+    }
+    // Pages past the old end of the data file read from it from now on: the checkpoint extended it with their contents,
+    // or with zeros where they were never written. Holes changed as well
+    backedSize = min(segmentSize, static_cast<VMSizeT>(st.st_size));
+    findDataExtents();
+}
+
+char* VMSegment::getPage(VMSizeT pageIndex, bool overwritten) {
+    auto& page = pages[pageIndex];
+    pageFlags[pageIndex] |= REFERENCED;
+    if (page) {
+        return page.get();
+    }
+    page.reset(new char[PAGE_SIZE]);
+    charge(PAGE_SIZE);
+    if (overwritten) {
+        return page.get();
+    }
+    VMSizeT pageOffset = pageIndex * PAGE_SIZE;
+    VMSizeT fromFile = pageOffset < backedSize ? min(PAGE_SIZE, backedSize - pageOffset) : 0;
+    bool backed = fromFile > 0;
+    // Holes need no read, such pages are zeros
+    if (fromFile > 0 && isHole(pageOffset, fromFile)) {
+        fromFile = 0;
+    }
+    bool failed = fromFile > 0 && pread(fileDescriptor, page.get(), fromFile, pageOffset) != static_cast<ssize_t>(fromFile);
+    // Checked after the read: a change the read saw has updated the version by then. The hole map may be stale too
+    struct stat st;
+    failed = failed || (backed && !dataVersion.empty() && (fstat(fileDescriptor, &st) == -1 || stat_version(st) != dataVersion));
+    if (failed) {
+        page.reset();
+        charge(-static_cast<long>(PAGE_SIZE));
+        return nullptr;
+    }
+    if (fromFile > 0) {
+        pendingFaults++;
+    }
+    memset(page.get() + fromFile, 0, PAGE_SIZE - fromFile);
+    return page.get();
+}
+
+void VMSegment::pinDataVersion(const string& version) {
+    lock_guard<mutex> guard(segmentMutex);
+    dataVersion = version;
+}
+
+void VMSegment::charge(long bytes) {
+    residentBytes += bytes;
+    pendingCharge += bytes;
+}
+
+void VMSegment::settle(unique_lock<mutex>& lock) {
+    long bytes = pendingCharge;
+    uint64_t faults = pendingFaults;
+    pendingCharge = 0;
+    pendingFaults = 0;
+    lock.unlock();
+    if (memoryBudget && (bytes != 0 || faults != 0)) {
+        memoryBudget->chargePages(bytes, faults);
+    }
+}
+
+void MemoryBudget::setLimit(size_t bytes) {
+    {
+        lock_guard<mutex> guard(budgetMutex);
+        limit = bytes;
+    }
+    reclaim();
+}
+
+void MemoryBudget::registerSegment(VMSegment* segment) {
+    lock_guard<mutex> guard(budgetMutex);
+    segments.push_back(segment);
+}
+
+void MemoryBudget::unregisterSegment(VMSegment* segment) {
+    lock_guard<mutex> guard(budgetMutex);
+    segments.erase(remove(segments.begin(), segments.end(), segment), segments.end());
+}
+
+void MemoryBudget::chargePages(long bytes, uint64_t faultedPages) {
+    residentBytes += bytes;
+    this->faultedPages += faultedPages;
+    if (bytes > 0) {
+        reclaim();
+    }
+}
+
+void MemoryBudget::chargeTransactions(long bytes, long spilledBytes) {
+    transactionBytes += bytes;
+    this->spilledBytes += spilledBytes;
+    if (bytes > 0) {
+        reclaim();
+    }
+}
+
+gtfs_memory_usage_t MemoryBudget::getUsage() {
+    lock_guard<mutex> guard(budgetMutex);
+    gtfs_memory_usage_t usage;
+    usage.residentBytes = residentBytes;
+    usage.transactionBytes = transactionBytes;
+    usage.spilledBytes = spilledBytes;
+    usage.budgetBytes = limit;
+    usage.evictedPages = evictedPages;
+    usage.faultedPages = faultedPages;
+    return usage;
+}
+
+void MemoryBudget::reclaim() {
+    lock_guard<mutex> guard(budgetMutex);
+    if (limit == 0) {
+        return;
+    }
+    // Visit the segments round robin so that evictions are spread over the open files, skipping the ones busy in another thread
+    for (size_t visited = 0; visited < segments.size(); ++visited) {
+        size_t used = residentBytes + transactionBytes;
+        if (used <= limit) {
+            break;
+        }
+        nextSegment = nextSegment >= segments.size() ? 0 : nextSegment;
+        VMSegment* segment = segments[nextSegment++];
+        unique_lock<mutex> segmentLock(segment->getMutex(), try_to_lock);
+        if (segmentLock.owns_lock()) {
+            size_t evicted = segment->evictClean(used - limit);
+            residentBytes -= evicted;
+            evictedPages += evicted / VMSegment::PAGE_SIZE;
+        }
+    }
+}
+
+gtfs_memory_usage_t gtfs_get_memory_usage(gtfs_t* gtfs) {
+    if (!gtfs) {
+        return gtfs_memory_usage_t();
+    }
+    return gtfs->memoryBudget->getUsage();
+}
+
+BaseTransactionManager::BaseTransactionManager(vector<char>&& contents): vmSegment(move(contents)), durableSize(vmSegment.size()) {}
+
+BaseTransactionManager::BaseTransactionManager(int fileDescriptor, VMSizeT size, shared_ptr<MemoryBudget> memoryBudget)
+    : vmSegment(fileDescriptor, size, memoryBudget), durableSize(size), memoryBudget(memoryBudget) {}
+
+BaseTransactionManager::~BaseTransactionManager() {
+    if (memoryBudget) {
+        memoryBudget->chargeTransactions(-static_cast<long>(chargedTransactionBytes), -static_cast<long>(chargedSpilledBytes));
+    }
+    if (spillFd != -1) {
+        close(spillFd);
+    }
+}
+
+void BaseTransactionManager::chargeTransactions() {
+    size_t bytes = 0, spilledBytes = 0;
+    for (const auto& transaction: uncommittedTransactions) {
+        bytes += transaction.oldData.size() + transaction.newData.size();
+        if (transaction.spilled.offset != -1) {
+            spilledBytes += transaction.spilled.oldLength + transaction.spilled.newLength;
+        }
+    }
+    // Spilled data is only appended, the file gets reused from its start once all of it was read back or dropped
+    if (spilledBytes == 0 && spillEnd > 0) {
+        spillEnd = 0;
+        if (ftruncate(spillFd, 0) == -1) {
+            VERBOSE_PRINT(do_verbose, "Failed to empty spill file\n");
+        }
+    }
+    if (!memoryBudget) {
+        return;
+    }
+    memoryBudget->chargeTransactions(static_cast<long>(bytes) - static_cast<long>(chargedTransactionBytes),
+        static_cast<long>(spilledBytes) - static_cast<long>(chargedSpilledBytes));
+    chargedTransactionBytes = bytes;
+    chargedSpilledBytes = spilledBytes;
+}
+
+int BaseTransactionManager::spill(Transaction& transaction) {
+    if (spillFd == -1) {
+        spillFd = open(spillDirectory.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+        if (spillFd == -1) {
+            // File systems without O_TMPFILE: create a named file and unlink it right away
+            string path = (spillDirectory / ".gtfs.spill.XXXXXX").string();
+            spillFd = mkostemp(&path[0], O_CLOEXEC);
+            if (spillFd == -1) {
+                return -1;
+            }
+            unlink(path.c_str());
+        }
+    }
+    const auto& oldData = transaction.oldData;
+    const auto& newData = transaction.newData;
+    if (pwrite_full(spillFd, oldData.data(), oldData.size(), spillEnd) != 0
+        || pwrite_full(spillFd, newData.data(), newData.size(), spillEnd + oldData.size()) != 0) {
+        return -1;
+    }
+    transaction.spilled.offset = spillEnd;
+    transaction.spilled.oldLength = oldData.size();
+    transaction.spilled.newLength = newData.size();
+    spillEnd += oldData.size() + newData.size();
+    vector<char>().swap(transaction.oldData);
+    vector<char>().swap(transaction.newData);
+    return 0;
+}
+
+int BaseTransactionManager::readSpilled(const Transaction& transaction, vector<char>* oldData, vector<char>* newData) {
+    const auto& spilled = transaction.spilled;
+    if (oldData) {
+        oldData->resize(spilled.oldLength);
+        if (pread_full(spillFd, oldData->data(), spilled.oldLength, spilled.offset) != static_cast<ssize_t>(spilled.oldLength)) {
+            return -1;
+        }
+    }
+    if (newData) {
+        newData->resize(spilled.newLength);
+        if (pread_full(spillFd, newData->data(), spilled.newLength, spilled.offset + spilled.oldLength) != static_cast<ssize_t>(spilled.newLength)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int BaseTransactionManager::unspill(Transaction& transaction) {
+    if (transaction.spilled.offset == -1) {
+        return 0;
+    }
+    if (readSpilled(transaction, &transaction.oldData, &transaction.newData) == -1) {
+        return -1;
+    }
+    transaction.spilled = SpilledPayload();
+    return 0;
+}
+
+const vector<char>* BaseTransactionManager::undoData(const Transaction& transaction, vector<char>& buffer) {
+    if (transaction.spilled.offset == -1) {
+        return &transaction.oldData;
+    }
+    return readSpilled(transaction, &buffer, nullptr) == 0 ? &buffer : nullptr;
+}
+
+TransactionID BaseTransactionManager::createTransaction(VMSizeT offset, VMSizeT length, const char* newData) {
+    Transaction transaction;
+    transaction.transactionId = totalTransactionCount++;
+    transaction.offset = offset;
+    // Calculate the sizes for undo and redo data for the transaction
+    VMSizeT segmentSize = vmSegment.size();
+    VMSizeT oldSize = offset < segmentSize ? min(length, segmentSize - offset) : 0;
+    transaction.oldData.resize(oldSize);
+    transaction.newData.assign(newData, newData + length);
+    // Copy the managed data from the VM segment offset to the undo data, then the newData over it,
+    // extending the managed VM segment if required for writing outside bounds of the segment
+    if (vmSegment.read(offset, oldSize, transaction.oldData.data()) == -1 || vmSegment.write(offset, length, newData) == -1) {
+        return INVALID_TRANSACTION_ID;
+    }
+
+    // Undo data captured on top of another uncommitted write is not what the log would replay to
+    size_t residentBytes = oldSize + length;
+    for (const auto& uncommitted: uncommittedTransactions) {
+        if (uncommitted.overlaps(offset, length)) {
+            transaction.undoIsDurable = false;
+        }
+        residentBytes += uncommitted.oldData.size() + uncommitted.newData.size();
+    }
+    // Past the budget the data waits for the commit or abort on disk, the write stays in memory if that fails
+    if (spillThreshold > 0 && residentBytes > spillThreshold && !spillDirectory.empty() && spill(transaction) == -1) {
+        VERBOSE_PRINT(do_verbose, "Failed to spill uncommitted write data\n");
+    }
+    uncommittedTransactions.push_back(move(transaction));
+    chargeTransactions();
+    return uncommittedTransactions.back().transactionId;
+}
+
+int BaseTransactionManager::abortTransaction(TransactionID transactionId) {
+    for (auto it = uncommittedTransactions.begin(); it != uncommittedTransactions.end(); it++) {
+        if (it->transactionId == transactionId) {
+            // Apply the undo data from the transaction to the VM segment, and erase the transaction
+            if (unspill(*it) == -1 || vmSegment.write(it->offset, it->oldData.size(), it->oldData.data()) == -1) {
+                return -1;
+            }
+            invalidateOverlappingUndo(*it);
+            // Undo data captured over other uncommitted writes, and bytes the write appended, are not what the log replays to
+            if (!it->undoIsDurable || it->redoSize() > it->undoSize()) {
+                markUnlogged(it->offset, max(it->redoSize(), it->undoSize()));
+            }
+            uncommittedTransactions.erase(it);
+            chargeTransactions();
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void BaseTransactionManager::markUnlogged(VMSizeT offset, VMSizeT length) {
+    if (length == 0) {
+        return;
+    }
+    VMSizeT end = offset + length;
+    // Merge with the ranges it overlaps or touches
+    auto it = unloggedRanges.upper_bound(offset);
+    if (it != unloggedRanges.begin() && prev(it)->second >= offset) {
+        --it;
+        offset = it->first;
+    }
+    while (it != unloggedRanges.end() && it->first <= end) {
+        end = max(end, it->second);
+        it = unloggedRanges.erase(it);
+    }
+    unloggedRanges[offset] = end;
+}
+
+void BaseTransactionManager::markLogged(VMSizeT offset, VMSizeT length) {
+    VMSizeT end = offset + length;
+    auto it = unloggedRanges.upper_bound(offset);
+    if (it != unloggedRanges.begin() && prev(it)->second > offset) {
+        --it;
+    }
+    // Keep the parts of the ranges before and after the logged one
+    while (it != unloggedRanges.end() && it->first < end) {
+        VMSizeT rangeStart = it->first, rangeEnd = it->second;
+        it = unloggedRanges.erase(it);
+        if (rangeStart < offset) {
+            unloggedRanges[rangeStart] = offset;
+        }
+        if (rangeEnd > end) {
+            unloggedRanges[end] = rangeEnd;
+        }
+    }
+}
+
+bool BaseTransactionManager::overlapsUnlogged(VMSizeT offset, VMSizeT length) const {
+    auto it = unloggedRanges.upper_bound(offset);
+    if (it != unloggedRanges.begin() && prev(it)->second > offset) {
+        return true;
+    }
+    return it != unloggedRanges.end() && it->first < offset + length;
+}
+
+void BaseTransactionManager::markPagesLogged(VMSizeT offset, VMSizeT length) {
+    if (length == 0) {
+        return;
+    }
+    const VMSizeT pageSize = VMSegment::PAGE_SIZE;
+    VMSizeT firstPage = offset / pageSize, lastPage = (offset + length - 1) / pageSize;
+    // Page ranges holding bytes of uncommitted transactions or bytes no log has, those pages stay unmarked
+    vector<pair<VMSizeT, VMSizeT>> pending;
+    auto addPending = [&](VMSizeT start, VMSizeT end) {
+        if (start < end && start / pageSize <= lastPage && (end - 1) / pageSize >= firstPage) {
+            pending.emplace_back(start / pageSize, (end - 1) / pageSize);
+        }
+    };
+    for (const auto& transaction: uncommittedTransactions) {
+        addPending(transaction.offset, transaction.offset + max(transaction.redoSize(), transaction.undoSize()));
+    }
+    for (const auto& range: unloggedRanges) {
+        addPending(range.first, range.second);
+    }
+    sort(pending.begin(), pending.end());
+    VMSizeT page = firstPage;
+    for (const auto& range: pending) {
+        if (range.first > page) {
+            vmSegment.markLogged(page, range.first - page);
+        }
+        page = max(page, range.second + 1);
+    }
+    if (page <= lastPage) {
+        vmSegment.markLogged(page, lastPage - page + 1);
+    }
+}
+
+// Replays of fewer redo bytes stay on the calling thread, larger ones use up to one thread per core but at most this many
+#define PARALLEL_REPLAY_MIN_BYTES (4 << 20)
+#define MAX_REPLAY_THREADS 8u
+
+/** Returns the threads to replay `redoBytes` of log records with, `configured` being gtfs_options_t::replayThreads */
+static unsigned replay_threads(VMSizeT redoBytes, unsigned configured) {
+    if (redoBytes < PARALLEL_REPLAY_MIN_BYTES) {
+        return 1;
+    }
+    return configured > 0 ? configured : max(1u, min(thread::hardware_concurrency(), MAX_REPLAY_THREADS));
+}
+
+int BaseTransactionManager::replayTransactions(const vector<Transaction>& transactions) {
+    // First find the max last index in the transactions
+    auto maxOffsetElement = max_element(transactions.begin(), transactions.end(), [](const Transaction& t1, const Transaction& t2) {
+        return t1.redoEnd() < t2.redoEnd();
+    });
+    if (maxOffsetElement == transactions.end()) {
+        return 0;
+    }
+    VMSizeT maxOffset = maxOffsetElement->redoEnd();
+    // Resize the VM segment to accommodate the max offset
+    if (maxOffset > vmSegment.size() && vmSegment.resize(maxOffset) == -1) {
+        return -1;
+    }
+    durableSize = max(durableSize, maxOffset);
+    // Delta-encoded records make one write per run
+    vector<SegmentWrite> writes;
+    VMSizeT redoBytes = 0, minOffset = maxOffset;
+    for (const auto& transaction: transactions) {
+        minOffset = min(minOffset, transaction.offset);
+        redoBytes += transaction.newData.size();
+        if (transaction.deltaRuns.empty()) {
+            writes.push_back(SegmentWrite{transaction.offset, transaction.newData.size(), transaction.newData.data()});
+            continue;
+        }
+        const char* runData = transaction.newData.data();
+        for (const auto& run: transaction.deltaRuns) {
+            writes.push_back(SegmentWrite{transaction.offset + run.first, run.second, runData});
+            runData += run.second;
+        }
+    }
+    if (vmSegment.writeParallel(writes, replay_threads(redoBytes, replayThreads)) == -1) {
+        return -1;
+    }
+    markPagesLogged(minOffset, maxOffset - minOffset);
+    return 0;
+}
+
+int BaseTransactionManager::replayTransaction(const Transaction& transaction) {
+    VMSizeT end = transaction.redoEnd();
+    if (end > vmSegment.size() && vmSegment.resize(end) == -1) {
+        return -1;
+    }
+    durableSize = max(durableSize, end);
+    if (transaction.deltaRuns.empty()) {
+        if (vmSegment.write(transaction.offset, transaction.newData.size(), transaction.newData.data()) == -1) {
+            return -1;
+        }
+    } else {
+        // Delta-encoded record: scatter the packed run bytes to their offsets
+        const char* runData = transaction.newData.data();
+        for (const auto& run: transaction.deltaRuns) {
+            if (vmSegment.write(transaction.offset + run.first, run.second, runData) == -1) {
+                return -1;
+            }
+            runData += run.second;
+        }
+    }
+    markPagesLogged(transaction.offset, end - transaction.offset);
+    return 0;
+}
+
+void BaseTransactionManager::invalidateOverlappingUndo(const Transaction& transaction) {
+    for (auto& uncommitted: uncommittedTransactions) {
+        if (uncommitted.transactionId != transaction.transactionId && uncommitted.overlaps(transaction.offset, transaction.newData.size())) {
+            uncommitted.undoIsDurable = false;
+        }
+    }
+}
+
+void BaseTransactionManager::adoptSegmentSize() {
+    durableSize = vmSegment.size();
+}
+
+VMSegment& BaseTransactionManager::getVMSegment() {
+    return vmSegment;
+}
+
+// Unchanged gaps shorter than this are folded into the surrounding runs, as a run header costs about as much in the log
+#define DELTA_MIN_GAP 32
+
+/** Returns the first index in [from, length) where `a` and `b` differ (`equal` false) or match (`equal` true), or length if there is none */
+static VMSizeT findByteMatch(const char* a, const char* b, VMSizeT from, VMSizeT length, bool equal) {
+    VMSizeT i = from;
+#if defined(__SSE2__)
+    // Compare 16 bytes at a time, the movemask has one bit set per equal byte
+    const int skipMask = equal ? 0 : 0xFFFF;
+    for (; i + 16 <= length; i += 16) {
+        __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+        __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+        if (mask != skipMask) {
+            return i + __builtin_ctz(equal ? mask : ~mask & 0xFFFF);
+        }
+    }
+#endif
+    for (; i < length; ++i) {
+        if ((a[i] == b[i]) == equal) {
+            return i;
+        }
+    }
+    return length;
+}
+
+/** Returns the runs of `newData` that differ from `oldData` over the first `length` bytes, gaps under DELTA_MIN_GAP merged */
+static vector<DeltaRun> findChangedRuns(const char* oldData, const char* newData, VMSizeT length) {
+    vector<DeltaRun> runs;
+    VMSizeT start = findByteMatch(oldData, newData, 0, length, false);
+    while (start < length) {
+        VMSizeT end = findByteMatch(oldData, newData, start, length, true);
+        VMSizeT next = findByteMatch(oldData, newData, end, length, false);
+        if (!runs.empty() && start - (runs.back().first + runs.back().second) < DELTA_MIN_GAP) {
+            runs.back().second = end - runs.back().first;
+        } else {
+            runs.emplace_back(start, end - start);
+        }
+        start = next;
+    }
+    return runs;
+}
+
+/**
+ * Rewrites the redo data of `transaction` into the byte runs that differ from its undo data.
+ * Bytes past the end of the undo data (i.e. the write extended the segment) always count as changed.
+ * Leaves the transaction with empty redo data if it changes nothing.
+ */
+static void encodeDelta(Transaction& transaction) {
+    VMSizeT compared = min(transaction.oldData.size(), transaction.newData.size());
+    auto runs = findChangedRuns(transaction.oldData.data(), transaction.newData.data(), compared);
+    if (compared < transaction.newData.size()) {
+        if (!runs.empty() && compared - (runs.back().first + runs.back().second) < DELTA_MIN_GAP) {
+            runs.back().second = transaction.newData.size() - runs.back().first;
+        } else {
+            runs.emplace_back(compared, transaction.newData.size() - compared);
+        }
+    }
+    // A single run covering the whole write is cheaper to log as a plain record
+    if (runs.size() == 1 && runs[0].first == 0 && runs[0].second == transaction.newData.size()) {
+        return;
+    }
+    vector<char> packed;
+    for (const auto& run: runs) {
+        packed.insert(packed.end(), transaction.newData.begin() + run.first, transaction.newData.begin() + run.first + run.second);
+    }
+    transaction.newData = move(packed);
+    transaction.deltaRuns = move(runs);
+}
+
+TransactionManager::TransactionManager(const fs::path& originalFilePath, int fileDescriptor, VMSizeT size, const gtfs_options_t& options,
+    shared_ptr<SharedLog> sharedLog, shared_ptr<MemoryBudget> memoryBudget, shared_ptr<Replicator> replicator)
+    : BaseTransactionManager(fileDescriptor, size, memoryBudget), logFilePath(originalFilePath.string() + ".log"), options(options), sharedLog(sharedLog),
+      replicator(replicator) {
+    spillThreshold = options.uncommittedBudget;
+    replayThreads = options.replayThreads;
+    spillDirectory = originalFilePath.parent_path();
+}
+
+TransactionManager::~TransactionManager() {
+    openFiles.remove(this);
+}
+
+int TransactionManager::commitTransaction(TransactionID transactionId, int64_t bytes) {
+    ForegroundCommit inProgress;
+    for (auto it = uncommittedTransactions.begin(); it != uncommittedTransactions.end(); it++) {
+        if (it->transactionId == transactionId) {
+            if (unspill(*it) == -1) {
+                return -1;
+            }
+            // If `bytes` is provided, then only commit the first `bytes` bytes of the transaction
+            VMSizeT writtenLength = it->newData.size();
+            if (bytes != -1 && (bytes < 0 || static_cast<VMSizeT>(bytes) > writtenLength)) {
+                return -1;
+            }
+            VMSizeT loggedLength = bytes == -1 ? writtenLength : bytes;
+            if (overlapsUnlogged(it->offset, loggedLength)) {
+                it->undoIsDurable = false;
+            }
+            // The transaction stays as it was until the record is logged, so a failed commit leaves it uncommitted.
+            // Delta encoding is only valid if the undo data is what replaying the log yields for this range
+            Transaction partialOrDelta;
+            const Transaction* record = &*it;
+            if (loggedLength < writtenLength || (options.deltaEncoding && it->undoIsDurable)) {
+                partialOrDelta.transactionId = it->transactionId;
+                partialOrDelta.offset = it->offset;
+                partialOrDelta.newData.assign(it->newData.begin(), it->newData.begin() + loggedLength);
+                record = &partialOrDelta;
+            }
+            bool unchanged = false;
+            if (options.deltaEncoding && it->undoIsDurable) {
+                partialOrDelta.oldData = it->oldData;
+                encodeDelta(partialOrDelta);
+                // Nothing changed, so there is nothing to log
+                unchanged = partialOrDelta.newData.empty();
+            }
+            string fileName = original_file_path(logFilePath).filename().string();
+            if (!unchanged) {
+                int ret = sharedLog ? sharedLog->append(fileName, *record) : LogManager::writeTransaction(logFilePath, *record, options);
+                if (ret != 0) {
+                    VERBOSE_PRINT(do_verbose, "Failed to log the commit to " << (sharedLog ? sharedLog->getPath() : logFilePath) << "\n");
+                    return -1;
+                }
+                if (replicator && replicator->isActive()) {
+                    replicator->shipCommit(fileName, *record, sharedLog != nullptr);
+                }
+            }
+            durableSize = max(durableSize, it->offset + loggedLength);
+            writeCounters.committedBytes += loggedLength;
+            invalidateOverlappingUndo(*it);
+            if (loggedLength < writtenLength) {
+                // The rest of the write stays in the segment without being logged
+                markUnlogged(it->offset + loggedLength, writtenLength - loggedLength);
+            }
+            markLogged(it->offset, loggedLength);
+            VMSizeT committedOffset = it->offset;
+            uncommittedTransactions.erase(it);
+            markPagesLogged(committedOffset, loggedLength);
+            chargeTransactions();
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int TransactionManager::commitAll() {
+    ForegroundCommit inProgress;
+    if (uncommittedTransactions.empty()) {
+        return 0;
+    }
+    // Merge the written ranges into extents, ranges that overlap or touch go in the same one
+    vector<pair<VMSizeT, VMSizeT>> extents;
+    for (const auto& transaction: uncommittedTransactions) {
+        if (transaction.redoSize() > 0) {
+            extents.emplace_back(transaction.offset, transaction.offset + transaction.redoSize());
+        }
+    }
+    sort(extents.begin(), extents.end());
+    vector<pair<VMSizeT, VMSizeT>> merged;
+    for (const auto& extent: extents) {
+        if (!merged.empty() && extent.first <= merged.back().second) {
+            merged.back().second = max(merged.back().second, extent.second);
+        } else {
+            merged.push_back(extent);
+        }
+    }
+
+    vector<Transaction> transactions;
+    VMSizeT committedBytes = 0;
+    for (const auto& extent: merged) {
+        committedBytes += extent.second - extent.first;
+        Transaction transaction;
+        transaction.transactionId = totalTransactionCount++;
+        transaction.offset = extent.first;
+        // The segment holds the latest contents of the extent, its undo data is what the earliest write of each byte saw
+        transaction.newData.resize(extent.second - extent.first);
+        if (vmSegment.read(extent.first, transaction.newData.size(), transaction.newData.data()) == -1) {
+            return -1;
+        }
+        transaction.oldData = transaction.newData;
+        vector<bool> hasUndo(transaction.newData.size(), false);
+        vector<char> spilledUndo;
+        for (auto it = uncommittedTransactions.rbegin(); it != uncommittedTransactions.rend(); ++it) {
+            if (it->offset < extent.first || it->offset >= extent.second) {
+                continue;
+            }
+            VMSizeT start = it->offset - extent.first;
+            const vector<char>* undo = undoData(*it, spilledUndo);
+            if (!undo) {
+                return -1;
+            }
+            copy(undo->begin(), undo->end(), transaction.oldData.begin() + start);
+            fill(hasUndo.begin() + start, hasUndo.begin() + start + undo->size(), true);
+            transaction.undoIsDurable &= it->undoIsDurable;
+        }
+        // Bytes past the end the file had before the writes have no undo data, they can only be at the end of an extent
+        transaction.oldData.resize(find(hasUndo.begin(), hasUndo.end(), false) - hasUndo.begin());
+        transaction.undoIsDurable &= !overlapsUnlogged(extent.first, extent.second - extent.first);
+        if (options.deltaEncoding && transaction.undoIsDurable) {
+            encodeDelta(transaction);
+            if (transaction.newData.empty()) {
+                continue;
+            }
+        }
+        transactions.push_back(move(transaction));
+    }
+
+    string fileName = original_file_path(logFilePath).filename().string();
+    int ret = sharedLog ? sharedLog->append(fileName, transactions) : LogManager::writeTransactions(logFilePath, transactions, options);
+    if (ret != 0) {
+        return -1;
+    }
+    if (replicator && replicator->isActive()) {
+        for (const auto& transaction: transactions) {
+            replicator->shipCommit(fileName, transaction, sharedLog != nullptr);
+        }
+    }
+    writeCounters.committedBytes += committedBytes;
+    durableSize = max(durableSize, merged.empty() ? 0 : merged.back().second);
+    for (const auto& extent: merged) {
+        markLogged(extent.first, extent.second - extent.first);
+    }
+    uncommittedTransactions.clear();
+    for (const auto& extent: merged) {
+        markPagesLogged(extent.first, extent.second - extent.first);
+    }
+    chargeTransactions();
+    return 0;
+}
+
+fs::path TransactionManager::getLogFilePath() const {
+    return logFilePath;
+}
+
+void TransactionManager::checkpointed() {
+    // The data file of a log-structured file never gets the log applied
+    if (options.logStructured) {
+        return;
+    }
+    // Checked under the segment lock, which commits only take to mark their pages once their record is logged. A record
+    // logged after the checkpoint leaves a log behind, and the pages stay dirty until the next one
+    string fileName = original_file_path(logFilePath).filename().string();
+    vmSegment.markCheckpointed([&]() {
+        return !fs::exists(logFilePath) && (!sharedLog || !sharedLog->hasRecords(fileName));
+    });
+    if (memoryBudget) {
+        memoryBudget->reclaim();
+    }
+}
+
+bool TransactionManager::undoUncommitted() {
+    if (!unloggedRanges.empty()) {
+        return false;
+    }
+    for (const auto& transaction: uncommittedTransactions) {
+        if (!transaction.undoIsDurable) {
+            return false;
+        }
+    }
+    // Undo newest first, bytes a write appended past the end of the segment were zero (or nonexistent) before it
+    vector<char> spilledUndo;
+    for (auto it = uncommittedTransactions.rbegin(); it != uncommittedTransactions.rend(); ++it) {
+        const vector<char>* undo = undoData(*it, spilledUndo);
+        if (!undo || vmSegment.write(it->offset, undo->size(), undo->data()) == -1) {
+            return false;
+        }
+        VMSizeT extensionStart = it->offset + undo->size();
+        VMSizeT extensionEnd = min(it->offset + it->redoSize(), vmSegment.size());
+        if (extensionStart < extensionEnd) {
+            vector<char> zeros(extensionEnd - extensionStart, 0);
+            if (vmSegment.write(extensionStart, zeros.size(), zeros.data()) == -1) {
+                return false;
+            }
+        }
+    }
+    uncommittedTransactions.clear();
+    chargeTransactions();
+    return vmSegment.resize(durableSize) == 0;
+}
+
+VMSizeT Transaction::redoSize() const {
+    if (spilled.offset != -1) {
+        return spilled.newLength;
+    }
+    return external.length > 0 ? external.length : newData.size();
+}
+
+VMSizeT Transaction::undoSize() const {
+    return spilled.offset != -1 ? spilled.oldLength : oldData.size();
+}
+
+VMSizeT Transaction::redoEnd() const {
+    if (external.length > 0) {
+        return offset + external.length;
+    }
+    if (deltaRuns.empty()) {
+        return offset + newData.size();
+    }
+    return offset + deltaRuns.back().first + deltaRuns.back().second;
+}
+
+bool Transaction::overlaps(VMSizeT otherOffset, VMSizeT length) const {
+    return offset < otherOffset + length && otherOffset < offset + max(redoSize(), undoSize());
+}
+
+/** Appends the textual log record of `transaction`, without its checksum trailer, to `out` */
+static void appendRecordBody(string& out, const Transaction& transaction) {
+    // References to sidecar redo data are tagged with an 'x' and give its location, length and checksum instead of the data
+    if (transaction.external.length > 0) {
+        out += "x" + to_string(transaction.transactionId) + " " + to_string(transaction.offset) + " " + to_string(transaction.external.sidecarOffset)
+            + " " + to_string(transaction.external.length) + " " + to_string(transaction.external.checksum);
+        return;
+    }
+    // Delta-encoded records are tagged with a 'd' and list their runs before the packed redo data
+    if (!transaction.deltaRuns.empty()) {
+        out.push_back('d');
+    }
+    out += to_string(transaction.transactionId) + " " + to_string(transaction.offset) + " ";
+    if (!transaction.deltaRuns.empty()) {
+        out += to_string(transaction.deltaRuns.size()) + " ";
+        for (const auto& run: transaction.deltaRuns) {
+            out += to_string(run.first) + " " + to_string(run.second) + " ";
+        }
+    }
+    out += to_string(transaction.newData.size()) + " ";
+    out.append(transaction.newData.data(), transaction.newData.size());
+}
+
+ostream& operator<<(ostream& os, const Transaction& transaction) {
+    auto record = LogManager::encodeTransaction(transaction);
+    return os.write(record.data(), record.size());
+}
+
+istream& operator>>(istream& is, Transaction& transaction) {
+    size_t newDataSize;
+    uint32_t checksum;
+    // Skip whitespaces (because redo data might have whitespace chars) and read the transaction id, offset and redo data size
+    is.unsetf(ios_base::skipws);
+    bool isDelta = is.peek() == 'd';
+    bool isExternal = is.peek() == 'x';
+    if (isDelta || isExternal) {
+        is.ignore(1);
+    }
+    is>> transaction.transactionId;
+    is.ignore(1);
+    is >> transaction.offset;
+    is.ignore(1);
+    transaction.deltaRuns.clear();
+    transaction.external = ExternalRedo();
+    if (isExternal) {
+        is >> transaction.external.sidecarOffset;
+        is.ignore(1);
+        is >> transaction.external.length;
+        is.ignore(1);
+        is >> transaction.external.checksum;
+        is.ignore(1);
+        is >> checksum;
+        is.ignore(1);
+        transaction.oldData.clear();
+        transaction.newData.clear();
+        string body;
+        appendRecordBody(body, transaction);
+        if (is && crc32c(0, body.data(), body.size()) != checksum) {
+            is.setstate(ios_base::failbit);
+        }
+        return is;
+    }
+    if (isDelta) {
+        size_t runCount;
+        is >> runCount;
+        is.ignore(1);
+        transaction.deltaRuns.resize(runCount);
+        for (auto& run: transaction.deltaRuns) {
+            is >> run.first;
+            is.ignore(1);
+            is >> run.second;
+            is.ignore(1);
+        }
+    }
+    is >> newDataSize;
+    is.ignore(1);
+    transaction.oldData.clear();
+    transaction.newData.resize(newDataSize);
+    // Read the redo data now
+    is.read(transaction.newData.data(), newDataSize);
+    // And the checksum trailer, a torn or corrupted record fails the stream
+    is.ignore(1);
+    is >> checksum;
+    is.ignore(1);
+    string body;
+    appendRecordBody(body, transaction);
+    if (is && crc32c(0, body.data(), body.size()) != checksum) {
+        is.setstate(ios_base::failbit);
+    }
+    return is;
+}
+
+string LogManager::encodeTransaction(const Transaction& transaction, uint32_t checksumSeed) {
+    string record;
+    appendRecordBody(record, transaction);
+    record += " " + to_string(crc32c(checksumSeed, record.data(), record.size())) + "\n";
+    return record;
+}
+
+/** Parses an unsigned decimal number followed by `separator` at `p`, advancing past both. Returns false if there is none */
+static bool parseRecordNumber(const char*& p, const char* end, uint64_t& value, char separator = ' ') {
+    const char* digitsBegin = p;
+    value = 0;
+    while (p < end && *p >= '0' && *p <= '9' && p - digitsBegin < 20) {
+        value = value * 10 + (*p++ - '0');
+    }
+    if (p == digitsBegin || p >= end || *p != separator) {
+        return false;
+    }
+    ++p;
+    return true;
+}
+
+size_t LogManager::decodeTransaction(const char* data, size_t size, Transaction& transaction, uint32_t checksumSeed, size_t* minimumSize) {
+    const char* p = data;
+    const char* end = data + size;
+    uint64_t transactionId, offset, newDataSize, checksum;
+    // A field cut by the end of the data may still be completed by the bytes that follow, anything else wrong is corruption
+    auto malformed = [&]() {
+        return p >= end ? 0 : CORRUPT_RECORD;
+    };
+    bool isDelta = p < end && *p == 'd';
+    bool isExternal = p < end && *p == 'x';
+    if (isDelta || isExternal) {
+        ++p;
+    }
+    if (!parseRecordNumber(p, end, transactionId) || !parseRecordNumber(p, end, offset)) {
+        return malformed();
+    }
+    transaction.transactionId = transactionId;
+    transaction.offset = offset;
+    transaction.deltaRuns.clear();
+    transaction.external = ExternalRedo();
+    if (isExternal) {
+        uint64_t sidecarOffset, length, externalChecksum;
+        if (!parseRecordNumber(p, end, sidecarOffset) || !parseRecordNumber(p, end, length) || !parseRecordNumber(p, end, externalChecksum)
+            || !parseRecordNumber(p, end, checksum, '\n')) {
+            return malformed();
+        }
+        transaction.external = ExternalRedo{sidecarOffset, length, static_cast<uint32_t>(externalChecksum)};
+        transaction.oldData.clear();
+        transaction.newData.clear();
+        // The body ends before the space in front of the checksum
+        string body;
+        appendRecordBody(body, transaction);
+        if (length == 0 || crc32c(checksumSeed, body.data(), body.size()) != checksum) {
+            return CORRUPT_RECORD;
+        }
+        return p - data;
+    }
+    if (isDelta) {
+        uint64_t runCount, runOffset, runLength;
+        // Every run takes at least 4 bytes, which bounds the allocation for a corrupted count
+        if (!parseRecordNumber(p, end, runCount)) {
+            return malformed();
+        }
+        if (runCount > static_cast<uint64_t>(end - p) / 4) {
+            return 0;
+        }
+        transaction.deltaRuns.reserve(runCount);
+        for (uint64_t i = 0; i < runCount; ++i) {
+            if (!parseRecordNumber(p, end, runOffset) || !parseRecordNumber(p, end, runLength)) {
+                return malformed();
+            }
+            transaction.deltaRuns.emplace_back(runOffset, runLength);
+        }
+    }
+    if (!parseRecordNumber(p, end, newDataSize)) {
+        return malformed();
+    }
+    if (newDataSize > static_cast<uint64_t>(end - p)) {
+        if (minimumSize) {
+            // The redo data, then a space and at least one checksum digit and the newline
+            *minimumSize = (p - data) + newDataSize + 3;
+        }
+        return 0;
+    }
+    transaction.oldData.clear();
+    transaction.newData.assign(p, p + newDataSize);
+    p += newDataSize;
+    const char* bodyEnd = p;
+    if (p >= end) {
+        return 0;
+    }
+    if (*p++ != ' ' || !parseRecordNumber(p, end, checksum, '\n')) {
+        return malformed();
+    }
+    if (crc32c(checksumSeed, data, bodyEnd - data) != checksum) {
+        return CORRUPT_RECORD;
+    }
+    return p - data;
+}
+
+size_t LogManager::decodeLegacyTransaction(const char* data, size_t size, bool atEnd, Transaction& transaction) {
+    const char* p = data;
+    const char* end = data + size;
+    uint64_t transactionId, offset, newDataSize;
+    if (!parseRecordNumber(p, end, transactionId) || !parseRecordNumber(p, end, offset) || !parseRecordNumber(p, end, newDataSize)) {
+        return p >= end ? 0 : CORRUPT_RECORD;
+    }
+    if (newDataSize > static_cast<uint64_t>(end - p)) {
+        return 0;
+    }
+    const char* next = p + newDataSize;
+    // The record is only known to be whole once the next one starts, or the log ends
+    if (next == end && !atEnd) {
+        return 0;
+    }
+    if (next < end && !(*next >= '0' && *next <= '9') && *next != 'd' && *next != 'x') {
+        return CORRUPT_RECORD;
+    }
+    transaction.transactionId = transactionId;
+    transaction.offset = offset;
+    transaction.deltaRuns.clear();
+    transaction.external = ExternalRedo();
+    transaction.oldData.clear();
+    transaction.newData.assign(p, next);
+    return next - data;
+}
+
+bool LogManager::isLegacyLog(int fd) {
+    char header[64];
+    ssize_t headerSize = pread(fd, header, sizeof(header), 0);
+    if (headerSize <= 0) {
+        return false;
+    }
+    const char* p = header;
+    const char* end = header + headerSize;
+    uint64_t transactionId, offset, newDataSize;
+    if (!parseRecordNumber(p, end, transactionId) || !parseRecordNumber(p, end, offset) || !parseRecordNumber(p, end, newDataSize)) {
+        return false;
+    }
+    // Records with a checksum have a space after their redo data, legacy ones the next record or nothing
+    char next;
+    ssize_t nextSize = pread(fd, &next, 1, (p - header) + newDataSize);
+    return nextSize == 0 || (nextSize == 1 && next != ' ');
+}
+
+bool LogManager::forEachTransaction(const fs::path& logFilePath, const function<bool(Transaction&)>& apply, bool dropTornTail, bool loadExternal) {
+    // A record whose sidecar data cannot be loaded ends the consistent prefix like a corrupted record
+    auto applyLoaded = [&](Transaction& transaction) {
+        if (loadExternal && transaction.external.length > 0 && !load_external_redo(logFilePath, transaction)) {
+            return false;
+        }
+        return apply(transaction);
+    };
+    uint64_t firstSegment, lastSegment, fromOffset = 0;
+    if (!readSegmentManifest(logFilePath, firstSegment, lastSegment)) {
+        auto end = replay_log_file(logFilePath, fromOffset, applyLoaded, dropTornTail);
+        return end != ReplayEnd::READ_ERROR && end != ReplayEnd::CORRUPTED;
+    }
+    // Only the active segment can have a torn tail, one in a sealed segment is corruption with the later segments after it
+    for (uint64_t segment = firstSegment; segment <= lastSegment; ++segment) {
+        fromOffset = 0;
+        auto end = replay_log_file(getSegmentPath(logFilePath, segment), fromOffset, applyLoaded, dropTornTail && segment == lastSegment);
+        if (end != ReplayEnd::COMPLETE) {
+            return end == ReplayEnd::STOPPED || (end == ReplayEnd::TORN_TAIL && segment == lastSegment);
+        }
+    }
+    return true;
+}
+
+vector<Transaction> LogManager::getTransactionsInLog(const fs::path& logFilePath, bool dropTornTail, bool loadExternal) {
+    vector<Transaction> transactions;
+    forEachTransaction(logFilePath, [&](Transaction& transaction) {
+        transactions.push_back(move(transaction));
+        return true;
+    }, dropTornTail, loadExternal);
+    return transactions;
+}
+
+fs::path LogManager::getSidecarPath(const fs::path& logFilePath) {
+    return logFilePath.string() + ".ext";
+}
+
+/** Appends an encoded record to the log file at `logFilePath`, creating it if needed */
+static int append_log_record(const fs::path& logFilePath, const string& record, bool directIO) {
+    int fd = directIO ? open_direct(logFilePath) : -1;
+    if (fd != -1) {
+        struct stat st;
+        int ret = fstat(fd, &st) == 0 ? write_direct(fd, st.st_size, record.data(), record.size()) : -1;
+        close(fd);
+        if (ret == 0) {
+            writeCounters.logBytes += record.size();
+        }
+        return ret;
+    }
+    ofstream logFile(logFilePath, ios::binary | ios::app);
+    if (!logFile.is_open()) {
+        return -1;
+    }
+    logFile.write(record.data(), record.size());
+    logFile.close();
+    writeCounters.logBytes += record.size();
+    return 0;
+}
+
+// Segment size of log-structured files that do not set options.logSegmentSize
+#define LOG_STRUCTURED_SEGMENT_SIZE (1 << 20)
+
+/** Returns the size of the log segments new records go to, 0 if logs are not segmented */
+static VMSizeT log_segment_size(const gtfs_options_t& options) {
+    return options.logSegmentSize == 0 && options.logStructured ? LOG_STRUCTURED_SEGMENT_SIZE : options.logSegmentSize;
+}
+
+/** Appends an encoded record to the log, or to its active segment if the log is segmented */
+static int write_log_record(const fs::path& logFilePath, const string& record, const gtfs_options_t& options) {
+    if (log_segment_size(options) == 0) {
+        return append_log_record(logFilePath, record, options.directIO);
+    }
+    uint64_t firstSegment = 1, lastSegment = 1;
+    if (!LogManager::readSegmentManifest(logFilePath, firstSegment, lastSegment)) {
+        // Keep appending to a log written before segmentation was enabled until it gets cleaned
+        if (fs::exists(logFilePath)) {
+            return append_log_record(logFilePath, record, options.directIO);
+        }
+        if (LogManager::writeSegmentManifest(logFilePath, firstSegment, lastSegment) != 0) {
+            return -1;
+        }
+    }
+    // Seal the active segment and start a new one if the record does not fit anymore
+    error_code ec;
+    auto activeSize = fs::file_size(LogManager::getSegmentPath(logFilePath, lastSegment), ec);
+    if (!ec && activeSize > 0 && activeSize + record.size() > log_segment_size(options)) {
+        if (LogManager::writeSegmentManifest(logFilePath, firstSegment, ++lastSegment) != 0) {
+            return -1;
+        }
+    }
+    return append_log_record(LogManager::getSegmentPath(logFilePath, lastSegment), record, options.directIO);
+}
+
+/** Appends encoded records to the log in one write, see write_log_record(). The first records of a log list its file as dirty */
+static int write_log_records(const fs::path& logFilePath, const string& records, const gtfs_options_t& options) {
+    if (fs::exists(logFilePath)) {
+        return write_log_record(logFilePath, records, options);
+    }
+    // The manifest stays locked until the log exists, so that a concurrent clean cannot unlist the file in between
+    auto dirname = logFilePath.parent_path();
+    int lockFd = lock_dirty_manifest(dirname);
+    if (lockFd == -1) {
+        return -1;
+    }
+    int ret = list_dirty_file(dirname, original_file_path(logFilePath).filename().string()) == 0 ? write_log_record(logFilePath, records, options) : -1;
+    close(lockFd);
+    return ret;
+}
+
+/** Appends `length` bytes to the sidecar file at `sidecarPath`, creating it if needed, and sets `offset` to where they went */
+static int append_sidecar(const fs::path& sidecarPath, const char* data, size_t length, bool directIO, uint64_t& offset) {
+    int fd = directIO ? open_direct(sidecarPath) : -1;
+    bool direct = fd != -1;
+    if (!direct) {
+        fd = open(sidecarPath.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    }
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    offset = st.st_size;
+    int ret = direct ? write_direct(fd, offset, data, length) : pwrite_full(fd, data, length, offset);
+    close(fd);
+    if (ret == 0) {
+        writeCounters.logBytes += length;
+    }
+    return ret;
+}
+
+/**
+ * Encodes the transaction into `records`. Redo data of at least options.largeWriteThreshold bytes goes to the sidecar file
+ * right away, before the record referencing it gets appended, and only that reference is encoded
+ */
+static int encode_log_record(const fs::path& logFilePath, const Transaction& transaction, const gtfs_options_t& options, string& records) {
+    // Log-structured files never drop their whole log, which is what frees the sidecar file
+    if (options.largeWriteThreshold == 0 || transaction.newData.size() < options.largeWriteThreshold || !transaction.deltaRuns.empty()
+        || options.logStructured) {
+        records += LogManager::encodeTransaction(transaction);
+        return 0;
+    }
+    Transaction reference;
+    reference.transactionId = transaction.transactionId;
+    reference.offset = transaction.offset;
+    reference.external.length = transaction.newData.size();
+    reference.external.checksum = crc32c(0, transaction.newData.data(), transaction.newData.size());
+    if (append_sidecar(LogManager::getSidecarPath(logFilePath), transaction.newData.data(), transaction.newData.size(), options.directIO,
+            reference.external.sidecarOffset) != 0) {
+        VERBOSE_PRINT(do_verbose, "Failed to write sidecar redo data of " << logFilePath << "\n");
+        return -1;
+    }
+    records += LogManager::encodeTransaction(reference);
+    return 0;
+}
+
+/** Removes the sidecar file a log that got cleaned or removed may have left behind, nothing references its contents anymore */
+static void drop_stale_sidecar(const fs::path& logFilePath) {
+    if (!fs::exists(logFilePath)) {
+        error_code ec;
+        fs::remove(LogManager::getSidecarPath(logFilePath), ec);
+    }
+}
+
+int LogManager::writeTransaction(const fs::path& logFilePath, const Transaction& transaction, const gtfs_options_t& options) {
+    drop_stale_sidecar(logFilePath);
+    string record;
+    if (encode_log_record(logFilePath, transaction, options, record) != 0) {
+        return -1;
+    }
+    return write_log_records(logFilePath, record, options);
+}
+
+int LogManager::writeTransactions(const fs::path& logFilePath, const vector<Transaction>& transactions, const gtfs_options_t& options) {
+    drop_stale_sidecar(logFilePath);
+    string records;
+    for (const auto& transaction: transactions) {
+        if (encode_log_record(logFilePath, transaction, options, records) != 0) {
+            return -1;
+        }
+    }
+    return records.empty() ? 0 : write_log_records(logFilePath, records, options);
+}
+
+#define SEGMENT_MANIFEST_MAGIC "gtfs-segments "
+
+bool LogManager::readSegmentManifest(const fs::path& logFilePath, uint64_t& firstSegment, uint64_t& lastSegment) {
+    // Plain logs start with a record, i.e. a digit or a 'd', so the magic tells the two apart
+    ifstream manifest(logFilePath, ios::binary);
+    string magic(strlen(SEGMENT_MANIFEST_MAGIC), '\0');
+    if (!manifest.is_open() || !manifest.read(&magic[0], magic.size()) || magic != SEGMENT_MANIFEST_MAGIC) {
+        return false;
+    }
+    return static_cast<bool>(manifest >> firstSegment >> lastSegment) && firstSegment <= lastSegment;
+}
+
+int LogManager::writeSegmentManifest(const fs::path& logFilePath, uint64_t firstSegment, uint64_t lastSegment) {
+    // Write a temporary manifest and rename it over the old one, so the manifest is replaced atomically
+    fs::path tempPath = logFilePath.string() + ".tmp";
+    ofstream manifest(tempPath, ios::binary | ios::trunc);
+    if (!manifest.is_open()) {
+        return -1;
+    }
+    manifest << SEGMENT_MANIFEST_MAGIC << firstSegment << " " << lastSegment << "\n";
+    manifest.close();
+    error_code ec;
+    fs::rename(tempPath, logFilePath, ec);
+    return ec ? -1 : 0;
+}
+
+fs::path LogManager::getSegmentPath(const fs::path& logFilePath, uint64_t segment) {
+    return logFilePath.string() + "." + to_string(segment);
+}
+
+bool LogManager::removeLog(const fs::path& logFilePath) {
+    uint64_t firstSegment, lastSegment;
+    bool removed;
+    if (readSegmentManifest(logFilePath, firstSegment, lastSegment)) {
+        // Drop the manifest first: segments without a manifest are ignored, a manifest without its segments is not
+        removed = fs::remove(logFilePath);
+        for (uint64_t segment = firstSegment; segment <= lastSegment; ++segment) {
+            fs::remove(getSegmentPath(logFilePath, segment));
+        }
+    } else {
+        removed = fs::remove(logFilePath);
+    }
+    // The sidecar goes last, once no record references it anymore
+    error_code ec;
+    fs::remove(getSidecarPath(logFilePath), ec);
+    return removed;
+}
+
+#define SHARED_LOG_MAGIC "gtfs-wal "
+
+/** Returns the prefix of a shared log record naming its file */
+static string shared_log_tag(const string& fileName) {
+    return "w" + to_string(fileName.size()) + " " + fileName + " ";
+}
+
+/** Returns the header starting a new generation of the shared log */
+static string shared_log_header() {
+    auto now = chrono::system_clock::now().time_since_epoch();
+    return SHARED_LOG_MAGIC + to_string(chrono::duration_cast<chrono::nanoseconds>(now).count()) + "-" + to_string(getpid()) + "\n";
+}
+
+SharedLog::SharedLog(const fs::path& directory): path(directory / SHARED_LOG_NAME) {}
+
+int SharedLog::openLocked() {
+    while (true) {
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+        if (fd == -1) {
+            return -1;
+        }
+        struct stat st;
+        if (flock(fd, LOCK_EX) == -1 || fstat(fd, &st) == -1) {
+            close(fd);
+            return -1;
+        }
+        // A clean unlinked the log while we waited for the lock, start over with the new one
+        if (st.st_nlink == 0) {
+            close(fd);
+            continue;
+        }
+        if (st.st_size == 0) {
+            string header = shared_log_header();
+            if (write(fd, header.data(), header.size()) != static_cast<ssize_t>(header.size())) {
+                close(fd);
+                return -1;
+            }
+        }
+        return fd;
+    }
+}
+
+void SharedLog::catchUp(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        return;
+    }
+    char headerBuffer[128];
+    ssize_t headerRead = pread(fd, headerBuffer, sizeof(headerBuffer), 0);
+    string generation;
+    size_t headerSize = headerRead > 0 ? decodeHeader(headerBuffer, headerRead, generation) : 0;
+    if (headerSize == 0) {
+        return;
+    }
+    // The log was cleaned and restarted since the last look, its records start over
+    if (generation != indexedGeneration) {
+        indexedGeneration = generation;
+        indexedBytes = headerSize;
+        recordRanges.clear();
+        corrupted = false;
+    }
+    if (static_cast<uint64_t>(st.st_size) <= indexedBytes) {
+        return;
+    }
+    vector<char> buffer(st.st_size - indexedBytes);
+    if (pread(fd, buffer.data(), buffer.size(), indexedBytes) != static_cast<ssize_t>(buffer.size())) {
+        return;
+    }
+    size_t position = 0;
+    string fileName;
+    Transaction transaction;
+    bool isRemoval;
+    while (position < buffer.size()) {
+        size_t recordSize = decodeRecord(buffer.data() + position, buffer.size() - position, fileName, transaction, isRemoval);
+        if (recordSize == LogManager::CORRUPT_RECORD && log_continues_after(fd, indexedBytes + position)) {
+            // Stays unindexed, so the records after it are not replayed out of order with the lost one
+            VERBOSE_PRINT(do_verbose, "Corrupted record at offset " << indexedBytes + position << " in shared log " << path << "\n");
+            corrupted = true;
+            break;
+        }
+        if (recordSize == 0 || recordSize == LogManager::CORRUPT_RECORD) {
+            // Appends are serialized by the lock we hold, so this is what a crashed writer left behind
+            VERBOSE_PRINT(do_verbose, "Truncating torn shared log tail of " << buffer.size() - position << " bytes\n");
+            if (ftruncate(fd, indexedBytes + position) == -1) {
+                VERBOSE_PRINT(do_verbose, "Failed to truncate shared log " << path << "\n");
+            }
+            break;
+        }
+        if (isRemoval) {
+            recordRanges.erase(fileName);
+        } else {
+            recordRanges[fileName].emplace_back(indexedBytes + position, recordSize);
+        }
+        position += recordSize;
+    }
+    indexedBytes += position;
+}
+
+/** Writes the whole record to the locked shared log and releases it */
+static int append_shared_log_record(int fd, const string& record) {
+    int ret = 0;
+    for (size_t written = 0; written < record.size();) {
+        ssize_t n = write(fd, record.data() + written, record.size() - written);
+        if (n <= 0) {
+            ret = -1;
+            break;
+        }
+        written += n;
+    }
+    close(fd);
+    if (ret == 0) {
+        writeCounters.logBytes += record.size();
+    }
+    return ret;
+}
+
+int SharedLog::append(const string& fileName, const Transaction& transaction) {
+    string tag = shared_log_tag(fileName);
+    int fd = openLocked();
+    if (fd == -1) {
+        return -1;
+    }
+    return append_shared_log_record(fd, tag + LogManager::encodeTransaction(transaction, crc32c(0, tag.data(), tag.size())));
+}
+
+int SharedLog::append(const string& fileName, const vector<Transaction>& transactions) {
+    if (transactions.empty()) {
+        return 0;
+    }
+    string tag = shared_log_tag(fileName);
+    uint32_t checksumSeed = crc32c(0, tag.data(), tag.size());
+    string records;
+    for (const auto& transaction: transactions) {
+        records += tag + LogManager::encodeTransaction(transaction, checksumSeed);
+    }
+    int fd = openLocked();
+    if (fd == -1) {
+        return -1;
+    }
+    return append_shared_log_record(fd, records);
+}
+
+int SharedLog::appendRemoval(const string& fileName) {
+    string record = shared_log_tag(fileName) + "-";
+    record += " " + to_string(crc32c(0, record.data(), record.size())) + "\n";
+    int fd = openLocked();
+    if (fd == -1) {
+        return -1;
+    }
+    return append_shared_log_record(fd, record);
+}
+
+vector<Transaction> SharedLog::getTransactions(const string& fileName) {
+    lock_guard<mutex> guard(indexMutex);
+    vector<Transaction> transactions;
+    int fd = openLocked();
+    if (fd == -1) {
+        return transactions;
+    }
+    catchUp(fd);
+    string recordFileName;
+    Transaction transaction;
+    bool isRemoval;
+    vector<char> buffer;
+    for (const auto& range: recordRanges[fileName]) {
+        buffer.resize(range.second);
+        if (pread(fd, buffer.data(), range.second, range.first) != static_cast<ssize_t>(range.second)
+            || decodeRecord(buffer.data(), buffer.size(), recordFileName, transaction, isRemoval) != range.second) {
+            break;
+        }
+        transactions.push_back(move(transaction));
+    }
+    close(fd);
+    return transactions;
+}
+
+int SharedLog::clean(int64_t bytes, const gtfs_options_t& options) {
+    unique_lock<mutex> lock(indexMutex);
+    int fd = openLocked();
+    if (fd == -1) {
+        return -1;
+    }
+    catchUp(fd);
+    if (corrupted) {
+        // Dropping the log would lose the records past the corrupted one along with it
+        VERBOSE_PRINT(do_verbose, "Not cleaning shared log " << path << ", it has a corrupted record\n");
+        close(fd);
+        return -1;
+    }
+    // Demultiplex the records per file and checkpoint each file, all while holding the lock so no commit slips in between
+    string recordFileName;
+    Transaction transaction;
+    bool isRemoval;
+    vector<char> buffer;
+    // Records left out by the byte budget, carried over to the next generation of the log
+    vector<pair<uint64_t, uint64_t>> keptRanges;
+    // Files whose records all got applied
+    vector<string> checkpointedFiles;
+    int ret = 0;
+    for (const auto& fileRanges: recordRanges) {
+        vector<Transaction> transactions;
+        for (const auto& range: fileRanges.second) {
+            buffer.resize(range.second);
+            if (pread(fd, buffer.data(), range.second, range.first) != static_cast<ssize_t>(range.second)
+                || decodeRecord(buffer.data(), buffer.size(), recordFileName, transaction, isRemoval) != range.second) {
+                ret = -1;
+                break;
+            }
+            transactions.push_back(move(transaction));
+        }
+        truncate_to_bytes(transactions, bytes, path);
+        if (checkpoint_file(path.parent_path() / fileRanges.first, transactions, options) != 0) {
+            ret = -1;
+        }
+        if (transactions.size() < fileRanges.second.size()) {
+            keptRanges.insert(keptRanges.end(), fileRanges.second.begin() + transactions.size(), fileRanges.second.end());
+        } else {
+            checkpointedFiles.push_back(fileRanges.first);
+        }
+    }
+    if (ret != 0) {
+        // Files checkpointed already get their records applied again by the next clean, which is harmless
+        VERBOSE_PRINT(do_verbose, "Checkpoint failed, keeping shared log " << path << "\n");
+        close(fd);
+        return -1;
+    }
+    if (keptRanges.empty()) {
+        // Unlinking starts a new generation of the log for the next append, waiting writers notice the unlink once they get the lock
+        ret = fs::remove(path) ? 0 : -1;
+    } else {
+        // The next generation holds the records not applied, in log order. Renamed over the log, it unlinks the old
+        // generation as well; a crash before that leaves the old one, whose applied records get applied again
+        sort(keptRanges.begin(), keptRanges.end());
+        string records = shared_log_header();
+        for (const auto& range: keptRanges) {
+            size_t position = records.size();
+            records.resize(position + range.second);
+            if (pread_full(fd, &records[position], range.second, range.first) != static_cast<ssize_t>(range.second)) {
+                ret = -1;
+                break;
+            }
+        }
+        fs::path tempPath = path.string() + ".tmp";
+        int tempFd = ret == 0 ? open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) : -1;
+        if (tempFd == -1 || pwrite_full(tempFd, records.data(), records.size(), 0) != 0) {
+            ret = -1;
+        }
+        if (tempFd != -1) {
+            close(tempFd);
+        }
+        error_code ec;
+        if (ret == 0) {
+            fs::rename(tempPath, path, ec);
+        }
+        if (ret != 0 || ec) {
+            VERBOSE_PRINT(do_verbose, "Failed to carry the records not cleaned over to a new shared log " << path << "\n");
+            fs::remove(tempPath, ec);
+            close(fd);
+            return -1;
+        }
+        writeCounters.logBytes += records.size();
+    }
+    recordRanges.clear();
+    indexedGeneration.clear();
+    indexedBytes = 0;
+    close(fd);
+    // Open files look the log up to tell whether they are up to date, which takes the index lock
+    lock.unlock();
+    if (ret == 0) {
+        for (const auto& fileName: checkpointedFiles) {
+            openFiles.checkpointed((path.parent_path() / fileName).string());
+        }
+    }
+    return ret;
+}
+
+bool SharedLog::hasRecords(const string& fileName) {
+    lock_guard<mutex> guard(indexMutex);
+    // Unlike openLocked(), does not start a new log if there is none. A log unlinked meanwhile still gets looked at, which
+    // at worst reports records that are gone
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd == -1) {
+        return errno != ENOENT;
+    }
+    if (flock(fd, LOCK_EX) == -1) {
+        close(fd);
+        return true;
+    }
+    catchUp(fd);
+    close(fd);
+    auto it = recordRanges.find(fileName);
+    return it != recordRanges.end() && !it->second.empty();
+}
+
+string SharedLog::getPosition(const string& fileName) {
+    lock_guard<mutex> guard(indexMutex);
+    int fd = openLocked();
+    if (fd == -1) {
+        return "";
+    }
+    catchUp(fd);
+    close(fd);
+    const auto& ranges = recordRanges[fileName];
+    return indexedGeneration + ":" + (ranges.empty() ? "0" : to_string(ranges.back().first + ranges.back().second));
+}
+
+const fs::path& SharedLog::getPath() const {
+    return path;
+}
+
+size_t SharedLog::decodeRecord(const char* data, size_t size, string& fileName, Transaction& transaction, bool& isRemoval) {
+    const char* p = data;
+    const char* end = data + size;
+    uint64_t nameLength;
+    if (p >= end) {
+        return 0;
+    }
+    if (*p++ != 'w' || !parseRecordNumber(p, end, nameLength)) {
+        return p >= end ? 0 : LogManager::CORRUPT_RECORD;
+    }
+    if (nameLength + 1 > static_cast<uint64_t>(end - p)) {
+        return 0;
+    }
+    if (p[nameLength] != ' ') {
+        return LogManager::CORRUPT_RECORD;
+    }
+    fileName.assign(p, nameLength);
+    p += nameLength + 1;
+    size_t tagSize = p - data;
+    isRemoval = p < end && *p == '-';
+    if (!isRemoval) {
+        // The checksum of the transaction record is seeded with the tag, so it also covers the file name
+        size_t recordSize = LogManager::decodeTransaction(p, end - p, transaction, crc32c(0, data, tagSize));
+        return recordSize == 0 || recordSize == LogManager::CORRUPT_RECORD ? recordSize : tagSize + recordSize;
+    }
+    const char* markerEnd = ++p;
+    uint64_t checksum;
+    if (p >= end) {
+        return 0;
+    }
+    if (*p++ != ' ' || !parseRecordNumber(p, end, checksum, '\n')) {
+        return p >= end ? 0 : LogManager::CORRUPT_RECORD;
+    }
+    if (crc32c(0, data, markerEnd - data) != checksum) {
+        return LogManager::CORRUPT_RECORD;
+    }
+    return p - data;
+}
+
+size_t SharedLog::decodeHeader(const char* data, size_t size, string& generation) {
+    size_t magicSize = strlen(SHARED_LOG_MAGIC);
+    if (size <= magicSize || memcmp(data, SHARED_LOG_MAGIC, magicSize) != 0) {
+        return 0;
+    }
+    const char* newline = static_cast<const char*>(memchr(data + magicSize, '\n', size - magicSize));
+    if (!newline) {
+        return 0;
+    }
+    generation.assign(data + magicSize, newline);
+    return newline + 1 - data;
+}
+
+AlignedBufferPool::Buffer::Buffer(AlignedBufferPool* pool, char* bytes, size_t capacity): pool(pool), bytes(bytes), bufferCapacity(capacity) {}
+
+AlignedBufferPool::Buffer::Buffer(Buffer&& other): pool(other.pool), bytes(other.bytes), bufferCapacity(other.bufferCapacity) {
+    other.bytes = nullptr;
+}
+
+AlignedBufferPool::Buffer::~Buffer() {
+    if (bytes) {
+        pool->release(bytes, bufferCapacity);
+    }
+}
+
+char* AlignedBufferPool::Buffer::data() {
+    return bytes;
+}
+
+size_t AlignedBufferPool::Buffer::capacity() const {
+    return bufferCapacity;
+}
+
+AlignedBufferPool::~AlignedBufferPool() {
+    for (auto& sizeBuffers: freeBuffers) {
+        for (char* bytes: sizeBuffers.second) {
+            free(bytes);
+        }
+    }
+}
+
+AlignedBufferPool::Buffer AlignedBufferPool::acquire(size_t size) {
+    // Capacities are powers of two so buffers of similar sizes get reused
+    size_t capacity = ALIGNMENT;
+    while (capacity < size) {
+        capacity <<= 1;
+    }
+    {
+        lock_guard<mutex> guard(poolMutex);
+        auto& sizeBuffers = freeBuffers[capacity];
+        if (!sizeBuffers.empty()) {
+            char* bytes = sizeBuffers.back();
+            sizeBuffers.pop_back();
+            pooledBytes -= capacity;
+            return Buffer(this, bytes, capacity);
+        }
+    }
+    void* bytes = nullptr;
+    if (posix_memalign(&bytes, ALIGNMENT, capacity) != 0) {
+        throw bad_alloc();
+    }
+    return Buffer(this, static_cast<char*>(bytes), capacity);
+}
+
+void AlignedBufferPool::release(char* bytes, size_t capacity) {
+    lock_guard<mutex> guard(poolMutex);
+    if (pooledBytes + capacity > MAX_POOLED_BYTES) {
+        free(bytes);
+        return;
+    }
+    freeBuffers[capacity].push_back(bytes);
+    pooledBytes += capacity;
+}
+
+void BufferCache::setBudget(size_t bytes) {
+    lock_guard<mutex> guard(cacheMutex);
+    budgetBytes = bytes;
+    while (usedBytes > budgetBytes && makeRoom()) {}
+    if (budgetBytes == 0) {
+        files.clear();
+        slots.clear();
+        freeSlots.clear();
+        usedBytes = 0;
+    }
+}
+
+bool BufferCache::isEnabled() {
+    lock_guard<mutex> guard(cacheMutex);
+    return budgetBytes > 0;
+}
+
+void BufferCache::insert(const string& path, const string& version, VMSegment& segment) {
+    lock_guard<mutex> guard(cacheMutex);
+    eraseFile(path);
+    if (budgetBytes == 0) {
+        return;
+    }
+    CachedFile& file = files[path];
+    file.version = version;
+    file.size = segment.size();
+    vector<char> data;
+    bool dirty;
+    for (VMSizeT pageIndex = 0; pageIndex < segment.pageCount(); ++pageIndex) {
+        // Clean pages that are not resident need not be cached, they can be read from the data file again
+        if (!segment.copyPage(pageIndex, data, dirty)) {
+            file.slots.push_back(NOT_CACHED);
+            continue;
+        }
+        if (!makeRoom()) {
+            if (dirty) {
+                eraseFile(path);
+                return;
+            }
+            file.slots.push_back(NOT_CACHED);
+            continue;
+        }
+        long slotIndex;
+        if (!freeSlots.empty()) {
+            slotIndex = freeSlots.back();
+            freeSlots.pop_back();
+        } else {
+            slotIndex = slots.size();
+            slots.emplace_back();
+        }
+        // Pages of the file being inserted get evicted last: they start out referenced
+        Slot& slot = slots[slotIndex];
+        slot.path = path;
+        slot.pageIndex = pageIndex;
+        slot.data = move(data);
+        slot.dirty = dirty;
+        slot.referenced = true;
+        slot.used = true;
+        usedBytes += VMSegment::PAGE_SIZE;
+        file.slots.push_back(slotIndex);
+    }
+}
+
+bool BufferCache::take(const string& path, const string& version, VMSegment& segment) {
+    lock_guard<mutex> guard(cacheMutex);
+    auto it = files.find(path);
+    bool complete = it != files.end() && it->second.version == version
+        && find(it->second.slots.begin(), it->second.slots.end(), EVICTED) == it->second.slots.end();
+    if (!complete) {
+        if (it != files.end()) {
+            eraseFile(path);
+        }
+        stats.misses++;
+        return false;
+    }
+    segment.resize(it->second.size);
+    for (VMSizeT pageIndex = 0; pageIndex < it->second.slots.size(); ++pageIndex) {
+        long slotIndex = it->second.slots[pageIndex];
+        if (slotIndex >= 0) {
+            segment.adoptPage(pageIndex, move(slots[slotIndex].data), slots[slotIndex].dirty);
+        }
+    }
+    // The open file owns its contents now, they get cached again when it is closed
+    eraseFile(path);
+    stats.hits++;
+    return true;
+}
+
+void OpenFiles::add(const string& path, TransactionManager* transactionManager) {
+    lock_guard<mutex> guard(filesMutex);
+    files.emplace(path, transactionManager);
+}
+
+void OpenFiles::remove(TransactionManager* transactionManager) {
+    lock_guard<mutex> guard(filesMutex);
+    for (auto it = files.begin(); it != files.end(); ++it) {
+        if (it->second == transactionManager) {
+            files.erase(it);
+            return;
+        }
+    }
+}
+
+void OpenFiles::checkpointed(const string& path) {
+    // Held throughout, so the files cannot get closed meanwhile
+    lock_guard<mutex> guard(filesMutex);
+    auto range = files.equal_range(path);
+    for (auto it = range.first; it != range.second; ++it) {
+        it->second->checkpointed();
+    }
+}
+
+void BufferCache::invalidate(const string& path) {
+    lock_guard<mutex> guard(cacheMutex);
+    eraseFile(path);
+}
+
+gtfs_buffer_cache_stats_t BufferCache::getStats() {
+    lock_guard<mutex> guard(cacheMutex);
+    auto current = stats;
+    current.usedBytes = usedBytes;
+    current.budgetBytes = budgetBytes;
+    return current;
+}
+
+void BufferCache::eraseFile(const string& path) {
+    auto it = files.find(path);
+    if (it == files.end()) {
+        return;
+    }
+    for (long slotIndex: it->second.slots) {
+        if (slotIndex >= 0) {
+            slots[slotIndex] = Slot();
+            freeSlots.push_back(slotIndex);
+            usedBytes -= VMSegment::PAGE_SIZE;
+        }
+    }
+    files.erase(it);
+}
+
+bool BufferCache::makeRoom() {
+    if (budgetBytes < VMSegment::PAGE_SIZE) {
+        return false;
+    }
+    // Second chance: referenced pages get their bit cleared and are skipped once, the first unreferenced one is evicted
+    while (usedBytes + VMSegment::PAGE_SIZE > budgetBytes) {
+        clockHand = clockHand >= slots.size() ? 0 : clockHand;
+        Slot& slot = slots[clockHand];
+        if (slot.used && slot.referenced) {
+            slot.referenced = false;
+        } else if (slot.used) {
+            // Without a dirty page the file cannot be restored, a clean one can still be read from the data file
+            files[slot.path].slots[slot.pageIndex] = slot.dirty ? EVICTED : NOT_CACHED;
+            slot = Slot();
+            freeSlots.push_back(clockHand);
+            usedBytes -= VMSegment::PAGE_SIZE;
+            stats.evictedPages++;
+        }
+        clockHand++;
+    }
+    return true;
+}
+
+int gtfs_start_replication(gtfs_t* primary, gtfs_t* standby, size_t checkpointBytes) {
     int ret = -1;
-    if (write_id) {
-        VERBOSE_PRINT(do_verbose, "Persisting [ " << bytes << " bytes ] write of " << write_id->length << " bytes starting from offset " << write_id->offset << " inside file " << write_id->filename << "\n");
+    if (primary and standby) {
+        VERBOSE_PRINT(do_verbose, "Starting replication from " << primary->dirname << " to " << standby->dirname << "\n");
     } else {
-        VERBOSE_PRINT(do_verbose, "Write operation does not exist\n");
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
         return ret;
     }
-
-    // Commit only the first `bytes` bytes of the transaction to the log file
-    ret = write_id->file->transactionManager->commitTransaction(write_id->transactionId, bytes);
-    if (ret == -1) {
-        VERBOSE_PRINT(do_verbose, "Number of bytes to sync was more than the bytes written in write_id\n");
+    if (primary == standby) {
+        VERBOSE_PRINT(do_verbose, "A GTFileSystem cannot be its own standby\n");
         return ret;
     }
-
-    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    ret = primary->replicator->start(primary, standby, checkpointBytes);
+    VERBOSE_PRINT(do_verbose, (ret == 0 ? "Success\n" : "Failed to start replication\n")); //On success returns 0.
     return ret;
 }
 
-BaseTransactionManager::BaseTransactionManager(VMSegment&& vmSegment): vmSegment(vmSegment) {}
+int gtfs_stop_replication(gtfs_t* primary) {
+    if (!primary) {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
+        return -1;
+    }
+    VERBOSE_PRINT(do_verbose, "Stopping replication of " << primary->dirname << "\n");
+    return primary->replicator->stop();
+}
 
-TransactionID BaseTransactionManager::createTransaction(VMSizeT offset, VMSizeT length, const char* newData) {
-    Transaction transaction;
-    transaction.transactionId = totalTransactionCount++;
-    transaction.offset = offset;
-    // Calculate the sizes for undo and redo data for the transaction
-    VMSizeT oldSize = max(min(length, vmSegment.size() - offset), size_t{0});
-    vector<char>::iterator vmBegin = vmSegment.begin() + offset;
-    transaction.oldData.resize(oldSize);
-    transaction.newData.resize(length);
-    // Copy the managed data from the VM segment offset to the undo data, and from newData to the redo data
-    copy(vmBegin, vmBegin + oldSize, transaction.oldData.begin());
-    copy(newData, newData + length, transaction.newData.begin());
+gtfs_replication_stats_t gtfs_get_replication_stats(gtfs_t* primary) {
+    if (!primary) {
+        return gtfs_replication_stats_t();
+    }
+    return primary->replicator->getStats();
+}
 
-    // Extend the managed VM segment if required for writing outside bounds of the segment
-    // Can be easily done because the VM segment is a vector of chars.
-    if (offset + length > vmSegment.size()) {
-        vmSegment.resize(offset + length);
+int gtfs_promote_standby(gtfs_t* primary) {
+    if (!primary || !primary->replicator->getStandby()) {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist or has no standby\n");
+        return -1;
+    }
+    VERBOSE_PRINT(do_verbose, "Promoting standby of " << primary->dirname << "\n");
+    primary->replicator->stop();
+    if (primary->replicator->getStats().failedRecords > 0) {
+        VERBOSE_PRINT(do_verbose, "Standby misses records it failed to apply, not promoting it\n");
+        return -1;
     }
-    // Also copy the newData to the VM segment at the offset
-    copy(newData, newData + length, vmSegment.begin() + offset);
+    // Checkpoint everything the standby's logs still hold, so opening its files replays nothing
+    return gtfs_clean(primary->replicator->getStandby());
+}
 
-    uncommittedTransactions.push_back(transaction);
-    return transaction.transactionId;
+Replicator::~Replicator() {
+    stop();
 }
 
-int BaseTransactionManager::abortTransaction(TransactionID transactionId) {
-    for (auto it = uncommittedTransactions.begin(); it != uncommittedTransactions.end(); it++) {
-        if (it->transactionId == transactionId) {
-            // Apply the undo data from the transaction to the VM segment, and erase the transaction
-            copy(it->oldData.begin(), it->oldData.end(), vmSegment.begin() + it->offset);
-            uncommittedTransactions.erase(it);
-            return 0;
+int Replicator::start(gtfs_t* primary, gtfs_t* standby, size_t checkpointBytes) {
+    if (active || applier.joinable()) {
+        return -1;
+    }
+    this->standby = standby;
+    this->checkpointBytes = checkpointBytes;
+    stopping = false;
+    // The files get copied over again, which makes up for the records a previous run failed to apply
+    failedRecords = 0;
+    // Ship from now on, then copy what was committed before. Commits made in between end up both in the copy and
+    // shipped, which replaying redo records in order makes harmless
+    active = true;
+    error_code ec;
+    for (auto& p: fs::directory_iterator(primary->dirname, ec)) {
+        auto name = p.path().filename().string();
+        if (!p.is_regular_file() || name == DIRTY_MANIFEST_NAME || p.path().extension() == ".tmp") {
+            continue;
+        }
+        if (!fs::copy_file(p.path(), fs::path(standby->dirname) / name, fs::copy_options::overwrite_existing, ec)) {
+            VERBOSE_PRINT(do_verbose, "Failed to copy " << p.path() << " to the standby\n");
+            active = false;
+            return -1;
         }
     }
-    return -1;
+    // The standby's dirty file manifest gets rebuilt from the copied logs
+    fs::remove(fs::path(standby->dirname) / DIRTY_MANIFEST_NAME, ec);
+    applier = thread(&Replicator::run, this);
+    return 0;
 }
 
-int BaseTransactionManager::replayTransactions(const vector<Transaction>& transactions) {
-    // First find the max last index in the transactions
-    auto maxOffsetElement = max_element(transactions.begin(), transactions.end(), [](const Transaction& t1, const Transaction& t2) {
-        return (t1.offset + t1.newData.size()) < (t2.offset + t2.newData.size());
-    });
-    if (maxOffsetElement == transactions.end()) {
-        return 0;
-    }
-    VMSizeT maxOffset = maxOffsetElement->offset + maxOffsetElement->newData.size();
-    // Resize the VM segment to accommodate the max offset
-    if (maxOffset > vmSegment.size()) {
-        vmSegment.resize(maxOffset);
-    }
-    for (const auto& transaction: transactions) {
-        copy(transaction.newData.begin(), transaction.newData.end(), vmSegment.begin() + transaction.offset);
+int Replicator::stop() {
+    {
+        lock_guard<mutex> guard(queueMutex);
+        if (!active) {
+            return -1;
+        }
+        active = false;
+        stopping = true;
     }
+    queueChanged.notify_all();
+    applier.join();
     return 0;
 }
 
-vector<char>& BaseTransactionManager::getVMBase() {
-    return vmSegment;
+bool Replicator::isActive() const {
+    return active;
 }
 
-TransactionManager::TransactionManager(const fs::path& originalFilePath, VMSegment&& vmSegment)
-    : BaseTransactionManager(move(vmSegment)), logFilePath(originalFilePath.string() + ".log") {}
+gtfs_t* Replicator::getStandby() const {
+    return standby;
+}
 
-int TransactionManager::commitTransaction(TransactionID transactionId, int bytes) {
-    for (auto it = uncommittedTransactions.begin(); it != uncommittedTransactions.end(); it++) {
-        if (it->transactionId == transactionId) {
-            // If `bytes` is provided, then only commit the first `bytes` bytes of the transaction
-            if (bytes != -1) {
-                if (bytes > it->newData.size()) {
-                    return -1;
-                } else {
-                    it->newData.resize(bytes);
-                }
-            }
-            LogManager::writeTransaction(logFilePath, *it);
-            uncommittedTransactions.erase(it);
-            return 0;
+void Replicator::shipCommit(const string& fileName, const Transaction& transaction, bool toSharedLog) {
+    ship(Shipment{fileName, transaction, false, toSharedLog, chrono::steady_clock::now()});
+}
+
+void Replicator::shipRemoval(const string& fileName) {
+    ship(Shipment{fileName, Transaction(), true, false, chrono::steady_clock::now()});
+}
+
+void Replicator::ship(Shipment&& shipment) {
+    {
+        // Checked under the lock, so nothing gets queued once stop() drained the queue
+        lock_guard<mutex> guard(queueMutex);
+        if (!active) {
+            return;
         }
+        shippedRecords++;
+        pendingBytes += shipment.transaction.newData.size();
+        queue.push_back(move(shipment));
     }
-    return -1;
+    queueChanged.notify_all();
 }
 
-fs::path TransactionManager::getLogFilePath() const {
-    return logFilePath;
+gtfs_replication_stats_t Replicator::getStats() {
+    lock_guard<mutex> guard(queueMutex);
+    gtfs_replication_stats_t stats;
+    stats.active = active;
+    stats.shippedRecords = shippedRecords;
+    stats.appliedRecords = appliedRecords;
+    stats.failedRecords = failedRecords;
+    stats.pendingRecords = queue.size() + (applying ? 1 : 0);
+    stats.pendingBytes = pendingBytes;
+    if (stats.pendingRecords > 0) {
+        auto oldest = applying ? applyingShippedAt : queue.front().shippedAt;
+        stats.lagSeconds = chrono::duration<double>(chrono::steady_clock::now() - oldest).count();
+    }
+    stats.uncheckpointedBytes = uncheckpointedBytes;
+    return stats;
 }
 
-ostream& operator<<(ostream& os, const Transaction& transaction) {
-    os<< transaction.transactionId<< " "<< transaction.offset<< " "<< transaction.newData.size()<< " ";
-    for (const auto& c: transaction.newData) {
-        os << c;
+void Replicator::run() {
+    auto standbyDir = fs::path(standby->dirname);
+    unique_lock<mutex> lock(queueMutex);
+    while (true) {
+        queueChanged.wait(lock, [this] { return stopping || !queue.empty(); });
+        if (queue.empty()) {
+            break;
+        }
+        Shipment shipment = move(queue.front());
+        queue.pop_front();
+        applying = true;
+        applyingShippedAt = shipment.shippedAt;
+        lock.unlock();
+
+        // Append to the same kind of log as the primary did, so the standby's cleans apply the records in commit order
+        auto logFilePath = standbyDir / (shipment.fileName + ".log");
+        int ret = 0;
+        if (shipment.isRemoval) {
+            error_code ec;
+            fs::remove(standbyDir / shipment.fileName, ec);
+            LogManager::removeLog(logFilePath);
+            if (fs::exists(standbyDir / SHARED_LOG_NAME)) {
+                ret = get_shared_log(standby)->appendRemoval(shipment.fileName);
+            }
+        } else if (shipment.toSharedLog) {
+            ret = get_shared_log(standby)->append(shipment.fileName, shipment.transaction);
+        } else {
+            ret = LogManager::writeTransaction(logFilePath, shipment.transaction, standby->options);
+        }
+        if (ret != 0) {
+            VERBOSE_PRINT(do_verbose, "Failed to apply a record of " << shipment.fileName << " to the standby\n");
+        }
+
+        size_t bytes = shipment.transaction.newData.size();
+        lock.lock();
+        applying = false;
+        pendingBytes -= bytes;
+        // A failed record is not in the standby's logs, which keeps the standby from being promoted until replication restarts
+        if (ret != 0) {
+            failedRecords++;
+            continue;
+        }
+        appliedRecords++;
+        uncheckpointedBytes += bytes;
+        // Checkpoint the standby's logs regularly, so that a takeover only has a bounded amount of log to replay
+        if (uncheckpointedBytes >= checkpointBytes) {
+            lock.unlock();
+            gtfs_clean(standby);
+            lock.lock();
+            uncheckpointedBytes = 0;
+        }
     }
-    return os;
 }
 
-istream& operator>>(istream& is, Transaction& transaction) {
-    size_t newDataSize;
-    // Skip whitespaces (because redo data might have whitespace chars) and read the transaction id, offset and redo data size
-    is.unsetf(ios_base::skipws);
-    is>> transaction.transactionId;
-    is.ignore(1);
-    is >> transaction.offset;
-    is.ignore(1);
-    is >> newDataSize;
-    is.ignore(1);
-    transaction.oldData.clear();
-    transaction.newData.resize(newDataSize);
-    // Read the redo data now
-    for (size_t i = 0; i < newDataSize; ++i) {
-        is >> transaction.newData[i];
+int gtfs_start_cleaner(gtfs_t* gtfs, const gtfs_cleaner_options_t& options) {
+    if (!gtfs) {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
+        return -1;
     }
-    return is;
+    VERBOSE_PRINT(do_verbose, "Starting background cleaner inside directory " << gtfs->dirname << "\n");
+    if (options.chunkBytes <= 0) {
+        VERBOSE_PRINT(do_verbose, "Cleaner chunks must be at least 1 byte\n");
+        return -1;
+    }
+    return gtfs->cleaner->start(gtfs, options);
 }
 
-vector<Transaction> LogManager::getTransactionsInLog(const fs::path& logFilePath) {
-    ifstream logFile(logFilePath, ios::binary);
-    vector<Transaction> transactions;
-    if (!logFile.is_open()) {
-        return transactions;
+int gtfs_stop_cleaner(gtfs_t* gtfs) {
+    if (!gtfs) {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
+        return -1;
     }
-    Transaction transaction;
-    // Read the transactions one by one from the log file until eof
-    while (logFile.peek() != char_traits<char>::eof() && logFile>> transaction) {
-        transactions.push_back(transaction);
+    VERBOSE_PRINT(do_verbose, "Stopping background cleaner inside directory " << gtfs->dirname << "\n");
+    return gtfs->cleaner->stop();
+}
+
+gtfs_cleaner_stats_t gtfs_get_cleaner_stats(gtfs_t* gtfs) {
+    if (!gtfs) {
+        return gtfs_cleaner_stats_t();
     }
-    logFile.close();
-    return transactions;
+    return gtfs->cleaner->getStats();
 }
 
-int LogManager::writeTransaction(const fs::path& logFilePath, const Transaction& transaction) {
-    ofstream logFile(logFilePath, ios::binary | ios::app);
-    if (!logFile.is_open()) {
+Cleaner::~Cleaner() {
+    stop();
+}
+
+int Cleaner::start(gtfs_t* gtfs, const gtfs_cleaner_options_t& options) {
+    lock_guard<mutex> guard(stateMutex);
+    if (worker.joinable()) {
         return -1;
     }
-    logFile<< transaction;
-    logFile.close();
+    this->gtfs = gtfs;
+    this->options = options;
+    stopping = false;
+    stats = gtfs_cleaner_stats_t();
+    stats.running = true;
+    worker = thread(&Cleaner::run, this);
+    return 0;
+}
+
+int Cleaner::stop() {
+    {
+        lock_guard<mutex> guard(stateMutex);
+        if (!worker.joinable()) {
+            return -1;
+        }
+        stopping = true;
+    }
+    stateChanged.notify_all();
+    worker.join();
+    lock_guard<mutex> guard(stateMutex);
+    stats.running = false;
+    return 0;
+}
+
+gtfs_cleaner_stats_t Cleaner::getStats() {
+    lock_guard<mutex> guard(stateMutex);
+    return stats;
+}
+
+unique_lock<mutex> Cleaner::suspend() {
+    unique_lock<mutex> lock(chunkMutex);
+    cursors.clear();
+    return lock;
+}
+
+bool Cleaner::pause(double seconds) {
+    unique_lock<mutex> lock(stateMutex);
+    return !stateChanged.wait_for(lock, chrono::duration<double>(seconds), [this] { return stopping; });
+}
+
+bool Cleaner::yieldToCommits() {
+    if (foregroundCommits == 0) {
+        return pause(0);
+    }
+    auto start = chrono::steady_clock::now();
+    bool running = true;
+    while (foregroundCommits > 0 && running
+        && chrono::duration<double>(chrono::steady_clock::now() - start).count() < options.maxYieldSeconds) {
+        running = pause(0.0001);
+    }
+    lock_guard<mutex> guard(stateMutex);
+    stats.yields++;
+    stats.throttledSeconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    return running;
+}
+
+/** Returns the size of the segments of a segmented log */
+static uint64_t segmented_log_bytes(const fs::path& logFilePath, uint64_t firstSegment, uint64_t lastSegment) {
+    uint64_t bytes = 0;
+    for (uint64_t segment = firstSegment; segment <= lastSegment; ++segment) {
+        error_code ec;
+        auto size = fs::file_size(LogManager::getSegmentPath(logFilePath, segment), ec);
+        bytes += ec ? 0 : size;
+    }
+    return bytes;
+}
+
+uint64_t Cleaner::cleanChunk(const string& fileName, uint64_t& cleanedBytes) {
+    auto logFilePath = fs::path(gtfs->dirname) / (fileName + ".log");
+    uint64_t firstSegment, lastSegment;
+    if (LogManager::readSegmentManifest(logFilePath, firstSegment, lastSegment)) {
+        // Dropping segments rewrites the manifest commits append through, so commits wait for the chunk
+        unique_lock<shared_mutex> appends(logAppendGate);
+        uint64_t before = segmented_log_bytes(logFilePath, firstSegment, lastSegment);
+        // Segments get applied whole, let the chunk take the oldest one even if it is larger
+        error_code ec;
+        auto oldestSize = fs::file_size(LogManager::getSegmentPath(logFilePath, firstSegment), ec);
+        int64_t bytes = max<int64_t>(options.chunkBytes, ec ? 0 : oldestSize);
+        if (clean_n_bytes(logFilePath, bytes, gtfs->options) != 0) {
+            VERBOSE_PRINT(do_verbose, "Background clean of log file " << logFilePath << " failed\n");
+        }
+        uint64_t after = LogManager::readSegmentManifest(logFilePath, firstSegment, lastSegment)
+            ? segmented_log_bytes(logFilePath, firstSegment, lastSegment) : 0;
+        cleanedBytes += before > after ? before - after : 0;
+        // Compaction keeps the live bytes in the log, a log-structured log has nothing left to clean
+        return gtfs->options.logStructured ? 0 : after;
+    }
+
+    // The data file gets created by the checkpoint, only go ahead if there is a log
+    struct stat st;
+    if (stat(logFilePath.c_str(), &st) == -1) {
+        cursors.erase(fileName);
+        return 0;
+    }
+    auto& cursor = cursors[fileName];
+    if (cursor.logInode != st.st_ino) {
+        cursor = Cursor{static_cast<uint64_t>(st.st_ino), 0};
+    }
+    // Applying the records past the cursor again is harmless, redo records carry the bytes they write
+    RedoBudget budget{options.chunkBytes};
+    // The replay moves `offset` past a record before handing it over, `applied` only once it got applied
+    uint64_t offset = cursor.offset, applied = cursor.offset, logInode = 0;
+    ReplayEnd end = ReplayEnd::COMPLETE;
+    int checkpointed = checkpoint_file(original_file_path(logFilePath), [&](const function<bool(const Transaction&)>& apply) {
+        end = replay_log_file(logFilePath, offset, [&](Transaction& transaction) {
+            if (budget.exhausted()) {
+                return false;
+            }
+            if (!budget.take(transaction)) {
+                // Take at least one record, so records larger than a chunk get cleaned too
+                if (applied > cursor.offset) {
+                    return false;
+                }
+                budget.bytes = 0;
+            }
+            if (!apply(transaction)) {
+                return false;
+            }
+            applied = offset;
+            return true;
+        }, false, &logInode);
+    }, gtfs->options);
+    if (logInode != cursor.logInode) {
+        // The log got replaced in between, start over on the new one
+        cursor = Cursor{logInode, 0};
+        return logInode == 0 ? 0 : st.st_size;
+    }
+    if (checkpointed != 0) {
+        // The chunk is not in the data file, the cursor stays so the next pass applies it again
+        VERBOSE_PRINT(do_verbose, "Background checkpoint of log file " << logFilePath << " failed\n");
+        return st.st_size > static_cast<off_t>(cursor.offset) ? st.st_size - cursor.offset : 0;
+    }
+    cleanedBytes += applied - cursor.offset;
+    cursor.offset = applied;
+    if (end != ReplayEnd::COMPLETE) {
+        return st.st_size > static_cast<off_t>(applied) ? st.st_size - applied : 0;
+    }
+    // Commits may have appended records since the replay ended, apply those too before dropping the log
+    unique_lock<shared_mutex> appends(logAppendGate);
+    checkpointed = checkpoint_file(original_file_path(logFilePath), [&](const function<bool(const Transaction&)>& apply) {
+        end = replay_log_file(logFilePath, offset, [&](Transaction& transaction) {
+            return apply(transaction);
+        }, false, &logInode);
+    }, gtfs->options);
+    if (checkpointed != 0 || end != ReplayEnd::COMPLETE || logInode != cursor.logInode) {
+        // Left for the next pass, which starts over if the log got replaced
+        return 0;
+    }
+    cleanedBytes += offset - cursor.offset;
+    if (!LogManager::removeLog(logFilePath)) {
+        VERBOSE_PRINT(do_verbose, "Failed to delete log file " << logFilePath << "\n");
+    } else {
+        openFiles.checkpointed(original_file_path(logFilePath).string());
+    }
+    cursors.erase(fileName);
     return 0;
 }
+
+void Cleaner::run() {
+    // Bytes the chunks write, counted through the process-wide write counters, so foreground checkpoints and compactions
+    // made at the same time are charged to the cleaner as well
+    auto writtenBytes = [] {
+        return writeCounters.checkpointBytes + writeCounters.compactedBytes;
+    };
+    while (true) {
+        auto dirtyFiles = get_dirty_files(gtfs->dirname);
+        uint64_t passCleanedBytes = 0, backlogBytes = 0;
+        for (const auto& fileName: dirtyFiles) {
+            if (!yieldToCommits()) {
+                return;
+            }
+            uint64_t writtenBefore = writtenBytes(), cleanedBytes = 0;
+            {
+                lock_guard<mutex> chunk(chunkMutex);
+                backlogBytes += cleanChunk(fileName, cleanedBytes);
+            }
+            uint64_t written = writtenBytes() - writtenBefore;
+            passCleanedBytes += cleanedBytes;
+            double throttle = options.bytesPerSecond > 0 ? static_cast<double>(written) / options.bytesPerSecond : 0;
+            {
+                lock_guard<mutex> guard(stateMutex);
+                stats.chunks += cleanedBytes > 0 || written > 0;
+                stats.cleanedBytes += cleanedBytes;
+                stats.writtenBytes += written;
+                stats.throttledSeconds += throttle;
+            }
+            if (throttle > 0 && !pause(throttle)) {
+                return;
+            }
+        }
+        if (prune_dirty_files(gtfs->dirname, dirtyFiles) != 0) {
+            VERBOSE_PRINT(do_verbose, "Failed to update dirty file manifest of " << gtfs->dirname << "\n");
+        }
+        {
+            lock_guard<mutex> guard(stateMutex);
+            stats.passes++;
+            stats.backlogBytes = backlogBytes;
+        }
+        if (!pause(passCleanedBytes == 0 ? options.idleSeconds : 0)) {
+            return;
+        }
+    }
+}
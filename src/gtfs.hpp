@@ -6,10 +6,18 @@
 #include <cstdlib>
 #include <iostream>
 #include <unordered_map>
+#include <map>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <vector>
 #include <memory>
+#include <mutex>
+#include <atomic>
+#include <deque>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
 
 /*********** Cross-compiler <filesystem> include taken from https://stackoverflow.com/a/53365539 *********/ 
 
@@ -77,26 +85,113 @@ namespace fs = std::filesystem;
 extern int do_verbose;
 
 class TransactionManager;
+class SharedLog;
+class MemoryBudget;
+class Replicator;
+class Cleaner;
 using TransactionID = uint32_t;
+#define INVALID_TRANSACTION_ID UINT32_MAX
 using VMSizeT = size_t;
 
+/** Tunables of a GTFileSystem instance: set them on gtfs_t::options right after gtfs_init(), before opening files */
+typedef struct gtfs_options {
+    // Log only the byte runs a write actually changed instead of its whole redo data, and skip no-op writes
+    bool deltaEncoding = false;
+    // Split each file's log into segments of about this many bytes (0 keeps a single log file). <file>.log then holds a
+    // small manifest of the live segments <file>.log.<n>, and partial cleans drop whole segments instead of the whole log
+    VMSizeT logSegmentSize = 0;
+    // Append the commits of all files to a single directory-wide log (.gtfs.wal) instead of one <file>.log per file
+    bool sharedLog = false;
+    // Bypass the page cache (O_DIRECT) for log appends and checkpoint writes, through pooled aligned buffers.
+    // Falls back to buffered I/O on file systems without direct I/O support
+    bool directIO = false;
+    // Cap in bytes on the memory held by the open files (0 for no cap). Above it, pages still identical to the data file
+    // get dropped and are read back when accessed again. Taken into account by the files opened after it is set
+    size_t memoryBudget = 0;
+    // Extend files to the length they are opened with by allocating their blocks (fallocate) instead of leaving a hole
+    bool preallocate = false;
+    // Write the redo data of commits of at least this many bytes (0 to disable) once, to the sidecar file <file>.log.ext,
+    // and log only a reference to it. Checkpoints copy the extent into the data file inside the kernel (copy_file_range,
+    // a reflink where the file system supports it). Commits to the shared log always keep their data in the log
+    VMSizeT largeWriteThreshold = 0;
+    // Log-structured engine: the segments of each file's log (of logSegmentSize bytes, 1 MiB if unset) are where its
+    // contents live, the data file keeps the contents it had before and is never written back. Cleans compact the oldest
+    // segments instead, appending the bytes still live in them to the log, as long as live bytes make up less than
+    // compactionLiveRatio of the logged bytes. Commits bypass the shared log and the sidecar file
+    bool logStructured = false;
+    double compactionLiveRatio = 0.5;
+    // Cap in bytes on the undo and redo data of each open file's uncommitted writes kept in memory (0 for no cap).
+    // Writes past it move theirs to an unlinked spill file next to the data file, read back when they are committed or aborted
+    size_t uncommittedBudget = 0;
+    // Threads replaying a large log when a file gets opened, each applying the records of its own offset ranges
+    // (0 for one per core, up to 8)
+    unsigned replayThreads = 0;
+} gtfs_options_t;
+
 typedef struct gtfs {
     string dirname;
+    // Open directory, files get opened and created relative to it
+    int directoryFd = -1;
+    gtfs_options_t options;
+    // Directory-wide write-ahead log, set up on first use when options.sharedLog is set
+    shared_ptr<SharedLog> sharedLog;
+    // Memory accounting of the open files, shared by their VM segments
+    shared_ptr<MemoryBudget> memoryBudget;
+    // Ships commits to a standby instance once replication is started
+    shared_ptr<Replicator> replicator;
+    // Checkpoints the logs in the background once started
+    shared_ptr<Cleaner> cleaner;
 } gtfs_t;
 
+/**
+ * Handle of a write, see gtfs_write_file_handle(). Refers to a slot of the write slab of the file; the slot's generation
+ * changes once the handle gets released, which makes stale copies of it fail. A zeroed handle is invalid
+ */
+typedef struct gtfs_write_handle {
+    uint32_t slot = 0;
+    uint32_t generation = 0;
+} gtfs_write_handle_t;
+
+/** Write handles of an open file. Released slots get reused, so a file needs no more slots than writes it has in flight */
+class WriteSlab {
+public:
+    gtfs_write_handle_t acquire(TransactionID transactionId);
+    /** Returns the transaction of the handle, INVALID_TRANSACTION_ID if the handle is invalid or was released */
+    TransactionID lookup(gtfs_write_handle_t handle) const;
+    int release(gtfs_write_handle_t handle);
+private:
+    struct Slot {
+        TransactionID transactionId = INVALID_TRANSACTION_ID;
+        // Odd while the slot is handed out, so a released slot matches no handle
+        uint32_t generation = 0;
+    };
+    vector<Slot> slots;
+    vector<uint32_t> freeSlots;
+};
+
 typedef struct file {
     string filename;
-    int fileLength;
+    off_t fileLength;
     int fileDescriptor = -1;
     unique_ptr<TransactionManager> transactionManager;
+    // Opened with gtfs_open_file_readonly(): the file is not locked and writes are refused
+    bool readOnly = false;
+    // Read-only files: state of the data file and of the log the view was built from, to refresh it incrementally
+    string dataVersion;
+    uint64_t logInode = 0;
+    uint64_t logOffset = 0;
+    bool incrementalRefresh = false;
+    WriteSlab writes;
 } file_t;
 
+/** Heap-allocated write of the original API, a wrapper around a write handle. Release it with gtfs_release_write_file() */
 typedef struct write {
     string filename;
-    int offset;
-    int length;
+    off_t offset;
+    size_t length;
     file_t* file;
     TransactionID transactionId;
+    gtfs_write_handle_t handle;
 } write_t;
 
 // GTFileSystem basic API calls
@@ -107,58 +202,732 @@ int gtfs_clean(gtfs_t *gtfs);
 file_t* gtfs_open_file(gtfs_t* gtfs, string filename, int file_length);
 int gtfs_close_file(gtfs_t* gtfs, file_t* fl);
 int gtfs_remove_file(gtfs_t* gtfs, file_t* fl);
+/**
+ * Opens an existing file for reading without locking it, so that writers are never blocked. The view is made of the
+ * data file and the intact log records committed at the time of the open. Once a clean changed the data file, reads
+ * that need a page not read yet fail rather than mix old and new contents, until gtfs_refresh_file() rebuilds the view.
+ */
+file_t* gtfs_open_file_readonly(gtfs_t* gtfs, string filename);
+/** Brings the view of a read-only file up to date, reading only the log records appended since the last open or refresh */
+int gtfs_refresh_file(gtfs_t* gtfs, file_t* fl);
+/** Opens many files at once, in parallel. Returns the files in the order of `filenames`, NULL for those that failed to open */
+vector<file_t*> gtfs_open_files(gtfs_t* gtfs, const vector<string>& filenames, const vector<int>& fileLengths);
 
 char* gtfs_read_file(gtfs_t* gtfs, file_t* fl, int offset, int length);
 write_t* gtfs_write_file(gtfs_t* gtfs, file_t* fl, int offset, int length, const char* data);
 int gtfs_sync_write_file(write_t* write_id);
+/**
+ * Commits all uncommitted writes of the file at once. Adjacent and overlapping writes are merged into as few log records
+ * as possible, all appended in a single write. Syncing or aborting their write_t afterwards fails
+ */
+int gtfs_sync_file(gtfs_t* gtfs, file_t* fl);
 int gtfs_abort_write_file(write_t* write_id);
 
+/** Releases the handle of the write and deletes the write_t. A write still uncommitted stays pending, see gtfs_release_write_handle() */
+int gtfs_release_write_file(write_t* write_id);
+
+// Handle-based writes: like the write_t calls, without an allocation per write. The handles come from a slab kept by
+// the file and must be released once the write got synced or aborted, or is left to gtfs_sync_file()
+
+/** Same as gtfs_write_file64(), returns a handle instead. The handle is invalid (zeroed) on failure */
+gtfs_write_handle_t gtfs_write_file_handle(gtfs_t* gtfs, file_t* fl, off_t offset, size_t length, const char* data);
+/** Commits the write, or its first `bytes` bytes if `bytes` is not -1 */
+int gtfs_sync_write_handle(file_t* fl, gtfs_write_handle_t handle, int64_t bytes = -1);
+int gtfs_abort_write_handle(file_t* fl, gtfs_write_handle_t handle);
+/**
+ * Returns the slot of the handle to the file's slab, any later use of the handle fails. A write still uncommitted is not
+ * aborted: gtfs_sync_file() commits it, closing the file discards it
+ */
+int gtfs_release_write_handle(file_t* fl, gtfs_write_handle_t handle);
+
 // BONUS: Implement below API calls to get bonus credits
 
 int gtfs_clean_n_bytes(gtfs_t *gtfs, int bytes);
 int gtfs_sync_write_file_n_bytes(write_t* write_id, int bytes);
 
+// 64-bit variants of the calls above, for files of 2 GB and more. The int versions forward to them
+
+file_t* gtfs_open_file64(gtfs_t* gtfs, string filename, off_t file_length);
+vector<file_t*> gtfs_open_files64(gtfs_t* gtfs, const vector<string>& filenames, const vector<off_t>& fileLengths);
+char* gtfs_read_file64(gtfs_t* gtfs, file_t* fl, off_t offset, size_t length);
+write_t* gtfs_write_file64(gtfs_t* gtfs, file_t* fl, off_t offset, size_t length, const char* data);
+/** Same as gtfs_clean_n_bytes(), a negative `bytes` cleans the whole logs */
+int gtfs_clean_n_bytes64(gtfs_t *gtfs, int64_t bytes);
+int gtfs_sync_write_file_n_bytes64(write_t* write_id, size_t bytes);
+
+// Verification of log and data files
+
+typedef struct gtfs_verify_result {
+    string filename;
+    bool isLog = false;
+    uint64_t size = 0;
+    // Logs: length of the prefix made of intact records. Data files: same as size
+    uint64_t validBytes = 0;
+    uint64_t records = 0;
+    // CRC32C of the intact contents, to compare scrubs of a data file over time
+    uint32_t checksum = 0;
+    bool ioError = false;
+    // Logs: a corrupted record at validBytes is followed by more of the log, which repair leaves alone
+    bool corrupted = false;
+    // The torn tail (size - validBytes bytes) was truncated away
+    bool repaired = false;
+} gtfs_verify_result_t;
+
+/**
+ * Scans every log and data file in the directory in parallel, checking log record framing and checksums.
+ * With `repair`, torn log tails of files not open by a writer are truncated. Logs with a corrupted record followed by more
+ * records are only reported, they need to be looked at before anything gets dropped.
+ * Returns the number of damaged files (0 if all are intact), or -1 on error.
+ */
+int gtfs_verify(gtfs_t* gtfs, bool repair, vector<gtfs_verify_result_t>& results);
+
+// Process-wide cache of closed files
+
+typedef struct gtfs_buffer_cache_stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictedPages = 0;
+    size_t usedBytes = 0;
+    size_t budgetBytes = 0;
+} gtfs_buffer_cache_stats_t;
+
+/**
+ * Sets the memory budget of the process-wide cache of closed files (0, the default, disables it).
+ * Reopening a cached file whose data file and log did not change since it was closed skips reading and replaying it.
+ */
+void gtfs_set_buffer_cache_budget(size_t bytes);
+gtfs_buffer_cache_stats_t gtfs_get_buffer_cache_stats();
+
+// Process-wide accounting of the bytes written, to compare the write amplification of the storage engines
+
+typedef struct gtfs_write_stats {
+    // Bytes of the committed writes, as the application wrote them
+    uint64_t committedBytes = 0;
+    // Bytes appended to logs, log segments, sidecar files and the shared log
+    uint64_t logBytes = 0;
+    // Bytes written to data files by checkpoints
+    uint64_t checkpointBytes = 0;
+    // Bytes moved by the compaction of log-structured files, included in logBytes
+    uint64_t compactedBytes = 0;
+} gtfs_write_stats_t;
+
+/** Returns the bytes written by the process so far. (logBytes + checkpointBytes) / committedBytes is the write amplification */
+gtfs_write_stats_t gtfs_get_write_stats();
+
+// Memory held by the open files of a GTFileSystem instance
+
+typedef struct gtfs_memory_usage {
+    // Resident pages of VM segments
+    size_t residentBytes = 0;
+    // Undo and redo data of uncommitted writes held in memory, and moved to spill files
+    size_t transactionBytes = 0;
+    size_t spilledBytes = 0;
+    size_t budgetBytes = 0;
+    uint64_t evictedPages = 0;
+    // Pages read (back) from data files on access
+    uint64_t faultedPages = 0;
+} gtfs_memory_usage_t;
+
+gtfs_memory_usage_t gtfs_get_memory_usage(gtfs_t* gtfs);
+
+// Replication of the commits of a GTFileSystem instance (the primary) to a standby instance in another directory
+
+typedef struct gtfs_replication_stats {
+    bool active = false;
+    uint64_t shippedRecords = 0;
+    uint64_t appliedRecords = 0;
+    // Records the standby failed to append. The standby then misses commits of the primary and cannot be promoted
+    uint64_t failedRecords = 0;
+    // Commits shipped but not yet in the standby's logs, and their redo bytes
+    uint64_t pendingRecords = 0;
+    uint64_t pendingBytes = 0;
+    // Age of the oldest commit not yet in the standby's logs (0 when caught up)
+    double lagSeconds = 0;
+    // Redo bytes in the standby's logs that are not checkpointed yet, i.e. what a takeover has to replay at most
+    uint64_t uncheckpointedBytes = 0;
+} gtfs_replication_stats_t;
+
+/**
+ * Copies the files of `primary` to `standby`, then ships every commit and removal of `primary` to the standby as it
+ * happens. A background thread appends them to the standby's logs and checkpoints those once they exceed `checkpointBytes`
+ * of redo data, which bounds the catch-up of a takeover.
+ */
+int gtfs_start_replication(gtfs_t* primary, gtfs_t* standby, size_t checkpointBytes = 1 << 20);
+/** Stops replication once everything shipped so far is in the standby's logs */
+int gtfs_stop_replication(gtfs_t* primary);
+gtfs_replication_stats_t gtfs_get_replication_stats(gtfs_t* primary);
+/**
+ * Stops replication and checkpoints the standby, which then holds everything committed to the primary and can take over.
+ * Fails if the standby failed to append any shipped record
+ */
+int gtfs_promote_standby(gtfs_t* primary);
+
+// Background cleaning of the per-file logs of a GTFileSystem instance
+
+typedef struct gtfs_cleaner_options {
+    // Cap on the bytes the cleaner writes to data files and logs per second (0 for no cap)
+    uint64_t bytesPerSecond = 0;
+    // Redo bytes applied per chunk, the unit of work between checks for foreground commits, the rate and stop requests
+    int64_t chunkBytes = 1 << 20;
+    // Pause after a pass over the dirty files that found nothing to clean
+    double idleSeconds = 0.1;
+    // Longest a chunk waits for the foreground commits in progress to finish before going ahead anyway
+    double maxYieldSeconds = 0.05;
+} gtfs_cleaner_options_t;
+
+typedef struct gtfs_cleaner_stats {
+    bool running = false;
+    uint64_t passes = 0;
+    uint64_t chunks = 0;
+    // Log bytes checkpointed (or compacted away, for log-structured files)
+    uint64_t cleanedBytes = 0;
+    // Bytes the chunks wrote to data files and logs, what bytesPerSecond applies to
+    uint64_t writtenBytes = 0;
+    // Log bytes left to clean as of the end of the last pass
+    uint64_t backlogBytes = 0;
+    // Chunks held back for foreground commits, and the time spent waiting for those or for the rate limit
+    uint64_t yields = 0;
+    double throttledSeconds = 0;
+} gtfs_cleaner_stats_t;
+
+/**
+ * Starts a background thread that keeps checkpointing the logs of the files listed as dirty, one bounded chunk per file
+ * and pass, waiting for foreground commits in progress before each chunk and sleeping as needed to stay within
+ * options.bytesPerSecond. Plain logs are checkpointed a chunk at a time and removed once fully applied, segmented logs
+ * lose their oldest segments. Commits of the process wait while the cleaner drops a log or segments; the shared log is
+ * left to gtfs_clean().
+ */
+int gtfs_start_cleaner(gtfs_t* gtfs, const gtfs_cleaner_options_t& options = gtfs_cleaner_options_t());
+/** Stops the background cleaner once the chunk it is working on is done */
+int gtfs_stop_cleaner(gtfs_t* gtfs);
+gtfs_cleaner_stats_t gtfs_get_cleaner_stats(gtfs_t* gtfs);
+
+/** CRC32C of `data`, continuing from a previous `crc` (0 to start). Uses the SSE4.2 crc32 instruction when available */
+uint32_t crc32c(uint32_t crc, const char* data, size_t length);
+
+
+/** Run of changed bytes inside a delta-encoded transaction: offset relative to Transaction::offset, and length */
+using DeltaRun = pair<VMSizeT, VMSizeT>;
+
+/** Location of the undo and redo data of an uncommitted transaction moved to the spill file of its file */
+struct SpilledPayload {
+    // -1 for transactions holding their data
+    off_t offset = -1;
+    VMSizeT oldLength = 0;
+    VMSizeT newLength = 0;
+};
+
+/** Location of redo data kept in the sidecar file of a log instead of in the log record */
+struct ExternalRedo {
+    VMSizeT sidecarOffset = 0;
+    // 0 for records holding their redo data
+    VMSizeT length = 0;
+    uint32_t checksum = 0;
+};
 
 struct Transaction {
     TransactionID transactionId;
     VMSizeT offset;
     vector<char> oldData;
     vector<char> newData;
+    // Set for logged references to sidecar redo data, newData is then empty until the data gets loaded
+    ExternalRedo external;
+    // Set for uncommitted transactions whose data went to the spill file, oldData and newData are then empty until loaded back
+    SpilledPayload spilled;
+    // Non-empty for delta-encoded redo records: newData then holds only the bytes of these runs, back to back
+    vector<DeltaRun> deltaRuns;
+    // False once an overlapping transaction was created, committed or aborted, i.e. oldData may no longer match the logged state
+    bool undoIsDurable = true;
+
+    /** Returns the number of redo bytes, including those kept in the sidecar or the spill file */
+    VMSizeT redoSize() const;
+    /** Returns the number of undo bytes, including those kept in the spill file */
+    VMSizeT undoSize() const;
+    /** Returns one past the last VM byte written by the redo data */
+    VMSizeT redoEnd() const;
+    /** Returns true if the redo data of the transaction intersects [offset, offset + length) */
+    bool overlaps(VMSizeT offset, VMSizeT length) const;
 };
 ostream& operator<<(ostream& os, const Transaction& transaction);
 istream& operator>>(istream& is, Transaction& transaction);
 
 class LogManager;
-using VMSegment = vector<char>;
+
+/** Write of `length` bytes at `data` to `offset` of a VMSegment, see VMSegment::writeParallel() */
+struct SegmentWrite {
+    VMSizeT offset;
+    VMSizeT length;
+    const char* data;
+};
+
+/**
+ * Contents of a file, managed in pages. Pages still identical to the backing data file (clean) are read from it on first
+ * access and may be dropped again to fit a MemoryBudget. Pages past the end of the data file or in its holes read as zeros.
+ * Not movable: the memory budget keeps track of the segment by address.
+ */
+class VMSegment {
+public:
+    static constexpr VMSizeT PAGE_SIZE = 4096;
+
+    /** Segment holding `contents`, without a backing data file */
+    VMSegment(vector<char>&& contents, shared_ptr<MemoryBudget> memoryBudget = nullptr);
+    /** Segment of `size` bytes backed by the open data file `fileDescriptor`, which must outlive any access to the segment */
+    VMSegment(int fileDescriptor, VMSizeT size, shared_ptr<MemoryBudget> memoryBudget = nullptr);
+    VMSegment(const VMSegment&) = delete;
+    VMSegment& operator=(const VMSegment&) = delete;
+    ~VMSegment();
+
+    VMSizeT size();
+    /** Grows the segment with zeros, or shrinks it */
+    int resize(VMSizeT newSize);
+    /** Copies [offset, offset + length) into `data`, the range must lie within the segment. Returns -1 if a page could not be read */
+    int read(VMSizeT offset, VMSizeT length, char* data);
+    /** Copies `data` to [offset, offset + length), growing the segment if needed. Returns -1 if a page could not be read */
+    int write(VMSizeT offset, VMSizeT length, const char* data);
+    /**
+     * Makes the writes, growing the segment if needed, with the same result as making them in order. The segment gets cut
+     * into page-aligned ranges, each getting the parts of the writes that fall into it in order, and up to `threads` threads
+     * take ranges until all are done. Returns -1 if a page could not be read
+     */
+    int writeParallel(const vector<SegmentWrite>& writes, unsigned threads);
+    /**
+     * Writes the dirty pages back to the data file, after which they are clean. With `directFd`, an O_DIRECT descriptor of
+     * the data file, runs of consecutive dirty pages go through pooled aligned buffers. Returns the bytes written, or -1 on failure
+     */
+    ssize_t writeBack(int directFd = -1);
+    /**
+     * Fails page reads from the data file once its stat_version() is no longer `version`, the one it had when the segment
+     * got created. For views of files that other processes change underneath
+     */
+    void pinDataVersion(const string& version);
+
+    // Page level access, used by the buffer cache
+    VMSizeT pageCount();
+    /** Copies a resident page into `data` and returns true, or returns false for a clean page that is not resident */
+    bool copyPage(VMSizeT pageIndex, vector<char>& data, bool& dirty);
+    void adoptPage(VMSizeT pageIndex, vector<char>&& data, bool dirty);
+
+    /**
+     * Drops up to `bytes` bytes of clean pages, least recently used first (CLOCK). Returns the number of bytes dropped.
+     * The caller holds getMutex() and accounts the dropped bytes
+     */
+    size_t evictClean(size_t bytes);
+    mutex& getMutex();
+    /** Marks the dirty pages among the `count` pages from `firstPage` as holding nothing but bytes the logs or the data file have */
+    void markLogged(VMSizeT firstPage, VMSizeT count);
+    /**
+     * Makes the pages marked by markLogged() clean once a checkpoint wrote them to the data file, which `upToDate` confirms
+     * under the segment lock. Written pages rewritten since are not marked anymore and stay dirty
+     */
+    void markCheckpointed(const function<bool()>& upToDate);
+private:
+    // LOGGED: a dirty page whose bytes all come from log records or the data file, see markLogged()
+    enum PageFlags : uint8_t { DIRTY = 1, REFERENCED = 2, LOGGED = 4 };
+    /** Returns the resident page, reading it in unless it gets fully overwritten. Returns nullptr on a failed read */
+    char* getPage(VMSizeT pageIndex, bool overwritten);
+    int resizeLocked(VMSizeT newSize);
+    /** write() within the segment, with segmentMutex held. Calls touching different pages may run concurrently */
+    int writeLocked(VMSizeT offset, VMSizeT length, const char* data);
+    /** Maps the byte ranges of the data file that hold data (SEEK_DATA/SEEK_HOLE), or all of it if the file system cannot tell */
+    void findDataExtents();
+    /** Returns true if [offset, offset + length) of the data file is a hole, i.e. reads as zeros */
+    bool isHole(VMSizeT offset, VMSizeT length) const;
+    void charge(long bytes);
+    /** Releases the lock, then passes the memory accounting changes made under it on to the budget */
+    void settle(unique_lock<mutex>& lock);
+
+    int fileDescriptor = -1;
+    // See pinDataVersion(), empty if the data file only changes through the segment
+    string dataVersion;
+    // Bytes of the data file that back the segment, pages past them start out as zeros
+    VMSizeT backedSize = 0;
+    VMSizeT segmentSize = 0;
+    // Sorted, disjoint ranges of the data file holding data. Pages in the holes between them are zeroed instead of read
+    vector<pair<VMSizeT, VMSizeT>> dataExtents;
+    vector<unique_ptr<char[]>> pages;
+    vector<uint8_t> pageFlags;
+    size_t clockHand = 0;
+    // Atomic, the threads of writeParallel() fault pages in at the same time
+    atomic<size_t> residentBytes{0};
+    // Budget changes accumulated under segmentMutex, settled once it is released
+    atomic<long> pendingCharge{0};
+    atomic<uint64_t> pendingFaults{0};
+    mutex segmentMutex;
+    shared_ptr<MemoryBudget> memoryBudget;
+};
+
+/** Accounts the memory held by the VM segments and uncommitted transactions of a GTFileSystem instance, and enforces its cap */
+class MemoryBudget {
+public:
+    void setLimit(size_t bytes);
+    void registerSegment(VMSegment* segment);
+    void unregisterSegment(VMSegment* segment);
+    /** Accounts resident page bytes, evicting clean pages of any segment if they push the usage over the cap */
+    void chargePages(long bytes, uint64_t faultedPages = 0);
+    void chargeTransactions(long bytes, long spilledBytes = 0);
+    gtfs_memory_usage_t getUsage();
+    /** Evicts clean pages of any segment until the usage is back within the cap */
+    void reclaim();
+private:
+
+    mutex budgetMutex;
+    vector<VMSegment*> segments;
+    size_t nextSegment = 0;
+    atomic<size_t> residentBytes{0};
+    atomic<size_t> transactionBytes{0};
+    atomic<size_t> spilledBytes{0};
+    atomic<uint64_t> faultedPages{0};
+    uint64_t evictedPages = 0;
+    size_t limit = 0;
+};
 
 /** Transaction manager that manages a virtual memory segment and provides the basic functionality to create, abort and replay transactions */
 class BaseTransactionManager {
 protected:
     int totalTransactionCount = 0;
     VMSegment vmSegment;
+    // Size of the segment as replaying the logs would produce it, i.e. without extensions by uncommitted writes
+    VMSizeT durableSize;
     vector<Transaction> uncommittedTransactions;
+    shared_ptr<MemoryBudget> memoryBudget;
+    // Undo and redo bytes of the uncommitted transactions in memory and in the spill file, as charged to memoryBudget
+    size_t chargedTransactionBytes = 0;
+    size_t chargedSpilledBytes = 0;
+    // Undo and redo bytes of the uncommitted transactions kept in memory past which new ones get spilled (0 for no cap)
+    size_t spillThreshold = 0;
+    // Threads replayTransactions() may use, see gtfs_options_t::replayThreads
+    unsigned replayThreads = 0;
+    // Directory of the spill file, an unlinked temporary file created on first use
+    fs::path spillDirectory;
+    int spillFd = -1;
+    off_t spillEnd = 0;
+    // Ranges of the segment (start to end) that may hold bytes no log has, left by partial commits and aborts
+    map<VMSizeT, VMSizeT> unloggedRanges;
+    void markUnlogged(VMSizeT offset, VMSizeT length);
+    /** Drops the range from unloggedRanges once a log record gives all of its bytes */
+    void markLogged(VMSizeT offset, VMSizeT length);
+    bool overlapsUnlogged(VMSizeT offset, VMSizeT length) const;
+    /** Marks the pages of the range holding no uncommitted or unlogged bytes as logged, see VMSegment::markLogged() */
+    void markPagesLogged(VMSizeT offset, VMSizeT length);
+    /** Moves the undo and redo data of the transaction to the spill file */
+    int spill(Transaction& transaction);
+    /** Reads spilled undo and redo data back into `oldData` and `newData` (either may be null) */
+    int readSpilled(const Transaction& transaction, vector<char>* oldData, vector<char>* newData);
+    /** Loads the spilled data of the transaction back into it */
+    int unspill(Transaction& transaction);
+    /** Returns the undo data of the transaction, read into `buffer` if it was spilled */
+    const vector<char>* undoData(const Transaction& transaction, vector<char>& buffer);
+    /** Marks uncommitted transactions other than `transaction` overlapping its range as no longer having a durable undo image */
+    void invalidateOverlappingUndo(const Transaction& transaction);
+    /** Brings the memory charged for uncommitted transactions up to date, emptying the spill file once nothing is spilled */
+    void chargeTransactions();
 public:
-    BaseTransactionManager(VMSegment&& vmSegment);
+    BaseTransactionManager(vector<char>&& contents);
+    BaseTransactionManager(int fileDescriptor, VMSizeT size, shared_ptr<MemoryBudget> memoryBudget = nullptr);
+    virtual ~BaseTransactionManager();
+    /** Returns INVALID_TRANSACTION_ID if the segment could not be read */
     TransactionID createTransaction(VMSizeT offset, VMSizeT length, const char* newData);
     int abortTransaction(TransactionID transactionId);
+    /** Applies the redo data of logged transactions in log order, on several threads if there is enough of it */
     int replayTransactions(const vector<Transaction>& transactions);
-    vector<char>& getVMBase();
+    /** Applies the redo data of a single logged transaction, extending the segment if needed */
+    int replayTransaction(const Transaction& transaction);
+    /** Takes the size of the segment as its durable size, once committed contents got moved into it from elsewhere */
+    void adoptSegmentSize();
+    VMSegment& getVMSegment();
 };
 
 /** Specialization of BaseTransactionManager that manages a disk file and provides additional functionality to commit transactions to a log file */
 class TransactionManager: public BaseTransactionManager {
     fs::path logFilePath;
+    gtfs_options_t options;
+    // Commits go to this log instead of logFilePath when set
+    shared_ptr<SharedLog> sharedLog;
+    // Commits get shipped through it while replication is active
+    shared_ptr<Replicator> replicator;
 public:
-    TransactionManager(const fs::path& originalFilePath, VMSegment&& vmSegment);
-    int commitTransaction(TransactionID transactionId, int bytes = -1);
+    /** Manages the `size` bytes of the open data file `fileDescriptor` at `originalFilePath` */
+    TransactionManager(const fs::path& originalFilePath, int fileDescriptor, VMSizeT size, const gtfs_options_t& options = gtfs_options_t(),
+        shared_ptr<SharedLog> sharedLog = nullptr, shared_ptr<MemoryBudget> memoryBudget = nullptr, shared_ptr<Replicator> replicator = nullptr);
+    ~TransactionManager();
+    int commitTransaction(TransactionID transactionId, int64_t bytes = -1);
+    /** Commits all uncommitted transactions, merged into one transaction per run of adjacent or overlapping ranges */
+    int commitAll();
     fs::path getLogFilePath() const;
+    /**
+     * Called once a checkpoint applied every record logged for the file to its data file: the committed pages become clean,
+     * so the memory budget can evict them. Does nothing if records got logged since
+     */
+    void checkpointed();
+    /**
+     * Undoes the uncommitted transactions, leaving the segment with the committed contents only. Returns false, leaving
+     * the manager untouched, if the committed contents cannot be told apart from uncommitted ones (or false after a failed read).
+     */
+    bool undoUncommitted();
 };
 
-/** Utility class to read and write transactions to/from a given log file */
+/** Utility class to read and write transactions to/from a given log file, or from its segments if the log is segmented */
 class LogManager {
 public:
-    static vector<Transaction> getTransactionsInLog(const fs::path& logFilePath);
-    static int writeTransaction(const fs::path& logFilePath, const Transaction& transaction);
+    /**
+     * Returns the transactions of the intact prefix of the log, optionally truncating a torn tail off the log. Redo data
+     * kept in the sidecar file gets loaded unless `loadExternal` is false
+     */
+    static vector<Transaction> getTransactionsInLog(const fs::path& logFilePath, bool dropTornTail = false, bool loadExternal = true);
+    /**
+     * Hands the transactions of the intact prefix of the log to `apply` in log order, as they are decoded. The log is read
+     * ahead on an I/O thread meanwhile. `apply` returns false to stop early. Returns false on a read error, or if the log
+     * goes on past a corrupted record (the records after it are not handed over, and the log is never truncated there)
+     */
+    static bool forEachTransaction(const fs::path& logFilePath, const function<bool(Transaction&)>& apply, bool dropTornTail = false,
+        bool loadExternal = true);
+    /** Returns the path of the sidecar file holding the large redo data of the log, see gtfs_options_t::largeWriteThreshold */
+    static fs::path getSidecarPath(const fs::path& logFilePath);
+    /** Appends the transaction to the log, to its active segment if options.logSegmentSize is set */
+    static int writeTransaction(const fs::path& logFilePath, const Transaction& transaction, const gtfs_options_t& options = gtfs_options_t());
+    /** Appends the transactions to the log in a single write */
+    static int writeTransactions(const fs::path& logFilePath, const vector<Transaction>& transactions, const gtfs_options_t& options = gtfs_options_t());
+    /** Serializes a transaction into a log record with a CRC32C trailer */
+    static string encodeTransaction(const Transaction& transaction, uint32_t checksumSeed = 0);
+    // Returned by decodeTransaction() for a record that is malformed or fails its checksum, whatever bytes follow it
+    static constexpr size_t CORRUPT_RECORD = SIZE_MAX;
+    /**
+     * Parses the log record at `data`. Returns its size, 0 if it is incomplete, or CORRUPT_RECORD. For an incomplete record
+     * whose header is there, `minimumSize` (if given) gets the size the record has at least
+     */
+    static size_t decodeTransaction(const char* data, size_t size, Transaction& transaction, uint32_t checksumSeed = 0,
+        size_t* minimumSize = nullptr);
+    /**
+     * Parses a record of a log written before records had checksums, `id offset size data` with the next record right after
+     * it. Such a record only ends where the next one starts, `atEnd` tells whether the log ends with `data`. Returns like
+     * decodeTransaction()
+     */
+    static size_t decodeLegacyTransaction(const char* data, size_t size, bool atEnd, Transaction& transaction);
+    /** Tells whether the log open at `fd` starts with a record written before records had checksums */
+    static bool isLegacyLog(int fd);
+    /** Reads the live segment range of a segmented log. Returns false if the log does not exist or is not segmented */
+    static bool readSegmentManifest(const fs::path& logFilePath, uint64_t& firstSegment, uint64_t& lastSegment);
+    static int writeSegmentManifest(const fs::path& logFilePath, uint64_t firstSegment, uint64_t lastSegment);
+    static fs::path getSegmentPath(const fs::path& logFilePath, uint64_t segment);
+    /** Removes the log along with all its segments and its sidecar file. Returns false if there was no log */
+    static bool removeLog(const fs::path& logFilePath);
+};
+
+/** Files open for writing in the process by data file path, so that checkpoints can tell them, see TransactionManager::checkpointed() */
+class OpenFiles {
+public:
+    void add(const string& path, TransactionManager* transactionManager);
+    void remove(TransactionManager* transactionManager);
+    void checkpointed(const string& path);
+private:
+    mutex filesMutex;
+    unordered_multimap<string, TransactionManager*> files;
+};
+
+/** Page cache of the committed contents of closed files, with CLOCK eviction of pages within a memory budget */
+class BufferCache {
+public:
+    void setBudget(size_t bytes);
+    bool isEnabled();
+    /** Caches the contents of the file at `path`, valid as long as the file and its logs are at `version` */
+    void insert(const string& path, const string& version, VMSegment& segment);
+    /**
+     * Moves the cached contents of `path` into `segment`, backed by the same data file, and returns true if its dirty
+     * pages are all cached at `version`. Clean pages that are not cached are left for the segment to read
+     */
+    bool take(const string& path, const string& version, VMSegment& segment);
+    void invalidate(const string& path);
+    gtfs_buffer_cache_stats_t getStats();
+private:
+    struct Slot {
+        string path;
+        VMSizeT pageIndex;
+        vector<char> data;
+        bool dirty = false;
+        bool referenced = false;
+        bool used = false;
+    };
+    // Page slot markers: a dirty page got evicted (the file can no longer be restored), or a clean page is not cached
+    static constexpr long EVICTED = -1;
+    static constexpr long NOT_CACHED = -2;
+    struct CachedFile {
+        string version;
+        VMSizeT size;
+        // Slot of every page, or one of the markers above
+        vector<long> slots;
+    };
+    void eraseFile(const string& path);
+    /** Frees pages with the CLOCK algorithm until one more page fits in the budget. Returns false if the budget is too small */
+    bool makeRoom();
+
+    mutex cacheMutex;
+    unordered_map<string, CachedFile> files;
+    vector<Slot> slots;
+    vector<long> freeSlots;
+    size_t clockHand = 0;
+    size_t budgetBytes = 0;
+    size_t usedBytes = 0;
+    gtfs_buffer_cache_stats_t stats;
+};
+
+/** Pool of aligned buffers for direct I/O, which needs the memory, file offset and length of transfers aligned to the block size */
+class AlignedBufferPool {
+public:
+    static const size_t ALIGNMENT = 4096;
+    // Free buffers beyond this many bytes are returned to the system
+    static const size_t MAX_POOLED_BYTES = 64 << 20;
+
+    /** Buffer of at least the requested size, handed back to the pool on destruction */
+    class Buffer {
+        AlignedBufferPool* pool;
+        char* bytes;
+        size_t bufferCapacity;
+    public:
+        Buffer(AlignedBufferPool* pool, char* bytes, size_t capacity);
+        Buffer(Buffer&& other);
+        Buffer(const Buffer&) = delete;
+        ~Buffer();
+        char* data();
+        size_t capacity() const;
+    };
+
+    ~AlignedBufferPool();
+    Buffer acquire(size_t size);
+private:
+    void release(char* bytes, size_t capacity);
+    mutex poolMutex;
+    unordered_map<size_t, vector<char*>> freeBuffers;
+    size_t pooledBytes = 0;
+};
+
+/**
+ * Write-ahead log shared by all files of a directory. Each record is a regular log record prefixed with the name of its file,
+ * and appends from all processes are serialized with flock, so the directory gets a single sequential log.
+ * Keeps an index of the records of each file, caught up incrementally, so opening a file does not rescan the whole log.
+ */
+class SharedLog {
+    fs::path path;
+    // Identifies the incarnation of the log file the index refers to, a new one is started after every clean
+    string indexedGeneration;
+    uint64_t indexedBytes = 0;
+    // Byte ranges of the records of each file since its last removal
+    unordered_map<string, vector<pair<uint64_t, uint64_t>>> recordRanges;
+    // The index stopped at a corrupted record that more of the log follows, the log must not be dropped
+    bool corrupted = false;
+    mutex indexMutex;
+
+    /** Opens the log and takes its exclusive lock, creating the log if needed. Returns -1 on failure */
+    int openLocked();
+    /** Indexes the records appended since the last call, dropping a torn tail (the caller holds the lock) */
+    void catchUp(int fd);
+public:
+    explicit SharedLog(const fs::path& directory);
+    /** Appends a commit of `fileName` */
+    int append(const string& fileName, const Transaction& transaction);
+    /** Appends several commits of `fileName` in a single write */
+    int append(const string& fileName, const vector<Transaction>& transactions);
+    /** Appends a marker discarding the records of `fileName` logged so far, when the file is removed */
+    int appendRemoval(const string& fileName);
+    /** Returns the committed transactions of `fileName`, in log order */
+    vector<Transaction> getTransactions(const string& fileName);
+    /** Tells whether the log holds records of `fileName` (true if the log cannot be read) */
+    bool hasRecords(const string& fileName);
+    /** Returns a token that changes whenever records of `fileName` are appended or the log is cleaned */
+    string getPosition(const string& fileName);
+    /**
+     * Checkpoints the transactions of every file (the first `bytes` redo bytes of each if not -1) and starts a new log,
+     * holding the transactions left out by `bytes`
+     */
+    int clean(int64_t bytes = -1, const gtfs_options_t& options = gtfs_options_t());
+    const fs::path& getPath() const;
+
+    /**
+     * Parses the shared log record at `data` into its file name and transaction (none for removal markers). Returns its size,
+     * 0 if it is incomplete, or LogManager::CORRUPT_RECORD
+     */
+    static size_t decodeRecord(const char* data, size_t size, string& fileName, Transaction& transaction, bool& isRemoval);
+    /** Returns the size of the header at the start of the log, or 0 if there is no complete header */
+    static size_t decodeHeader(const char* data, size_t size, string& generation);
+};
+
+/** Ships the commits of a GTFileSystem instance to a standby instance, where a background thread applies them */
+class Replicator {
+public:
+    ~Replicator();
+    int start(gtfs_t* primary, gtfs_t* standby, size_t checkpointBytes);
+    /** Waits until everything shipped so far is applied, then stops the background thread */
+    int stop();
+    bool isActive() const;
+    void shipCommit(const string& fileName, const Transaction& transaction, bool toSharedLog);
+    void shipRemoval(const string& fileName);
+    gtfs_replication_stats_t getStats();
+    gtfs_t* getStandby() const;
+private:
+    struct Shipment {
+        string fileName;
+        Transaction transaction;
+        bool isRemoval;
+        // Committed to the shared log rather than to the file's own log
+        bool toSharedLog;
+        chrono::steady_clock::time_point shippedAt;
+    };
+    void ship(Shipment&& shipment);
+    void run();
+
+    atomic<bool> active{false};
+    gtfs_t* standby = nullptr;
+    size_t checkpointBytes = 0;
+    mutex queueMutex;
+    condition_variable queueChanged;
+    deque<Shipment> queue;
+    bool stopping = false;
+    // Shipment being applied, still pending
+    bool applying = false;
+    chrono::steady_clock::time_point applyingShippedAt;
+    thread applier;
+    uint64_t shippedRecords = 0;
+    uint64_t appliedRecords = 0;
+    uint64_t failedRecords = 0;
+    uint64_t pendingBytes = 0;
+    uint64_t uncheckpointedBytes = 0;
+};
+
+/** Checkpoints the logs of a GTFileSystem instance on a background thread, see gtfs_start_cleaner() */
+class Cleaner {
+public:
+    ~Cleaner();
+    int start(gtfs_t* gtfs, const gtfs_cleaner_options_t& options);
+    int stop();
+    gtfs_cleaner_stats_t getStats();
+    /**
+     * Waits for the chunk in progress and holds off the next one as long as the returned lock is held, for cleans and
+     * removals by the application. The cleaner then starts over on each log, as those may get replaced meanwhile
+     */
+    unique_lock<mutex> suspend();
+private:
+    // Plain logs: the records before `offset` are in the data file, as long as the log is still the file `logInode`
+    struct Cursor {
+        uint64_t logInode = 0;
+        uint64_t offset = 0;
+    };
+    void run();
+    /** Cleans a chunk of the log of `fileName`, adding the log bytes it applied to `cleanedBytes`. Returns the log bytes left */
+    uint64_t cleanChunk(const string& fileName, uint64_t& cleanedBytes);
+    /** Waits for the foreground commits in progress, for up to options.maxYieldSeconds. Returns false once stopped */
+    bool yieldToCommits();
+    /** Sleeps for `seconds` unless stopped meanwhile. Returns false once stopped */
+    bool pause(double seconds);
+
+    gtfs_t* gtfs = nullptr;
+    gtfs_cleaner_options_t options;
+    mutex stateMutex;
+    condition_variable stateChanged;
+    bool stopping = false;
+    thread worker;
+    // Held while a chunk runs
+    mutex chunkMutex;
+    unordered_map<string, Cursor> cursors;
+    gtfs_cleaner_stats_t stats;
 };
 
 #endif
@@ -0,0 +1,85 @@
+#ifndef GTFS_RECORD_HPP
+#define GTFS_RECORD_HPP
+
+#include "gtfs.hpp"
+#include <type_traits>
+
+/**
+ * Typed view of an open GTFileSystem file as an array of fixed-size records, record `index` taking the sizeof(T) bytes
+ * at index * sizeof(T). Reads copy the record straight out of the file's VM segment and writes hand it straight to the
+ * file's transaction manager, without the write_t, the strdup and the runtime length checks of the generic calls.
+ * Records are copied byte for byte, so unlike gtfs_read_file() they may contain zero bytes.
+ * The view does not own the file, which must stay open while the view is used.
+ */
+template <typename T>
+class gtfs_record_file {
+    static_assert(is_trivially_copyable<T>::value, "records are copied byte for byte, T must be trivially copyable");
+    static_assert(is_default_constructible<T>::value, "records past the end of the file read as a zeroed T");
+public:
+    static constexpr VMSizeT record_size = sizeof(T);
+
+    explicit gtfs_record_file(file_t* fl): fl(fl) {}
+
+    /** Records the file has room for, partial ones at the end not included */
+    VMSizeT size() const {
+        return isOpen() ? fl->transactionManager->getVMSegment().size() / record_size : 0;
+    }
+
+    /** Writes the record and commits it to the log. Returns 0, or -1 on failure */
+    int write(VMSizeT index, const T& record) {
+        TransactionID transactionId = begin(index, record);
+        return transactionId == INVALID_TRANSACTION_ID ? -1 : fl->transactionManager->commitTransaction(transactionId);
+    }
+
+    /** Writes the record without committing it, sync() commits the pending records in one log append */
+    int write_pending(VMSizeT index, const T& record) {
+        return begin(index, record) == INVALID_TRANSACTION_ID ? -1 : 0;
+    }
+
+    /** Commits the records written with write_pending(), see gtfs_sync_file() */
+    int sync() {
+        return isOpen() && !fl->readOnly ? fl->transactionManager->commitAll() : -1;
+    }
+
+    /** Reads the record, including writes not committed yet. Returns false if it could not be read */
+    bool read(VMSizeT index, T& record) const {
+        if (!isOpen()) {
+            return false;
+        }
+        record = T();
+        auto& vmSegment = fl->transactionManager->getVMSegment();
+        VMSizeT offset = index * record_size, segmentSize = vmSegment.size();
+        if (offset >= segmentSize) {
+            return true;
+        }
+        // A record cut by the end of the file keeps zeros past it
+        VMSizeT length = segmentSize - offset < record_size ? segmentSize - offset : record_size;
+        return vmSegment.read(offset, length, reinterpret_cast<char*>(&record)) == 0;
+    }
+
+    /** Reads the record, a zeroed T if it could not be read */
+    T read(VMSizeT index) const {
+        T record;
+        if (!read(index, record)) {
+            record = T();
+        }
+        return record;
+    }
+
+private:
+    bool isOpen() const {
+        return fl && fl->fileDescriptor != -1 && fl->transactionManager;
+    }
+
+    /** Creates the transaction writing the record, INVALID_TRANSACTION_ID on failure */
+    TransactionID begin(VMSizeT index, const T& record) {
+        if (!isOpen() || fl->readOnly) {
+            return INVALID_TRANSACTION_ID;
+        }
+        return fl->transactionManager->createTransaction(index * record_size, record_size, reinterpret_cast<const char*>(&record));
+    }
+
+    file_t* fl;
+};
+
+#endif
@@ -1,6 +1,11 @@
 #include "../src/gtfs.hpp"
+#include "../src/gtfs_record.hpp"
 #include <cstring>
+#include <fstream>
+#include <algorithm>
 #include <sys/wait.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 // Assumes files are located within the current directory
 string directory;
@@ -313,8 +318,10 @@ void test_sync_write_more_bytes_than_written() {
     string str = "Testing string.\n";
     write_t *wrt1 = gtfs_write_file(gtfs, fl, 0, str.length(), str.c_str());
     int ret = gtfs_sync_write_file_n_bytes(wrt1, str.length() + 1);
+    // Also with a count too large for a signed 64-bit one
+    int ret64 = gtfs_sync_write_file_n_bytes64(wrt1, SIZE_MAX);
     gtfs_close_file(gtfs, fl);
-    if (ret != 0) {
+    if (ret != 0 && ret64 != 0) {
         cout << "gtfs_sync_write_file_n_bytes() with more bytes than written fails correctly: " << PASS;
     } else {
         cout << "gtfs_sync_write_file_n_bytes() with more bytes than written succeeds: " << FAIL;
@@ -461,6 +468,1199 @@ void test_abort_synced_write() {
     }
 }
 
+/** Testing that delta encoding logs only the changed bytes of a write, skips no-op writes and replays correctly */
+void test_delta_encoded_write() {
+    gtfs_t *gtfs = gtfs_init(directory + "/delta", verbose);
+    gtfs->options.deltaEncoding = true;
+    string filename = "test11.txt";
+    auto logFilePath = fs::path(gtfs->dirname) / (filename + ".log");
+    file_t *fl = gtfs_open_file(gtfs, filename, 8192);
+    string block(8192, 'a');
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, block.length(), block.c_str()));
+    gtfs_close_file(gtfs, fl);
+    gtfs_clean(gtfs);
+
+    fl = gtfs_open_file(gtfs, filename, 8192);
+    string changed = block;
+    changed.replace(100, 3, "bbb");
+    changed[5000] = 'c';
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, changed.length(), changed.c_str()));
+    auto deltaLogSize = fs::file_size(logFilePath);
+    // Rewriting the same contents again changes nothing and must not grow the log
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, changed.length(), changed.c_str()));
+    auto noopLogSize = fs::file_size(logFilePath);
+    gtfs_close_file(gtfs, fl);
+
+    fl = gtfs_open_file(gtfs, filename, 8192);
+    char *data = gtfs_read_file(gtfs, fl, 0, changed.length());
+    gtfs_close_file(gtfs, fl);
+    bool replayed = data && changed.compare(data) == 0;
+    cout << "Delta log size: " << deltaLogSize << ", after no-op write: " << noopLogSize << ", replayed: " << replayed << ": ";
+    (deltaLogSize < 100 && noopLogSize == deltaLogSize && replayed) ? cout << PASS : cout << FAIL;
+}
+
+/** Testing that gtfs_verify() detects and repairs a torn log tail, and that open drops a torn tail before new appends */
+void test_verify_torn_log() {
+    fs::remove_all(directory + "/verify");
+    gtfs_t *gtfs = gtfs_init(directory + "/verify", verbose);
+    string filename = "test12.txt";
+    auto logFilePath = fs::path(gtfs->dirname) / (filename + ".log");
+    file_t *fl = gtfs_open_file(gtfs, filename, 100);
+    string str = "Testing string.\n";
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, str.length(), str.c_str()));
+    gtfs_close_file(gtfs, fl);
+    auto intactSize = fs::file_size(logFilePath);
+
+    // Simulate a crash in the middle of appending a record
+    ofstream logFile(logFilePath, ios::binary | ios::app);
+    logFile << "1 20 16 Testing";
+    logFile.close();
+
+    vector<gtfs_verify_result_t> results;
+    int damaged = gtfs_verify(gtfs, false, results);
+    bool detected = false;
+    for (const auto& result: results) {
+        detected |= result.isLog && result.records == 1 && result.validBytes == intactSize && result.size > intactSize;
+    }
+    int damagedAfterRepair = gtfs_verify(gtfs, true, results);
+    bool repaired = fs::file_size(logFilePath) == intactSize && gtfs_verify(gtfs, false, results) == 0;
+
+    // A torn tail found at open is dropped, so a record appended afterwards is still replayed
+    logFile.open(logFilePath, ios::binary | ios::app);
+    logFile << "1 20 16 Test";
+    logFile.close();
+    fl = gtfs_open_file(gtfs, filename, 100);
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 40, str.length(), str.c_str()));
+    gtfs_close_file(gtfs, fl);
+    fl = gtfs_open_file(gtfs, filename, 100);
+    char *data = gtfs_read_file(gtfs, fl, 40, str.length());
+    gtfs_close_file(gtfs, fl);
+    bool replayed = data && str.compare(data) == 0;
+
+    cout << "Damaged: " << damaged << ", detected: " << detected << ", damaged after repair: " << damagedAfterRepair << ", repaired: " << repaired << ", replayed after torn tail: " << replayed << ": ";
+    (damaged == 1 && detected && damagedAfterRepair == 0 && repaired && replayed) ? cout << PASS : cout << FAIL;
+}
+
+/** Testing that a partial clean of a segmented log applies and drops whole segments and keeps the rest of the log */
+void test_segmented_log_partial_clean() {
+    fs::remove_all(directory + "/segments");
+    gtfs_t *gtfs = gtfs_init(directory + "/segments", verbose);
+    // Small enough that every record of this test goes to a segment of its own
+    gtfs->options.logSegmentSize = 64;
+    string filename = "test13.txt";
+    auto logFilePath = fs::path(gtfs->dirname) / (filename + ".log");
+    file_t *fl = gtfs_open_file(gtfs, filename, 100);
+    string str = "Testing string.\n";
+    for (int i = 0; i < 4; ++i) {
+        gtfs_sync_write_file(gtfs_write_file(gtfs, fl, i * 20, str.length(), str.c_str()));
+    }
+    gtfs_close_file(gtfs, fl);
+    uint64_t firstSegment = 0, lastSegment = 0;
+    LogManager::readSegmentManifest(logFilePath, firstSegment, lastSegment);
+    bool segmented = firstSegment == 1 && lastSegment == 4;
+
+    // 2.5 records worth of bytes: the first two segments get applied, the third does not fit
+    gtfs_clean_n_bytes(gtfs, 5 * str.length() / 2);
+    LogManager::readSegmentManifest(logFilePath, firstSegment, lastSegment);
+    bool dropped = firstSegment == 3 && lastSegment == 4 && !fs::exists(LogManager::getSegmentPath(logFilePath, 2));
+    auto dataFilePath = fs::path(gtfs->dirname) / filename;
+    ifstream dataFile(dataFilePath, ios::binary);
+    string checkpointed((istreambuf_iterator<char>(dataFile)), istreambuf_iterator<char>());
+    dataFile.close();
+    bool applied = checkpointed.compare(20, str.length(), str) == 0 && checkpointed[40] == '\0';
+
+    // The kept segments are still replayed at open, and a full clean removes the log
+    fl = gtfs_open_file(gtfs, filename, 100);
+    char *data = gtfs_read_file(gtfs, fl, 60, str.length());
+    gtfs_close_file(gtfs, fl);
+    bool replayed = data && str.compare(data) == 0;
+    gtfs_clean(gtfs);
+    bool removed = !fs::exists(logFilePath) && !fs::exists(LogManager::getSegmentPath(logFilePath, 4));
+
+    cout << "Segmented: " << segmented << ", segments dropped: " << dropped << ", applied: " << applied << ", tail replayed: " << replayed << ", log removed: " << removed << ": ";
+    (segmented && dropped && applied && replayed && removed) ? cout << PASS : cout << FAIL;
+}
+
+/** Testing that commits of several files go to the shared log, are replayed per file, and get demultiplexed by clean */
+void test_shared_log() {
+    fs::remove_all(directory + "/wal");
+    gtfs_t *gtfs = gtfs_init(directory + "/wal", verbose);
+    gtfs->options.sharedLog = true;
+    string filename1 = "test14a.txt", filename2 = "test14b.txt";
+    string str1 = "Testing string.\n", str2 = "Another string.\n";
+    file_t *fl1 = gtfs_open_file(gtfs, filename1, 100);
+    file_t *fl2 = gtfs_open_file(gtfs, filename2, 100);
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl1, 0, str1.length(), str1.c_str()));
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl2, 10, str2.length(), str2.c_str()));
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl1, 50, str2.length(), str2.c_str()));
+    gtfs_close_file(gtfs, fl1);
+    gtfs_close_file(gtfs, fl2);
+    auto sharedLogPath = fs::path(gtfs->dirname) / ".gtfs.wal";
+    bool sharedOnly = fs::exists(sharedLogPath) && !fs::exists(fs::path(gtfs->dirname) / (filename1 + ".log"));
+
+    fl1 = gtfs_open_file(gtfs, filename1, 100);
+    char *data1 = gtfs_read_file(gtfs, fl1, 0, str1.length());
+    char *data2 = gtfs_read_file(gtfs, fl1, 50, str2.length());
+    gtfs_close_file(gtfs, fl1);
+    bool replayed = data1 && data2 && str1.compare(data1) == 0 && str2.compare(data2) == 0;
+
+    // A removed file does not get its old records back when it is created again
+    gtfs_remove_file(gtfs, fl2);
+    fl2 = gtfs_open_file(gtfs, filename2, 100);
+    char *removedData = gtfs_read_file(gtfs, fl2, 10, str2.length());
+    gtfs_close_file(gtfs, fl2);
+    bool removed = removedData && strlen(removedData) == 0;
+
+    // A partial clean applies the first record and keeps the second one in the log
+    gtfs_clean_n_bytes(gtfs, str1.length());
+    ifstream partialFile(fs::path(gtfs->dirname) / filename1, ios::binary);
+    string partial((istreambuf_iterator<char>(partialFile)), istreambuf_iterator<char>());
+    fl1 = gtfs_open_file(gtfs, filename1, 100);
+    char *kept = gtfs_read_file(gtfs, fl1, 50, str2.length());
+    gtfs_close_file(gtfs, fl1);
+    bool partiallyCleaned = fs::exists(sharedLogPath) && partial.compare(0, str1.length(), str1) == 0
+        && partial.compare(50, str2.length(), str2) != 0 && kept && str2.compare(kept) == 0;
+    free(kept);
+
+    gtfs_clean(gtfs);
+    ifstream dataFile(fs::path(gtfs->dirname) / filename1, ios::binary);
+    string checkpointed((istreambuf_iterator<char>(dataFile)), istreambuf_iterator<char>());
+    bool cleaned = !fs::exists(sharedLogPath) && checkpointed.compare(50, str2.length(), str2) == 0;
+
+    cout << "Only shared log: " << sharedOnly << ", replayed: " << replayed << ", removed file not replayed: " << removed
+        << ", partially cleaned: " << partiallyCleaned << ", cleaned: " << cleaned << ": ";
+    (sharedOnly && replayed && removed && partiallyCleaned && cleaned) ? cout << PASS : cout << FAIL;
+}
+
+/** Testing that direct I/O log appends and checkpoints keep unaligned heads and tails intact */
+void test_direct_io() {
+    fs::remove_all(directory + "/direct");
+    gtfs_t *gtfs = gtfs_init(directory + "/direct", verbose);
+    gtfs->options.directIO = true;
+    string filename = "test15.txt";
+    file_t *fl = gtfs_open_file(gtfs, filename, 10000);
+    // Records of odd sizes, so every append starts and ends in the middle of a block
+    string str1 = "Testing string.\n", str2(5000, 'x');
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, str1.length(), str1.c_str()));
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 4000, str2.length(), str2.c_str()));
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 9990, str1.length(), str1.c_str()));
+    gtfs_close_file(gtfs, fl);
+    vector<gtfs_verify_result_t> results;
+    bool logIntact = gtfs_verify(gtfs, false, results) == 0;
+
+    fl = gtfs_open_file(gtfs, filename, 10000);
+    char *data = gtfs_read_file(gtfs, fl, 4000, str2.length());
+    gtfs_close_file(gtfs, fl);
+    bool replayed = data && str2.compare(data) == 0;
+
+    gtfs_clean(gtfs);
+    auto dataFilePath = fs::path(gtfs->dirname) / filename;
+    ifstream dataFile(dataFilePath, ios::binary);
+    string checkpointed((istreambuf_iterator<char>(dataFile)), istreambuf_iterator<char>());
+    bool cleaned = checkpointed.size() == 9990 + str1.length() && checkpointed.compare(0, str1.length(), str1) == 0
+        && checkpointed.compare(4000, str2.length(), str2) == 0 && checkpointed.compare(9990, str1.length(), str1) == 0;
+    dataFile.close();
+
+    // Overwrite the first page and clear the second one, the checkpoint writes back the first page alone
+    const int pageSize = 4096;
+    string str3(pageSize, 'y'), zeros(pageSize, '\0');
+    fl = gtfs_open_file(gtfs, filename, checkpointed.size());
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, str3.length(), str3.c_str()));
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl, pageSize, zeros.length(), zeros.c_str()));
+    gtfs_close_file(gtfs, fl);
+    auto statsBefore = gtfs_get_write_stats();
+    gtfs_clean(gtfs);
+    auto statsAfter = gtfs_get_write_stats();
+    checkpointed.replace(0, str3.length(), str3);
+    checkpointed.replace(pageSize, zeros.length(), zeros);
+    dataFile.open(dataFilePath, ios::binary);
+    string rewritten((istreambuf_iterator<char>(dataFile)), istreambuf_iterator<char>());
+    uint64_t rewrittenBytes = statsAfter.checkpointBytes - statsBefore.checkpointBytes;
+    // The cleared page only gets written where holes cannot be punched
+    bool dirtyOnly = rewritten == checkpointed && rewrittenBytes <= 2 * pageSize;
+
+    cout << "Log intact: " << logIntact << ", replayed: " << replayed << ", checkpoint size " << checkpointed.size() << " and contents: " << cleaned
+        << ", " << rewrittenBytes << " bytes checkpointed for two changed pages: " << dirtyOnly << ": ";
+    (logIntact && replayed && cleaned && dirtyOnly) ? cout << PASS : cout << FAIL;
+}
+
+/** Testing that reopening an unchanged closed file is served from the buffer cache with only its committed contents */
+void test_buffer_cache() {
+    fs::remove_all(directory + "/cache");
+    gtfs_t *gtfs = gtfs_init(directory + "/cache", verbose);
+    gtfs_set_buffer_cache_budget(1 << 20);
+    auto before = gtfs_get_buffer_cache_stats();
+    string filename = "test16.txt";
+    file_t *fl = gtfs_open_file(gtfs, filename, 100);
+    string str1 = "Committed string.\n", str2 = "Uncommitted string, past the committed end.\n";
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, str1.length(), str1.c_str()));
+    // Left uncommitted on close, it must not survive in the cached contents
+    gtfs_write_file(gtfs, fl, 90, str2.length(), str2.c_str());
+    gtfs_close_file(gtfs, fl);
+
+    fl = gtfs_open_file(gtfs, filename, 100);
+    char *data = gtfs_read_file(gtfs, fl, 0, str1.length());
+    char *beyond = gtfs_read_file(gtfs, fl, 90, str2.length());
+    bool cachedCommitted = data && str1.compare(data) == 0 && beyond && beyond[0] == '\0';
+    gtfs_close_file(gtfs, fl);
+    auto afterHit = gtfs_get_buffer_cache_stats();
+
+    // A file grown past its open length by a commit keeps its committed end through two hits in a row
+    string grownFilename = "test16b.txt", str3(100, 'Z');
+    fl = gtfs_open_file(gtfs, grownFilename, 100);
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 90, str3.length(), str3.c_str()));
+    gtfs_close_file(gtfs, fl);
+    bool grownKept = true;
+    for (int reopen = 0; reopen < 2; ++reopen) {
+        fl = gtfs_open_file(gtfs, grownFilename, 100);
+        char *grown = gtfs_read_file(gtfs, fl, 90, str3.length());
+        grownKept = grownKept && grown && str3.compare(grown) == 0;
+        free(grown);
+        gtfs_close_file(gtfs, fl);
+    }
+    auto afterGrown = gtfs_get_buffer_cache_stats();
+    bool grownHits = afterGrown.hits == afterHit.hits + 2;
+
+    // A change behind the library's back must not be served from the cache
+    ofstream dataFile(fs::path(gtfs->dirname) / filename, ios::binary | ios::app);
+    dataFile << "External.";
+    dataFile.close();
+    fl = gtfs_open_file(gtfs, filename, 200);
+    data = gtfs_read_file(gtfs, fl, 100, 9);
+    bool externalSeen = data && string("External.").compare(data) == 0;
+    gtfs_close_file(gtfs, fl);
+    auto afterMiss = gtfs_get_buffer_cache_stats();
+    gtfs_set_buffer_cache_budget(0);
+
+    bool hit = afterHit.hits == before.hits + 1, miss = afterMiss.misses == afterGrown.misses + 1;
+    cout << "Cached contents committed only: " << cachedCommitted << ", hit: " << hit << ", grown file kept through hits: "
+        << (grownKept && grownHits) << ", external change seen: " << externalSeen << ", miss: " << miss << ": ";
+    (cachedCommitted && hit && grownKept && grownHits && externalSeen && miss) ? cout << PASS : cout << FAIL;
+}
+
+/** Testing that clean pages of open files are evicted to stay within the memory budget and read back on access */
+void test_memory_budget() {
+    gtfs_t *gtfs = gtfs_init(directory + "/memory", verbose);
+    const int pageSize = 4096, pages = 64;
+    gtfs->options.memoryBudget = 16 * pageSize;
+    string filename = "test17.txt";
+    // Data file written behind the library's back, so that all its pages start out clean
+    string contents;
+    for (int i = 0; i < pages; ++i) {
+        contents += string(pageSize, 'a' + i % 26);
+    }
+    ofstream(fs::path(gtfs->dirname) / filename, ios::binary) << contents;
+
+    file_t *fl = gtfs_open_file(gtfs, filename, contents.size());
+    string str1 = "Dirty page, kept resident.\n";
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 10 * pageSize, str1.length(), str1.c_str()));
+    contents.replace(10 * pageSize, str1.length(), str1);
+    // Two passes over the file, the second one reads back the pages the first one got evicted
+    bool readBack = true;
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int i = 0; i < pages; ++i) {
+            char *data = gtfs_read_file(gtfs, fl, i * pageSize, pageSize);
+            readBack &= data && contents.compare(i * pageSize, pageSize, data) == 0;
+            free(data);
+        }
+    }
+    auto usage = gtfs_get_memory_usage(gtfs);
+    gtfs_close_file(gtfs, fl);
+    auto closed = gtfs_get_memory_usage(gtfs);
+
+    bool withinBudget = usage.residentBytes + usage.transactionBytes <= usage.budgetBytes;
+    bool evicted = usage.evictedPages >= pages && usage.faultedPages >= 2 * pages - 16;
+    bool released = closed.residentBytes == 0 && closed.transactionBytes == 0;
+    cout << "Read back: " << readBack << ", resident " << usage.residentBytes << " of " << usage.budgetBytes << " bytes, "
+        << usage.evictedPages << " pages evicted, " << usage.faultedPages << " faulted, released on close: " << released << ": ";
+    (readBack && withinBudget && evicted && released) ? cout << PASS : cout << FAIL;
+}
+
+/** Returns the file names listed in the dirty file manifest of `dirname` */
+vector<string> read_dirty_manifest(const string& dirname) {
+    vector<string> fileNames;
+    ifstream manifest(fs::path(dirname) / ".gtfs.dirty");
+    string line;
+    getline(manifest, line);
+    while (getline(manifest, line)) {
+        fileNames.push_back(line);
+    }
+    sort(fileNames.begin(), fileNames.end());
+    return fileNames;
+}
+
+/** Testing that the dirty file manifest lists exactly the files with logs, and gets rebuilt if lost */
+void test_dirty_manifest() {
+    gtfs_t *gtfs = gtfs_init(directory + "/dirty", verbose);
+    // Clean files around the dirty ones, which the manifest leaves out
+    for (int i = 0; i < 20; ++i) {
+        ofstream(fs::path(gtfs->dirname) / ("clean" + to_string(i) + ".txt")) << "Clean file.\n";
+    }
+    string filename1 = "test18a.txt", filename2 = "test18b.txt";
+    string str = "Dirty file.\n";
+    for (const auto& filename: {filename1, filename2}) {
+        file_t *fl = gtfs_open_file(gtfs, filename, 100);
+        gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, str.length(), str.c_str()));
+        gtfs_close_file(gtfs, fl);
+    }
+    bool listed = read_dirty_manifest(gtfs->dirname) == vector<string>{filename1, filename2};
+
+    // A lost manifest gets rebuilt from the logs in the directory
+    fs::remove(fs::path(gtfs->dirname) / ".gtfs.dirty");
+    gtfs_clean(gtfs);
+    bool unlisted = fs::exists(fs::path(gtfs->dirname) / ".gtfs.dirty") && read_dirty_manifest(gtfs->dirname).empty();
+    ifstream dataFile(fs::path(gtfs->dirname) / filename2);
+    string line;
+    getline(dataFile, line);
+    bool cleaned = !fs::exists(fs::path(gtfs->dirname) / (filename1 + ".log")) && line + "\n" == str;
+
+    cout << "Listed: " << listed << ", unlisted after rebuild and clean: " << unlisted << ", cleaned: " << cleaned << ": ";
+    (listed && unlisted && cleaned) ? cout << PASS : cout << FAIL;
+}
+
+/** Testing that a batch of files opens in parallel, each file failing or succeeding on its own */
+void test_open_files_batch() {
+    gtfs_t *gtfs = gtfs_init(directory + "/batch", verbose);
+    vector<string> filenames;
+    vector<int> fileLengths;
+    for (int i = 0; i < 40; ++i) {
+        filenames.push_back("test19_" + to_string(i) + ".txt");
+        fileLengths.push_back(100 + i);
+    }
+    // Names that cannot be opened as data files fail on their own, without failing the batch
+    fs::create_directory(fs::path(gtfs->dirname) / "subdirectory");
+    filenames.push_back("subdirectory");
+    fileLengths.push_back(100);
+
+    auto files = gtfs_open_files(gtfs, filenames, fileLengths);
+    bool opened = files.size() == filenames.size() && files.back() == NULL;
+    for (size_t i = 0; i + 1 < files.size(); ++i) {
+        opened &= files[i] != NULL;
+        if (files[i]) {
+            gtfs_sync_write_file(gtfs_write_file(gtfs, files[i], i, filenames[i].length(), filenames[i].c_str()));
+            gtfs_close_file(gtfs, files[i]);
+        }
+    }
+    filenames.pop_back();
+    fileLengths.pop_back();
+
+    files = gtfs_open_files(gtfs, filenames, fileLengths);
+    bool reread = files.size() == filenames.size();
+    for (size_t i = 0; i < files.size(); ++i) {
+        char *data = files[i] ? gtfs_read_file(gtfs, files[i], i, filenames[i].length()) : NULL;
+        reread &= data && filenames[i].compare(data) == 0 && fs::file_size(fs::path(gtfs->dirname) / filenames[i]) == static_cast<size_t>(fileLengths[i]);
+        free(data);
+        if (files[i]) {
+            gtfs_close_file(gtfs, files[i]);
+        }
+    }
+    cout << "Opened in a batch: " << opened << ", reopened with committed contents: " << reread << ": ";
+    (opened && reread) ? cout << PASS : cout << FAIL;
+}
+
+/** Testing that opening a sparse file reads only its data, and that extensions can be preallocated */
+void test_sparse_open() {
+    gtfs_t *gtfs = gtfs_init(directory + "/sparse", verbose);
+    const int pageSize = 4096, fileLength = 2048 * pageSize;
+    string filename = "test20.txt";
+    file_t *fl = gtfs_open_file(gtfs, filename, fileLength);
+    string str1 = "Data in the middle of a hole.\n";
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl, fileLength / 2, str1.length(), str1.c_str()));
+    gtfs_close_file(gtfs, fl);
+    gtfs_clean(gtfs);
+
+    // Only the page holding data gets read from the file, the holes around it are zeros without I/O
+    auto before = gtfs_get_memory_usage(gtfs);
+    fl = gtfs_open_file(gtfs, filename, fileLength);
+    char *data = gtfs_read_file(gtfs, fl, fileLength / 2, str1.length());
+    bool dataRead = data && str1.compare(data) == 0;
+    free(data);
+    bool holesZero = true;
+    for (int offset = 0; offset < fileLength; offset += 64 * pageSize) {
+        data = gtfs_read_file(gtfs, fl, offset, pageSize);
+        holesZero &= data && (offset == fileLength / 2 || data[0] == '\0');
+        free(data);
+    }
+    auto after = gtfs_get_memory_usage(gtfs);
+    gtfs_close_file(gtfs, fl);
+    bool holesSkipped = after.faultedPages - before.faultedPages == 1;
+
+    // Preallocated extensions get their blocks up front
+    gtfs->options.preallocate = true;
+    string filename2 = "test20b.txt";
+    fl = gtfs_open_file(gtfs, filename2, fileLength);
+    gtfs_close_file(gtfs, fl);
+    gtfs->options.preallocate = false;
+    struct stat st;
+    bool preallocated = stat((fs::path(gtfs->dirname) / filename2).c_str(), &st) == 0 && st.st_size == fileLength && st.st_blocks * 512 >= fileLength;
+
+    cout << "Data read: " << dataRead << ", holes zero: " << holesZero << ", pages read from file: " << after.faultedPages - before.faultedPages << ", preallocated: " << preallocated << ": ";
+    (dataRead && holesZero && holesSkipped && preallocated) ? cout << PASS : cout << FAIL;
+}
+
+/** Testing that the checkpoint punches holes for pages cleared to zeros instead of writing them */
+void test_checkpoint_hole_punching() {
+    gtfs_t *gtfs = gtfs_init(directory + "/punch", verbose);
+    const int pageSize = 4096, pages = 64;
+    string filename = "test21.txt";
+    auto filePath = fs::path(gtfs->dirname) / filename;
+    string contents(pages * pageSize, 'x');
+    ofstream(filePath, ios::binary) << contents;
+
+    // Clear 32 pages in the middle, the checkpoint punches them out instead of writing zeros
+    file_t *fl = gtfs_open_file(gtfs, filename, contents.size());
+    string zeros(32 * pageSize, '\0');
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 8 * pageSize, zeros.length(), zeros.c_str()));
+    gtfs_close_file(gtfs, fl);
+    gtfs_clean(gtfs);
+    contents.replace(8 * pageSize, zeros.length(), zeros);
+
+    ifstream dataFile(filePath, ios::binary);
+    string checkpointed((istreambuf_iterator<char>(dataFile)), istreambuf_iterator<char>());
+    struct stat st;
+    bool punched = stat(filePath.c_str(), &st) == 0 && st.st_blocks * 512 <= (pages - 32) * pageSize;
+    bool intact = checkpointed == contents;
+
+    cout << "Contents after checkpoint: " << intact << ", " << st.st_blocks * 512 << " bytes allocated for " << checkpointed.size() << ": ";
+    (intact && punched) ? cout << PASS : cout << FAIL;
+}
+
+/** Testing that a read-only open does not block the writer and refreshes from the records appended since */
+void test_readonly_open() {
+    fs::remove_all(directory + "/readonly");
+    gtfs_t *gtfs = gtfs_init(directory + "/readonly", verbose);
+    string filename = "test22.txt";
+    string str1 = "First commit.", str2 = "Second commit.", str3 = "Third commit.";
+    file_t *writer = gtfs_open_file(gtfs, filename, 300);
+    gtfs_sync_write_file(gtfs_write_file(gtfs, writer, 0, str1.length(), str1.c_str()));
+
+    // The reader does not lock the writer out, and the writer does not lock the reader out
+    file_t *reader = gtfs_open_file_readonly(gtfs, filename);
+    char *data = reader ? gtfs_read_file(gtfs, reader, 0, str1.length()) : NULL;
+    bool opened = data && str1.compare(data) == 0 && gtfs_write_file(gtfs, reader, 0, 1, "x") == NULL;
+    free(data);
+
+    // Refresh picks up the records appended since
+    gtfs_sync_write_file(gtfs_write_file(gtfs, writer, 100, str2.length(), str2.c_str()));
+    data = gtfs_read_file(gtfs, reader, 100, str2.length());
+    bool stale = data && data[0] == '\0';
+    free(data);
+    gtfs_refresh_file(gtfs, reader);
+    data = gtfs_read_file(gtfs, reader, 100, str2.length());
+    bool refreshed = data && str2.compare(data) == 0;
+    free(data);
+
+    // A clean replaces the log, the view gets rebuilt
+    gtfs_close_file(gtfs, writer);
+    gtfs_clean(gtfs);
+    writer = gtfs_open_file(gtfs, filename, 300);
+    bool writerReopened = writer != NULL;
+    if (writer) {
+        gtfs_sync_write_file(gtfs_write_file(gtfs, writer, 200, str3.length(), str3.c_str()));
+        gtfs_close_file(gtfs, writer);
+    }
+    gtfs_refresh_file(gtfs, reader);
+    char *data2 = gtfs_read_file(gtfs, reader, 100, str2.length());
+    char *data3 = gtfs_read_file(gtfs, reader, 200, str3.length());
+    bool rebuilt = data2 && str2.compare(data2) == 0 && data3 && str3.compare(data3) == 0;
+    free(data2);
+    free(data3);
+    gtfs_close_file(gtfs, reader);
+
+    cout << "Opened read-only: " << opened << ", stale before refresh: " << stale << ", refreshed: " << refreshed
+        << ", writer reopened: " << writerReopened << ", rebuilt after clean: " << rebuilt << ": ";
+    (opened && stale && refreshed && writerReopened && rebuilt) ? cout << PASS : cout << FAIL;
+}
+
+/** Testing that commits shipped to a standby are applied and checkpointed there, and survive its promotion */
+void test_replication() {
+    gtfs_t *primary = gtfs_init(directory + "/replica", verbose);
+    gtfs_t *standby = gtfs_init(directory + "/standby", verbose);
+    string filename = "test23.txt", removed = "test23b.txt";
+    string str1 = "Before replication.", str2 = "Shipped commit.", str3 = "Another shipped commit.";
+    file_t *fl = gtfs_open_file(primary, filename, 300);
+    gtfs_sync_write_file(gtfs_write_file(primary, fl, 0, str1.length(), str1.c_str()));
+    file_t *other = gtfs_open_file(primary, removed, 100);
+    gtfs_close_file(primary, other);
+
+    // Commits from before are copied, the ones after get shipped; a small threshold makes the standby checkpoint too
+    bool started = gtfs_start_replication(primary, standby, 16) == 0 && gtfs_start_replication(primary, standby) == -1;
+    gtfs_sync_write_file(gtfs_write_file(primary, fl, 100, str2.length(), str2.c_str()));
+    gtfs_sync_write_file(gtfs_write_file(primary, fl, 200, str3.length(), str3.c_str()));
+    gtfs_close_file(primary, fl);
+    bool removedOnPrimary = gtfs_remove_file(primary, other) != -1;
+    gtfs_replication_stats_t stats = gtfs_get_replication_stats(primary);
+    bool shipped = removedOnPrimary && stats.active && stats.shippedRecords == 3;
+
+    // Once promoted, the standby holds every commit in its data file and the removal took effect there as well
+    bool promoted = gtfs_promote_standby(primary) == 0;
+    stats = gtfs_get_replication_stats(primary);
+    bool applied = !stats.active && stats.appliedRecords == 3 && stats.pendingRecords == 0 && stats.uncheckpointedBytes == 0;
+    bool checkpointed = !ifstream(standby->dirname + "/" + filename + ".log").good()
+        && !ifstream(standby->dirname + "/" + removed).good();
+    fl = gtfs_open_file(standby, filename, 300);
+    char *data1 = fl ? gtfs_read_file(standby, fl, 0, str1.length()) : NULL;
+    char *data2 = fl ? gtfs_read_file(standby, fl, 100, str2.length()) : NULL;
+    char *data3 = fl ? gtfs_read_file(standby, fl, 200, str3.length()) : NULL;
+    bool replicated = data1 && str1.compare(data1) == 0 && data2 && str2.compare(data2) == 0 && data3 && str3.compare(data3) == 0;
+    free(data1);
+    free(data2);
+    free(data3);
+    if (fl) {
+        gtfs_close_file(standby, fl);
+    }
+
+    cout << "Started: " << started << ", shipped: " << shipped << ", promoted: " << promoted << ", applied: " << applied
+        << ", checkpointed: " << checkpointed << ", replicated: " << replicated << ": ";
+    (started && shipped && promoted && applied && checkpointed && replicated) ? cout << PASS : cout << FAIL;
+}
+
+/** Testing that offsets past 4 GB are written, logged, replayed and checkpointed through the 64-bit API */
+void test_large_file() {
+    gtfs_t *gtfs = gtfs_init(directory + "/large", verbose);
+    string filename = "test24.txt";
+    string str1 = "Below 2 GB.", str2 = "Beyond 4 GB.";
+    // Past 4 GB so that any 32-bit truncation of offsets or lengths shows, left sparse to stay cheap
+    off_t fileLength = (off_t(5) << 30) + 123, farOffset = (off_t(9) << 29) + 7;
+    file_t *fl = gtfs_open_file64(gtfs, filename, fileLength);
+    bool opened = fl && fl->fileLength == fileLength;
+    write_t *wrt = fl ? gtfs_write_file64(gtfs, fl, farOffset, str2.length(), str2.c_str()) : NULL;
+    bool written = wrt && wrt->offset == farOffset && gtfs_sync_write_file(wrt) == 0;
+    if (fl) {
+        gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, str1.length(), str1.c_str()));
+        gtfs_close_file(gtfs, fl);
+    }
+
+    // The log keeps the 64-bit offset, replaying and cleaning it lands the data at the right place
+    fl = gtfs_open_file64(gtfs, filename, fileLength);
+    char *data = fl ? gtfs_read_file64(gtfs, fl, farOffset, str2.length()) : NULL;
+    bool replayed = data && str2.compare(data) == 0;
+    free(data);
+    if (fl) {
+        gtfs_close_file(gtfs, fl);
+    }
+    bool cleaned = gtfs_clean_n_bytes64(gtfs, -1) == 0 && !ifstream(gtfs->dirname + "/" + filename + ".log").good();
+    char far[16] = {0};
+    struct stat st;
+    int fd = open((gtfs->dirname + "/" + filename).c_str(), O_RDONLY);
+    bool checkpointed = fd != -1 && fstat(fd, &st) == 0 && st.st_size == fileLength
+        && pread(fd, far, str2.length(), farOffset) == static_cast<ssize_t>(str2.length()) && str2.compare(far) == 0
+        && st.st_blocks * 512 < (off_t(1) << 30);
+    if (fd != -1) {
+        close(fd);
+    }
+
+    cout << "Opened: " << opened << ", written: " << written << ", replayed: " << replayed << ", cleaned: " << cleaned
+        << ", checkpointed in place: " << checkpointed << ": ";
+    (opened && written && replayed && cleaned && checkpointed) ? cout << PASS : cout << FAIL;
+}
+
+/** Testing that syncing a file commits all its pending writes as merged extents in one append */
+void test_sync_file() {
+    fs::remove_all(directory + "/syncfile");
+    gtfs_t *gtfs = gtfs_init(directory + "/syncfile", verbose);
+    string filename = "test25.txt";
+    file_t *fl = gtfs_open_file(gtfs, filename, 200);
+    // Adjacent and overlapping writes make up one extent, the write at 150 another one
+    vector<write_t*> writes;
+    writes.push_back(gtfs_write_file(gtfs, fl, 0, 10, "aaaaaaaaaa"));
+    writes.push_back(gtfs_write_file(gtfs, fl, 10, 10, "bbbbbbbbbb"));
+    writes.push_back(gtfs_write_file(gtfs, fl, 5, 10, "cccccccccc"));
+    writes.push_back(gtfs_write_file(gtfs, fl, 150, 5, "ddddd"));
+    writes.push_back(gtfs_write_file(gtfs, fl, 18, 4, "eeee"));
+    string expected = "aaaaaccccccccccbbbeeee";
+    bool synced = gtfs_sync_file(gtfs, fl) == 0 && gtfs_sync_write_file(writes[0]) == -1;
+    gtfs_close_file(gtfs, fl);
+
+    vector<gtfs_verify_result_t> results;
+    gtfs_verify(gtfs, false, results);
+    uint64_t records = 0;
+    for (const auto& result: results) {
+        records += result.isLog ? result.records : 0;
+    }
+    bool merged = records == 2;
+
+    fl = gtfs_open_file(gtfs, filename, 200);
+    char *data1 = gtfs_read_file(gtfs, fl, 0, expected.length());
+    char *data2 = gtfs_read_file(gtfs, fl, 150, 5);
+    bool replayed = data1 && expected.compare(data1) == 0 && data2 && string("ddddd").compare(data2) == 0;
+    free(data1);
+    free(data2);
+    // Nothing pending is a successful no-op
+    bool empty = gtfs_sync_file(gtfs, fl) == 0;
+    gtfs_close_file(gtfs, fl);
+
+    cout << "Synced: " << synced << ", merged into 2 records: " << merged << ", replayed: " << replayed << ", nothing pending: " << empty << ": ";
+    (synced && merged && replayed && empty) ? cout << PASS : cout << FAIL;
+}
+
+/** Testing that a log spanning several read-ahead chunks replays and cleans like a small one */
+void test_read_ahead_replay() {
+    gtfs_t *gtfs = gtfs_init(directory + "/readahead", verbose);
+    string filename = "test26.txt";
+    auto logFilePath = fs::path(gtfs->dirname) / (filename + ".log");
+    // Records of odd sizes, several above the room kept for carrying a record over, spread the log over a few read-ahead chunks
+    int records = 60, fileLength = 0;
+    vector<string> contents;
+    for (int i = 0; i < records; ++i) {
+        contents.push_back(string(50000 + i * 3001, 'a' + i % 26));
+        fileLength += contents.back().length();
+    }
+    file_t *fl = gtfs_open_file(gtfs, filename, fileLength);
+    int offset = 0;
+    for (const auto& content: contents) {
+        gtfs_sync_write_file(gtfs_write_file(gtfs, fl, offset, content.length(), content.c_str()));
+        offset += content.length();
+    }
+    gtfs_close_file(gtfs, fl);
+    auto intactSize = fs::file_size(logFilePath);
+    ofstream logFile(logFilePath, ios::binary | ios::app);
+    logFile << "1 20 16 Torn";
+    logFile.close();
+
+    // Every record gets replayed across the chunk boundaries, and the torn tail gets dropped
+    fl = gtfs_open_file(gtfs, filename, fileLength);
+    bool replayed = true;
+    offset = 0;
+    for (const auto& content: contents) {
+        char *data = gtfs_read_file(gtfs, fl, offset, content.length());
+        replayed &= data && content.compare(data) == 0;
+        free(data);
+        offset += content.length();
+    }
+    gtfs_close_file(gtfs, fl);
+    bool truncated = fs::file_size(logFilePath) == intactSize;
+
+    // A partial clean applies records while reading them and stops at the first one past the byte budget
+    gtfs_clean_n_bytes(gtfs, contents[0].length() + contents[1].length());
+    ifstream dataFile(fs::path(gtfs->dirname) / filename, ios::binary);
+    string checkpointed((istreambuf_iterator<char>(dataFile)), istreambuf_iterator<char>());
+    bool cleaned = checkpointed.compare(0, contents[0].length(), contents[0]) == 0
+        && checkpointed.compare(contents[0].length(), contents[1].length(), contents[1]) == 0
+        && checkpointed[contents[0].length() + contents[1].length()] == '\0';
+
+    cout << "Replayed: " << replayed << ", torn tail dropped: " << truncated << ", partially cleaned: " << cleaned << ": ";
+    (replayed && truncated && cleaned) ? cout << PASS : cout << FAIL;
+}
+
+/** Testing that large writes are logged as references to a sidecar file and copied from it by the checkpoint */
+void test_large_write_bypass() {
+    gtfs_t *gtfs = gtfs_init(directory + "/bypass", verbose);
+    gtfs->options.largeWriteThreshold = 4096;
+    string filename = "test27.txt";
+    auto logFilePath = fs::path(gtfs->dirname) / (filename + ".log");
+    auto sidecarPath = fs::path(gtfs->dirname) / (filename + ".log.ext");
+    string small(200, 'a'), large(20000, 'b'), overlapping(100, 'c');
+    file_t *fl = gtfs_open_file(gtfs, filename, 30000);
+    // Small writes stay in the log, the large one lands in the sidecar and gets partly overwritten by a later small write
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 900, small.length(), small.c_str()));
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 1000, large.length(), large.c_str()));
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 5000, overlapping.length(), overlapping.c_str()));
+    gtfs_close_file(gtfs, fl);
+    string expected = string(100, 'a') + string(4000, 'b') + overlapping + string(15900, 'b');
+    bool outOfPlace = fs::file_size(logFilePath) < large.length() && fs::exists(sidecarPath)
+        && fs::file_size(sidecarPath) >= large.length();
+
+    // Replay loads the referenced bytes back from the sidecar
+    fl = gtfs_open_file(gtfs, filename, 30000);
+    char *data = gtfs_read_file(gtfs, fl, 900, expected.length());
+    bool replayed = data && expected.compare(0, expected.length(), data, expected.length()) == 0;
+    free(data);
+    gtfs_close_file(gtfs, fl);
+
+    // The checkpoint copies what is left of the extent into the data file, then drops the log and its sidecar
+    gtfs_clean(gtfs);
+    ifstream dataFile(fs::path(gtfs->dirname) / filename, ios::binary);
+    string checkpointed((istreambuf_iterator<char>(dataFile)), istreambuf_iterator<char>());
+    bool cleaned = checkpointed.compare(900, expected.length(), expected) == 0 && checkpointed[899] == '\0'
+        && !fs::exists(logFilePath) && !fs::exists(sidecarPath);
+
+    cout << "Logged out of place: " << outOfPlace << ", replayed: " << replayed << ", cleaned: " << cleaned << ": ";
+    (outOfPlace && replayed && cleaned) ? cout << PASS : cout << FAIL;
+}
+
+/** Testing that the log-structured engine compacts the oldest segments and keeps its data out of the data file */
+void test_log_structured() {
+    gtfs_t *gtfs = gtfs_init(directory + "/logstructured", verbose);
+    gtfs->options.logStructured = true;
+    // One page-sized record per segment
+    gtfs->options.logSegmentSize = 8192;
+    string filename = "test28.txt";
+    auto logFilePath = fs::path(gtfs->dirname) / (filename + ".log");
+    file_t *fl = gtfs_open_file(gtfs, filename, 16384);
+    // A cold page written once, then a hot page overwritten over and over
+    string cold(4096, 'k');
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 8192, cold.length(), cold.c_str()));
+    string hot;
+    for (char c = 'a'; c <= 'h'; ++c) {
+        hot = string(4096, c);
+        gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, hot.length(), hot.c_str()));
+    }
+    gtfs_close_file(gtfs, fl);
+    auto logBytes = [&]() {
+        uintmax_t size = 0;
+        for (auto& p: fs::directory_iterator(gtfs->dirname)) {
+            if (p.path().filename().string().rfind(filename + ".log.", 0) == 0) {
+                size += fs::file_size(p.path());
+            }
+        }
+        return size;
+    };
+    auto before = logBytes();
+    auto statsBefore = gtfs_get_write_stats();
+
+    // The clean moves the cold page out of the oldest segment and drops the segments only holding dead versions of the hot one
+    gtfs_clean(gtfs);
+    auto statsAfter = gtfs_get_write_stats();
+    bool compacted = logBytes() < before / 2 && !fs::exists(logFilePath.string() + ".1") && fs::exists(logFilePath)
+        && statsAfter.compactedBytes - statsBefore.compactedBytes == cold.length()
+        && statsAfter.checkpointBytes == statsBefore.checkpointBytes;
+    ifstream dataFile(fs::path(gtfs->dirname) / filename, ios::binary);
+    string dataContents((istreambuf_iterator<char>(dataFile)), istreambuf_iterator<char>());
+    bool dataUntouched = dataContents == string(16384, '\0');
+
+    fl = gtfs_open_file(gtfs, filename, 16384);
+    char *hotData = gtfs_read_file(gtfs, fl, 0, hot.length());
+    char *coldData = gtfs_read_file(gtfs, fl, 8192, cold.length());
+    bool replayed = hotData && coldData && hot.compare(0, hot.length(), hotData, hot.length()) == 0
+        && cold.compare(0, cold.length(), coldData, cold.length()) == 0;
+    free(hotData);
+    free(coldData);
+    gtfs_close_file(gtfs, fl);
+
+    cout << "Compacted: " << compacted << ", data file untouched: " << dataUntouched << ", replayed: " << replayed << ": ";
+    (compacted && dataUntouched && replayed) ? cout << PASS : cout << FAIL;
+}
+
+/** Testing that uncommitted writes past the budget spill their data to disk and still commit and abort */
+void test_spill_uncommitted() {
+    gtfs_t *gtfs = gtfs_init(directory + "/spill", verbose);
+    gtfs->options.uncommittedBudget = 16384;
+    string filename = "test29.txt";
+    int writes = 16, length = 4096;
+    file_t *fl = gtfs_open_file(gtfs, filename, writes * length);
+    vector<write_t*> pending;
+    for (int i = 0; i < writes; ++i) {
+        string data(length, 'a' + i);
+        pending.push_back(gtfs_write_file(gtfs, fl, i * length, length, data.c_str()));
+    }
+    // Written on top of an uncommitted write, its undo data is that write's data
+    string overwrite(length, 'z');
+    write_t *overlapping = gtfs_write_file(gtfs, fl, 0, length, overwrite.c_str());
+    auto usage = gtfs_get_memory_usage(gtfs);
+    bool bounded = usage.transactionBytes <= gtfs->options.uncommittedBudget && usage.spilledBytes > 0;
+
+    // Commits and aborts read the data back from the spill file
+    gtfs_abort_write_file(overlapping);
+    for (int i = 0; i < writes; ++i) {
+        i % 2 == 0 ? gtfs_sync_write_file(pending[i]) : gtfs_abort_write_file(pending[i]);
+    }
+    bool released = gtfs_get_memory_usage(gtfs).spilledBytes == 0;
+    gtfs_close_file(gtfs, fl);
+
+    fl = gtfs_open_file(gtfs, filename, writes * length);
+    bool restored = true;
+    for (int i = 0; i < writes; ++i) {
+        // Reads stop at the first zero byte, aborted pages read as empty
+        char *data = gtfs_read_file(gtfs, fl, i * length, length);
+        restored &= data && (i % 2 == 0 ? string(data) == string(length, 'a' + i) : data[0] == '\0');
+        free(data);
+    }
+    gtfs_close_file(gtfs, fl);
+
+    cout << "Memory bounded: " << bounded << ", spill file released: " << released << ", committed and aborted: " << restored << ": ";
+    (bounded && released && restored) ? cout << PASS : cout << FAIL;
+}
+
+/** Testing that the background cleaner checkpoints the log in throttled chunks while commits go on */
+void test_background_cleaner() {
+    gtfs_t *gtfs = gtfs_init(directory + "/cleaner", verbose);
+    string filename = "test30.txt";
+    int writes = 8, length = 4096;
+    file_t *fl = gtfs_open_file(gtfs, filename, 2 * writes * length);
+    for (int i = 0; i < writes; ++i) {
+        string data(length, 'a' + i);
+        gtfs_sync_write_file(gtfs_write_file(gtfs, fl, i * length, length, data.c_str()));
+    }
+    gtfs_cleaner_options_t options;
+    options.chunkBytes = length;
+    options.bytesPerSecond = 1 << 20;
+    options.idleSeconds = 0.01;
+    bool started = gtfs_start_cleaner(gtfs, options) == 0;
+    // Commits keep going while the cleaner works through the log
+    for (int i = writes; i < 2 * writes; ++i) {
+        string data(length, 'a' + i);
+        gtfs_sync_write_file(gtfs_write_file(gtfs, fl, i * length, length, data.c_str()));
+    }
+    auto logFilePath = fs::path(gtfs->dirname) / (filename + ".log");
+    gtfs_cleaner_stats_t stats;
+    for (int waited = 0; waited < 500; ++waited) {
+        stats = gtfs_get_cleaner_stats(gtfs);
+        if (!fs::exists(logFilePath) && stats.backlogBytes == 0 && stats.passes > 1) {
+            break;
+        }
+        usleep(10000);
+    }
+    bool cleaned = !fs::exists(logFilePath) && stats.backlogBytes == 0;
+    bool paced = stats.chunks > 1 && stats.cleanedBytes > 0 && stats.throttledSeconds > 0;
+    bool stopped = gtfs_stop_cleaner(gtfs) == 0 && !gtfs_get_cleaner_stats(gtfs).running;
+    gtfs_close_file(gtfs, fl);
+
+    fl = gtfs_open_file(gtfs, filename, 2 * writes * length);
+    bool intact = true;
+    for (int i = 0; i < 2 * writes; ++i) {
+        char *data = gtfs_read_file(gtfs, fl, i * length, length);
+        intact &= data && string(data) == string(length, 'a' + i);
+        free(data);
+    }
+    gtfs_close_file(gtfs, fl);
+
+    cout << "Started: " << started << ", log cleaned: " << cleaned << ", chunked and throttled: " << paced << ", stopped: " << stopped << ", data intact: " << intact << ": ";
+    (started && cleaned && paced && stopped && intact) ? cout << PASS : cout << FAIL;
+}
+
+/** Testing that replaying a large log on several threads, by offset range, yields the contents of an in-order replay */
+void test_parallel_replay() {
+    gtfs_t *gtfs = gtfs_init(directory + "/parallelreplay", verbose);
+    gtfs->options.replayThreads = 4;
+    gtfs->options.deltaEncoding = true;
+    string filename = "test31.txt";
+    int fileLength = 1 << 21, writes = 160, length = 65536 + 100;
+    // Overlapping writes at unaligned offsets, more redo data than the file holds so that replay runs on several threads
+    string expected(fileLength, 'Z');
+    file_t *fl = gtfs_open_file(gtfs, filename, fileLength);
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, fileLength, expected.c_str()));
+    for (int i = 0; i < writes; ++i) {
+        int offset = (i * 7919 * 37) % (fileLength - length);
+        string data(length, 'a' + i % 26);
+        // Delta-encoded records keep only the changed bytes, leave a few unchanged in the middle
+        data.replace(length / 2, 64, expected, offset + length / 2, 64);
+        gtfs_sync_write_file(gtfs_write_file(gtfs, fl, offset, length, data.c_str()));
+        expected.replace(offset, length, data);
+    }
+    gtfs_close_file(gtfs, fl);
+
+    auto logFilePath = fs::path(gtfs->dirname) / (filename + ".log");
+    bool logged = fs::exists(logFilePath) && fs::file_size(logFilePath) > static_cast<uintmax_t>(2 * fileLength);
+    fl = gtfs_open_file(gtfs, filename, fileLength);
+    char *data = gtfs_read_file(gtfs, fl, 0, fileLength);
+    bool replayed = data && string(data) == expected;
+    free(data);
+    gtfs_close_file(gtfs, fl);
+
+    cout << "Log larger than the file: " << logged << ", replayed in order: " << replayed << ": ";
+    (logged && replayed) ? cout << PASS : cout << FAIL;
+}
+
+/** Testing that write handles come from a per-file slab, reuse released slots and reject stale handles */
+void test_write_handles() {
+    gtfs_t *gtfs = gtfs_init(directory + "/handles", verbose);
+    string filename = "test32.txt";
+    int writes = 1000, length = 100;
+    file_t *fl = gtfs_open_file(gtfs, filename, writes * length);
+    // Each write gets synced and released before the next, so all of them reuse the same slot
+    bool reused = true;
+    gtfs_write_handle_t first;
+    for (int i = 0; i < writes; ++i) {
+        string data(length, 'a' + i % 26);
+        auto handle = gtfs_write_file_handle(gtfs, fl, i * length, length, data.c_str());
+        reused &= handle.generation != 0 && handle.slot == 0 && gtfs_sync_write_handle(fl, handle) == 0 && gtfs_release_write_handle(fl, handle) == 0;
+        if (i == 0) {
+            first = handle;
+        }
+    }
+    // A released handle is rejected, even once its slot got handed out again
+    string data(length, 'X');
+    auto aborted = gtfs_write_file_handle(gtfs, fl, 0, length, data.c_str());
+    bool stale = gtfs_sync_write_handle(fl, first) == -1 && gtfs_abort_write_handle(fl, first) == -1 && gtfs_release_write_handle(fl, first) == -1
+        && gtfs_release_write_handle(fl, gtfs_write_handle_t()) == -1;
+    bool abortedOk = gtfs_abort_write_handle(fl, aborted) == 0 && gtfs_release_write_handle(fl, aborted) == 0;
+    // The write_t calls wrap a handle, releasing the write_t frees its slot
+    write_t *wrt = gtfs_write_file(gtfs, fl, length, length, data.c_str());
+    bool wrapped = wrt && wrt->handle.slot == 0 && gtfs_sync_write_file(wrt) == 0 && gtfs_release_write_file(wrt) == 0;
+    gtfs_close_file(gtfs, fl);
+
+    fl = gtfs_open_file(gtfs, filename, writes * length);
+    char *read = gtfs_read_file(gtfs, fl, 0, 2 * length);
+    bool persisted = read && string(read) == string(length, 'a') + data;
+    free(read);
+    gtfs_close_file(gtfs, fl);
+
+    cout << "Slot reused: " << reused << ", stale handles rejected: " << stale << ", aborted: " << abortedOk << ", write_t wrapper: " << wrapped << ", persisted: " << persisted << ": ";
+    (reused && stale && abortedOk && wrapped && persisted) ? cout << PASS : cout << FAIL;
+}
+
+/** Fixed-size record with zero bytes in it, which the generic read would stop at */
+struct TestRecord {
+    uint64_t id;
+    int32_t values[5];
+    char tag[4];
+};
+
+/** Testing that the typed record API writes and reads fixed-size records, zero bytes included */
+void test_record_file() {
+    gtfs_t *gtfs = gtfs_init(directory + "/records", verbose);
+    string filename = "test33.txt";
+    int records = 100;
+    file_t *fl = gtfs_open_file(gtfs, filename, records * sizeof(TestRecord));
+    gtfs_record_file<TestRecord> typed(fl);
+    auto make = [](uint64_t id) {
+        TestRecord record = {id, {0, int32_t(id), -int32_t(id), 0, 7}, {'r', 0, 'c', 0}};
+        return record;
+    };
+    bool written = typed.size() == static_cast<VMSizeT>(records);
+    for (int i = 0; i < records; ++i) {
+        written &= (i % 2 == 0 ? typed.write(i, make(i)) : typed.write_pending(i, make(i))) == 0;
+    }
+    written &= typed.sync() == 0;
+    gtfs_close_file(gtfs, fl);
+
+    fl = gtfs_open_file(gtfs, filename, records * sizeof(TestRecord));
+    gtfs_record_file<TestRecord> reopened(fl);
+    bool persisted = true;
+    for (int i = 0; i < records; ++i) {
+        TestRecord record = reopened.read(i), expected = make(i);
+        persisted &= memcmp(&record, &expected, sizeof(TestRecord)) == 0;
+    }
+    // Records past the end read as zeros, as do records of a closed file
+    TestRecord past = reopened.read(records), zero = TestRecord();
+    bool zeroed = memcmp(&past, &zero, sizeof(TestRecord)) == 0;
+    gtfs_close_file(gtfs, fl);
+    TestRecord closed;
+    bool refused = !reopened.read(0, closed) && reopened.write(0, make(0)) == -1;
+
+    cout << "Written: " << written << ", persisted with zero bytes: " << persisted << ", past the end zeroed: " << zeroed << ", closed file refused: " << refused << ": ";
+    (written && persisted && zeroed && refused) ? cout << PASS : cout << FAIL;
+}
+
+/** Testing that a log written before records had checksums gets replayed, and that a corrupted record in the middle of a log is never truncated */
+void test_legacy_and_corrupted_log() {
+    fs::remove_all(directory + "/legacy");
+    gtfs_t *gtfs = gtfs_init(directory + "/legacy", verbose);
+    string filename = "test34.txt";
+    auto filePath = fs::path(gtfs->dirname) / filename;
+    auto logFilePath = fs::path(gtfs->dirname) / (filename + ".log");
+    ofstream(filePath, ios::binary) << "hello world";
+    ofstream(logFilePath, ios::binary) << "1 0 5 HELLO";
+    file_t *fl = gtfs_open_file(gtfs, filename, 11);
+    char *data = fl ? gtfs_read_file(gtfs, fl, 0, 11) : NULL;
+    bool legacyReplayed = data && string(data) == "HELLO world";
+    free(data);
+    // The open rewrites the log with checksums, which the records appended since are checked against too
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, 5, "WORLD"));
+    gtfs_close_file(gtfs, fl);
+    vector<gtfs_verify_result_t> results;
+    bool upgraded = gtfs_verify(gtfs, false, results) == 0;
+
+    // Damage the first record, the second one must survive the failed open and a repair
+    auto logSize = fs::file_size(logFilePath);
+    fstream logFile(logFilePath, ios::binary | ios::in | ios::out);
+    logFile.seekp(8);
+    logFile.put('#');
+    logFile.close();
+    fl = gtfs_open_file(gtfs, filename, 11);
+    bool refused = fl == NULL;
+    if (fl) {
+        gtfs_close_file(gtfs, fl);
+    }
+    int damaged = gtfs_verify(gtfs, true, results);
+    bool reported = false;
+    for (const auto& result: results) {
+        reported |= result.isLog && result.corrupted && result.validBytes == 0 && !result.repaired;
+    }
+    bool kept = fs::file_size(logFilePath) == logSize;
+
+    cout << "Legacy log replayed: " << legacyReplayed << ", upgraded: " << upgraded << ", open refused: " << refused << ", damaged: " << damaged << ", reported: " << reported << ", log kept: " << kept << ": ";
+    (legacyReplayed && upgraded && refused && damaged == 1 && reported && kept) ? cout << PASS : cout << FAIL;
+}
+
+/** Testing that delta encoding does not diff a write against the unsynced rest of a partially synced write */
+void test_delta_after_partial_sync() {
+    fs::remove_all(directory + "/deltapartial");
+    gtfs_t *gtfs = gtfs_init(directory + "/deltapartial", verbose);
+    gtfs->options.deltaEncoding = true;
+    string filename = "test35.txt";
+    file_t *fl = gtfs_open_file(gtfs, filename, 200);
+    string x(100, 'X'), y(100, 'Y');
+    gtfs_sync_write_file_n_bytes(gtfs_write_file(gtfs, fl, 0, x.length(), x.c_str()), 50);
+    // Rewriting the bytes left unsynced is a change as far as the log goes, through a single commit and through gtfs_sync_file()
+    int synced = gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 50, 50, x.c_str()));
+    gtfs_sync_write_file_n_bytes(gtfs_write_file(gtfs, fl, 100, y.length(), y.c_str()), 50);
+    gtfs_write_file(gtfs, fl, 150, 50, y.c_str());
+    synced |= gtfs_sync_file(gtfs, fl);
+    gtfs_close_file(gtfs, fl);
+
+    fl = gtfs_open_file(gtfs, filename, 200);
+    char *data = gtfs_read_file(gtfs, fl, 0, 200);
+    bool replayed = data && string(data) == x + y;
+    free(data);
+    gtfs_close_file(gtfs, fl);
+
+    cout << "Synced: " << (synced == 0) << ", replayed: " << replayed << ": ";
+    (synced == 0 && replayed) ? cout << PASS : cout << FAIL;
+}
+
+/** Testing that a commit whose log append fails reports it and stays uncommitted, so that it can be synced again */
+void test_failed_log_append() {
+    fs::remove_all(directory + "/logfailure");
+    gtfs_t *gtfs = gtfs_init(directory + "/logfailure", verbose);
+    gtfs->options.largeWriteThreshold = 16;
+    string filename = "test36.txt";
+    auto logFilePath = fs::path(gtfs->dirname) / (filename + ".log");
+    // The sidecar file of large writes cannot be created where a directory is in the way
+    fs::create_directories(logFilePath.string() + ".ext/in-the-way");
+    file_t *fl = gtfs_open_file(gtfs, filename, 100);
+    string str(32, 'L');
+    write_t *wrt = gtfs_write_file(gtfs, fl, 0, str.length(), str.c_str());
+    bool failed = gtfs_sync_write_file(wrt) == -1 && !fs::exists(logFilePath);
+    fs::remove_all(logFilePath.string() + ".ext");
+    bool retried = gtfs_sync_write_file(wrt) == 0;
+    gtfs_close_file(gtfs, fl);
+
+    fl = gtfs_open_file(gtfs, filename, 100);
+    char *data = gtfs_read_file(gtfs, fl, 0, str.length());
+    bool replayed = data && str.compare(data) == 0;
+    free(data);
+    gtfs_close_file(gtfs, fl);
+
+    cout << "Failed append reported: " << failed << ", retried: " << retried << ", replayed: " << replayed << ": ";
+    (failed && retried && replayed) ? cout << PASS : cout << FAIL;
+}
+
+/** Testing that a clean whose checkpoint fails keeps the log, so a later clean still applies it */
+void test_failed_checkpoint() {
+    fs::remove_all(directory + "/checkpointfailure");
+    gtfs_t *gtfs = gtfs_init(directory + "/checkpointfailure", verbose);
+    string filename = "test37.txt";
+    auto filePath = fs::path(gtfs->dirname) / filename;
+    auto logFilePath = fs::path(gtfs->dirname) / (filename + ".log");
+    file_t *fl = gtfs_open_file(gtfs, filename, 100);
+    string str = "Testing string.\n";
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, str.length(), str.c_str()));
+    gtfs_close_file(gtfs, fl);
+
+    // The data file cannot be opened for the checkpoint while a directory is in its place
+    fs::rename(filePath, filePath.string() + ".moved");
+    fs::create_directory(filePath);
+    bool failed = gtfs_clean(gtfs) != 0 && fs::exists(logFilePath);
+    fs::remove(filePath);
+    fs::rename(filePath.string() + ".moved", filePath);
+    bool cleaned = gtfs_clean(gtfs) == 0 && !fs::exists(logFilePath);
+
+    fl = gtfs_open_file(gtfs, filename, 100);
+    char *data = gtfs_read_file(gtfs, fl, 0, str.length());
+    bool applied = data && str.compare(data) == 0;
+    free(data);
+    gtfs_close_file(gtfs, fl);
+
+    cout << "Failed clean kept the log: " << failed << ", cleaned afterwards: " << cleaned << ", applied: " << applied << ": ";
+    (failed && cleaned && applied) ? cout << PASS : cout << FAIL;
+}
+
+/** Testing that a read-only view never mixes the contents it was opened with and those a clean checkpointed since */
+void test_readonly_view_after_clean() {
+    fs::remove_all(directory + "/readonlyclean");
+    gtfs_t *gtfs = gtfs_init(directory + "/readonlyclean", verbose);
+    string filename = "test38.txt";
+    string a(8192, 'A'), b(8192, 'B');
+    file_t *fl = gtfs_open_file(gtfs, filename, 8192);
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, a.length(), a.c_str()));
+    gtfs_clean(gtfs);
+    file_t *view = gtfs_open_file_readonly(gtfs, filename);
+    char *data = gtfs_read_file(gtfs, view, 0, 10);
+    bool opened = data && string(data) == a.substr(0, 10);
+    free(data);
+
+    // Only the first page of the view is resident, the second one is gone from the data file after the clean
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, b.length(), b.c_str()));
+    gtfs_clean(gtfs);
+    data = gtfs_read_file(gtfs, view, 0, 8192);
+    bool notTorn = !data || string(data) == a;
+    free(data);
+    data = gtfs_refresh_file(gtfs, view) == 0 ? gtfs_read_file(gtfs, view, 0, 8192) : NULL;
+    bool refreshed = data && string(data) == b;
+    free(data);
+    gtfs_close_file(gtfs, view);
+    gtfs_close_file(gtfs, fl);
+
+    cout << "Opened: " << opened << ", not torn after clean: " << notTorn << ", refreshed: " << refreshed << ": ";
+    (opened && notTorn && refreshed) ? cout << PASS : cout << FAIL;
+}
+
+/** Testing that a standby which failed to append a shipped commit is not promoted */
+void test_failed_replication() {
+    fs::remove_all(directory + "/replicafailure");
+    fs::remove_all(directory + "/standbyfailure");
+    gtfs_t *primary = gtfs_init(directory + "/replicafailure", verbose);
+    gtfs_t *standby = gtfs_init(directory + "/standbyfailure", verbose);
+    string filename = "test39.txt";
+    string str = "Shipped commit.";
+    file_t *fl = gtfs_open_file(primary, filename, 100);
+
+    // The standby cannot append to its log while a directory is in its place
+    auto standbyLogPath = fs::path(standby->dirname) / (filename + ".log");
+    fs::create_directories(standbyLogPath / "in-the-way");
+    bool started = gtfs_start_replication(primary, standby) == 0;
+    gtfs_sync_write_file(gtfs_write_file(primary, fl, 0, str.length(), str.c_str()));
+    gtfs_close_file(primary, fl);
+    gtfs_stop_replication(primary);
+    gtfs_replication_stats_t stats = gtfs_get_replication_stats(primary);
+    bool counted = stats.failedRecords == 1 && stats.appliedRecords == 0 && stats.uncheckpointedBytes == 0;
+    bool refused = gtfs_promote_standby(primary) == -1;
+
+    // Restarting copies the primary's files over again, the standby then holds the commit and can be promoted
+    fs::remove_all(standbyLogPath);
+    bool promoted = gtfs_start_replication(primary, standby) == 0 && gtfs_get_replication_stats(primary).failedRecords == 0
+        && gtfs_promote_standby(primary) == 0;
+
+    cout << "Started: " << started << ", failure counted: " << counted << ", promotion refused: " << refused
+        << ", promoted after restart: " << promoted << ": ";
+    (started && counted && refused && promoted) ? cout << PASS : cout << FAIL;
+}
+
+/** Testing that committed pages of an open file get evicted once a clean checkpointed them, and read back from the data file */
+void test_memory_budget_checkpointed() {
+    fs::remove_all(directory + "/memorycheckpointed");
+    gtfs_t *gtfs = gtfs_init(directory + "/memorycheckpointed", verbose);
+    const int pageSize = 4096, pages = 256;
+    gtfs->options.memoryBudget = 16 * pageSize;
+    string filename = "test40.txt";
+    file_t *fl = gtfs_open_file(gtfs, filename, pages * pageSize);
+    string contents;
+    for (int i = 0; i < pages; ++i) {
+        string page(pageSize, 'a' + i % 26);
+        gtfs_sync_write_file(gtfs_write_file(gtfs, fl, i * pageSize, page.length(), page.c_str()));
+        contents += page;
+    }
+    // Committed but only in the log, the pages cannot be dropped yet
+    bool pinned = gtfs_get_memory_usage(gtfs).residentBytes >= static_cast<size_t>(pages) * pageSize;
+
+    gtfs_clean(gtfs);
+    bool evicted = gtfs_get_memory_usage(gtfs).residentBytes <= 16 * pageSize;
+    // A page written again is dirty until the next clean, the others get read back from the data file
+    string rewritten(pageSize, 'Z');
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, rewritten.length(), rewritten.c_str()));
+    contents.replace(0, pageSize, rewritten);
+    bool readBack = true;
+    for (int i = 0; i < pages; ++i) {
+        char *data = gtfs_read_file(gtfs, fl, i * pageSize, pageSize);
+        readBack &= data && contents.compare(i * pageSize, pageSize, data) == 0;
+        free(data);
+    }
+    auto usage = gtfs_get_memory_usage(gtfs);
+    gtfs_close_file(gtfs, fl);
+    fl = gtfs_open_file(gtfs, filename, pages * pageSize);
+    char *data = gtfs_read_file(gtfs, fl, 0, pageSize);
+    bool replayed = data && rewritten.compare(data) == 0;
+    free(data);
+    gtfs_close_file(gtfs, fl);
+
+    bool withinBudget = usage.residentBytes + usage.transactionBytes <= usage.budgetBytes;
+    cout << "Pinned before clean: " << pinned << ", evicted after clean: " << evicted << ", read back: " << readBack << ", resident "
+        << usage.residentBytes << " of " << usage.budgetBytes << " bytes, rewritten page replayed: " << replayed << ": ";
+    (pinned && evicted && readBack && withinBudget && replayed) ? cout << PASS : cout << FAIL;
+}
+
 int main(int argc, char **argv) {
     if (argc < 2)
         printf("Usage: ./test verbose_flag\n");
@@ -556,4 +1756,124 @@ int main(int argc, char **argv) {
     cout << "Testing that syncing a synced write again fails.\n";
     test_sync_synced_write();
 
+    cout << "================== Test 21 ==================\n";
+    cout << "Testing that delta encoding logs only changed bytes and skips no-op writes.\n";
+    test_delta_encoded_write();
+
+    cout << "================== Test 22 ==================\n";
+    cout << "Testing that gtfs_verify() detects and repairs a torn log tail.\n";
+    test_verify_torn_log();
+
+    cout << "================== Test 23 ==================\n";
+    cout << "Testing that a partial clean of a segmented log drops only whole applied segments.\n";
+    test_segmented_log_partial_clean();
+
+    cout << "================== Test 24 ==================\n";
+    cout << "Testing that the directory-wide shared log is replayed and cleaned per file.\n";
+    test_shared_log();
+
+    cout << "================== Test 25 ==================\n";
+    cout << "Testing that direct I/O log appends and checkpoints handle unaligned records.\n";
+    test_direct_io();
+
+    cout << "================== Test 26 ==================\n";
+    cout << "Testing that reopening an unchanged closed file is served from the buffer cache with only its committed contents.\n";
+    test_buffer_cache();
+
+    cout << "================== Test 27 ==================\n";
+    cout << "Testing that clean pages of open files are evicted to stay within the memory budget and read back on access.\n";
+    test_memory_budget();
+
+    cout << "================== Test 28 ==================\n";
+    cout << "Testing that the dirty file manifest lists exactly the files with logs, and gets rebuilt if lost.\n";
+    test_dirty_manifest();
+
+    cout << "================== Test 29 ==================\n";
+    cout << "Testing that a batch of files opens in parallel, each file failing or succeeding on its own.\n";
+    test_open_files_batch();
+
+    cout << "================== Test 30 ==================\n";
+    cout << "Testing that opening a sparse file reads only its data, and that extensions can be preallocated.\n";
+    test_sparse_open();
+
+    cout << "================== Test 31 ==================\n";
+    cout << "Testing that the checkpoint punches holes for pages cleared to zeros instead of writing them.\n";
+    test_checkpoint_hole_punching();
+
+    cout << "================== Test 32 ==================\n";
+    cout << "Testing that a read-only open does not block the writer and refreshes from the records appended since.\n";
+    test_readonly_open();
+
+    cout << "================== Test 33 ==================\n";
+    cout << "Testing that commits shipped to a standby are applied and checkpointed there, and survive its promotion.\n";
+    test_replication();
+
+    cout << "================== Test 34 ==================\n";
+    cout << "Testing that offsets past 4 GB are written, logged, replayed and checkpointed through the 64-bit API.\n";
+    test_large_file();
+
+    cout << "================== Test 35 ==================\n";
+    cout << "Testing that syncing a file commits all its pending writes as merged extents in one append.\n";
+    test_sync_file();
+
+    cout << "================== Test 36 ==================\n";
+    cout << "Testing that a log spanning several read-ahead chunks replays and cleans like a small one.\n";
+    test_read_ahead_replay();
+
+    cout << "================== Test 37 ==================\n";
+    cout << "Testing that large writes are logged as references to a sidecar file and copied from it by the checkpoint.\n";
+    test_large_write_bypass();
+
+    cout << "================== Test 38 ==================\n";
+    cout << "Testing that the log-structured engine compacts the oldest segments and keeps its data out of the data file.\n";
+    test_log_structured();
+
+    cout << "================== Test 39 ==================\n";
+    cout << "Testing that uncommitted writes past the budget spill their data to disk and still commit and abort.\n";
+    test_spill_uncommitted();
+
+    cout << "================== Test 40 ==================\n";
+    cout << "Testing that the background cleaner checkpoints the log in throttled chunks while commits go on.\n";
+    test_background_cleaner();
+
+    cout << "================== Test 41 ==================\n";
+    cout << "Testing that replaying a large log on several threads, by offset range, yields the contents of an in-order replay.\n";
+    test_parallel_replay();
+
+    cout << "================== Test 42 ==================\n";
+    cout << "Testing that write handles come from a per-file slab, reuse released slots and reject stale handles.\n";
+    test_write_handles();
+
+    cout << "================== Test 43 ==================\n";
+    cout << "Testing that the typed record API writes and reads fixed-size records, zero bytes included.\n";
+    test_record_file();
+
+    cout << "================== Test 44 ==================\n";
+    cout << "Testing that legacy logs get replayed and that a corrupted record in the middle of a log is reported, not truncated.\n";
+    test_legacy_and_corrupted_log();
+
+    cout << "================== Test 45 ==================\n";
+    cout << "Testing that delta encoding after a partial sync logs the bytes the partial sync left out.\n";
+    test_delta_after_partial_sync();
+
+    cout << "================== Test 46 ==================\n";
+    cout << "Testing that a commit whose log append fails returns an error and can be synced again.\n";
+    test_failed_log_append();
+
+    cout << "================== Test 47 ==================\n";
+    cout << "Testing that a clean whose checkpoint fails keeps the log.\n";
+    test_failed_checkpoint();
+
+    cout << "================== Test 48 ==================\n";
+    cout << "Testing that a read-only view does not mix old contents with contents a clean checkpointed since.\n";
+    test_readonly_view_after_clean();
+
+    cout << "================== Test 49 ==================\n";
+    cout << "Testing that a standby which failed to append a shipped commit is not promoted.\n";
+    test_failed_replication();
+
+    cout << "================== Test 50 ==================\n";
+    cout << "Testing that committed pages of an open file get evicted once a clean checkpointed them, and read back from the data file.\n";
+    test_memory_budget_checkpointed();
+
 }
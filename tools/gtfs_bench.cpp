@@ -0,0 +1,703 @@
+#include "../src/gtfs.hpp"
+#include <cstring>
+#include <cmath>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <random>
+#include <algorithm>
+#include <fcntl.h>
+
+// Workload driver: runs processes x threads of workers over a set of files with a configurable operation mix,
+// or replays a captured operation trace, and reports throughput and latency per run.
+//
+// Files are opened exclusively (flock), so each worker gets its own files: file i belongs to worker i % workers.
+// A trace is a text file of lines "<worker> <op> <file> <offset> <length>", see --capture, where "-" stands for the file
+// of clean operations. On replay the trace files are shared out among the workers in order of first appearance, each
+// worker running the operations on its files in trace order. Cleans go to the trace worker modulo the worker count.
+//
+// Each run also reports the bytes the library wrote against the bytes committed, i.e. its write amplification.
+// --compare-engines runs every configuration with the data file engine and with the log-structured one, each in its
+// own subdirectory, and cleans all logs at the end of the runs so that deferred checkpoints and compactions are counted.
+
+enum OpType { OP_READ, OP_WRITE, OP_PENDING, OP_SYNC, OP_ABORT, OP_CLEAN, OP_COUNT };
+static const char* OP_NAMES[OP_COUNT] = {"read", "write", "pending", "sync", "abort", "clean"};
+// Latency histogram buckets, bucket i counts operations that took [2^i, 2^(i+1)) nanoseconds
+static const int LATENCY_BUCKETS = 48;
+
+struct OpStats {
+    uint64_t count = 0;
+    uint64_t errors = 0;
+    uint64_t bytes = 0;
+    uint64_t latency[LATENCY_BUCKETS] = {};
+};
+
+/** Plain data, sent through a pipe from each worker process to the driver */
+struct RunStats {
+    OpStats ops[OP_COUNT];
+    // Steady clock bounds of the measured phase, comparable across processes
+    int64_t startNs = INT64_MAX;
+    int64_t endNs = 0;
+    gtfs_write_stats_t writes;
+
+    void add(const RunStats& other) {
+        for (int op = 0; op < OP_COUNT; ++op) {
+            ops[op].count += other.ops[op].count;
+            ops[op].errors += other.ops[op].errors;
+            ops[op].bytes += other.ops[op].bytes;
+            for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+                ops[op].latency[i] += other.ops[op].latency[i];
+            }
+        }
+        startNs = min(startNs, other.startNs);
+        endNs = max(endNs, other.endNs);
+        addWrites(other.writes, 1);
+    }
+
+    /** Adds `sign` times the write stats `other` */
+    void addWrites(const gtfs_write_stats_t& other, int sign) {
+        writes.committedBytes += sign * other.committedBytes;
+        writes.logBytes += sign * other.logBytes;
+        writes.checkpointBytes += sign * other.checkpointBytes;
+        writes.compactedBytes += sign * other.compactedBytes;
+    }
+};
+
+struct TraceOp {
+    int worker;
+    OpType op;
+    string file;
+    // Order of first appearance of the file in the trace
+    int fileIndex;
+    off_t offset;
+    int64_t length;
+};
+
+struct Config {
+    string directory;
+    int processes = 1;
+    int threads = 1;
+    int files = 0;
+    off_t fileSize = 1 << 20;
+    size_t minSize = 4096;
+    size_t maxSize = 4096;
+    uint64_t opsPerWorker = 10000;
+    double duration = 0;
+    unsigned weights[OP_COUNT] = {50, 50, 0, 0, 0, 0};
+    bool zipfian = false;
+    double theta = 0.99;
+    int64_t cleanBytes = -1;
+    uint64_t seed = 1;
+    bool scale = false;
+    string tracePath;
+    string capturePath;
+    gtfs_options_t options;
+    bool compareEngines = false;
+    bool finalClean = false;
+    bool backgroundCleaner = false;
+    gtfs_cleaner_options_t cleaner;
+    size_t bufferCacheBytes = 0;
+    int verbose = 0;
+    vector<TraceOp> trace;
+};
+
+static int64_t now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/** YCSB scrambled zipfian generator: item popularity follows a zipfian law, hot items are spread over the key space */
+class ZipfianGenerator {
+public:
+    ZipfianGenerator(uint64_t items, double theta): items(items), theta(theta) {
+        zetan = zeta(items, theta);
+        double zeta2 = zeta(2, theta);
+        alpha = 1.0 / (1.0 - theta);
+        eta = (1.0 - pow(2.0 / items, 1.0 - theta)) / (1.0 - zeta2 / zetan);
+    }
+
+    uint64_t next(mt19937_64& rng) {
+        double u = uniform_real_distribution<double>(0.0, 1.0)(rng);
+        double uz = u * zetan;
+        uint64_t rank;
+        if (uz < 1.0) {
+            rank = 0;
+        } else if (uz < 1.0 + pow(0.5, theta)) {
+            rank = 1;
+        } else {
+            rank = min<uint64_t>(items - 1, static_cast<uint64_t>(items * pow(eta * u - eta + 1.0, alpha)));
+        }
+        return fnv1a(rank) % items;
+    }
+
+private:
+    static double zeta(uint64_t n, double theta) {
+        double sum = 0;
+        for (uint64_t i = 1; i <= n; ++i) {
+            sum += 1.0 / pow(static_cast<double>(i), theta);
+        }
+        return sum;
+    }
+
+    static uint64_t fnv1a(uint64_t value) {
+        uint64_t hash = 0xcbf29ce484222325ULL;
+        for (int i = 0; i < 8; ++i) {
+            hash = (hash ^ (value & 0xff)) * 0x100000001b3ULL;
+            value >>= 8;
+        }
+        return hash;
+    }
+
+    uint64_t items;
+    double theta, zetan, alpha, eta;
+};
+
+/** State of one worker thread: its open files, the writes it left pending, and what it recorded for --capture */
+class Worker {
+public:
+    Worker(const Config& config, gtfs_t* gtfs, int id, int workers): config(config), gtfs(gtfs), id(id), workers(workers),
+        rng(config.seed * 1000003 + id) {}
+
+    RunStats run() {
+        return config.trace.empty() ? runSynthetic() : runTrace();
+    }
+
+    const string& getCapture() const {
+        return capture;
+    }
+
+private:
+    RunStats runSynthetic() {
+        vector<string> names;
+        for (int i = id; i < config.files; i += workers) {
+            names.push_back("bench" + to_string(i) + ".dat");
+        }
+        vector<file_t*> opened = gtfs_open_files64(gtfs, names, vector<off_t>(names.size(), config.fileSize));
+        for (size_t i = 0; i < names.size(); ++i) {
+            if (opened[i]) {
+                files[names[i]] = opened[i];
+            } else {
+                cerr << "Worker " << id << " failed to open " << names[i] << "\n";
+            }
+        }
+        if (files.size() != names.size()) {
+            closeAll();
+            return stats;
+        }
+        fillPayload(config.maxSize);
+
+        // Keys are the records of maxSize bytes of the worker's files
+        uint64_t slotsPerFile = max<uint64_t>(1, config.fileSize / config.maxSize);
+        uint64_t keys = slotsPerFile * names.size();
+        unique_ptr<ZipfianGenerator> zipfian = config.zipfian ? make_unique<ZipfianGenerator>(keys, config.theta) : nullptr;
+        discrete_distribution<int> opDistribution(config.weights, config.weights + OP_COUNT);
+        uniform_int_distribution<uint64_t> uniformKey(0, keys - 1);
+        uniform_int_distribution<size_t> size(config.minSize, config.maxSize);
+
+        stats.startNs = now_ns();
+        int64_t deadline = config.duration > 0 ? stats.startNs + static_cast<int64_t>(config.duration * 1e9) : INT64_MAX;
+        for (uint64_t n = 0; n < config.opsPerWorker && now_ns() < deadline; ++n) {
+            uint64_t key = zipfian ? zipfian->next(rng) : uniformKey(rng);
+            const string& name = names[key / slotsPerFile];
+            off_t offset = (key % slotsPerFile) * config.maxSize;
+            OpType op = static_cast<OpType>(opDistribution(rng));
+            execute(op, name, offset, op == OP_CLEAN ? config.cleanBytes : static_cast<int64_t>(size(rng)));
+        }
+        stats.endNs = now_ns();
+        closeAll();
+        return stats;
+    }
+
+    bool isOwnTraceOp(const TraceOp& traced) const {
+        return (traced.op == OP_CLEAN ? traced.worker : traced.fileIndex) % workers == id;
+    }
+
+    RunStats runTrace() {
+        // Open every file of the worker's share of the trace up front, large enough for all its operations
+        map<string, off_t> lengths;
+        size_t maxLength = 0;
+        for (const auto& traced: config.trace) {
+            if (isOwnTraceOp(traced) && traced.op != OP_CLEAN) {
+                auto& length = lengths[traced.file];
+                length = max<off_t>({length, config.fileSize, traced.offset + traced.length});
+                maxLength = max<size_t>(maxLength, traced.length);
+            }
+        }
+        for (const auto& fileLength: lengths) {
+            file_t* fl = gtfs_open_file64(gtfs, fileLength.first, fileLength.second);
+            if (!fl) {
+                cerr << "Worker " << id << " failed to open " << fileLength.first << "\n";
+                closeAll();
+                return stats;
+            }
+            files[fileLength.first] = fl;
+        }
+        fillPayload(maxLength);
+
+        stats.startNs = now_ns();
+        for (const auto& traced: config.trace) {
+            if (isOwnTraceOp(traced)) {
+                execute(traced.op, traced.file, traced.offset, traced.length);
+            }
+        }
+        stats.endNs = now_ns();
+        closeAll();
+        return stats;
+    }
+
+    void fillPayload(size_t size) {
+        payload.resize(size);
+        for (auto& c: payload) {
+            c = 'a' + rng() % 26;
+        }
+    }
+
+    void execute(OpType op, const string& name, off_t offset, int64_t length) {
+        file_t* fl = op == OP_CLEAN ? nullptr : files[name];
+        bool ok = true;
+        uint64_t bytes = 0;
+        int64_t start = now_ns();
+        switch (op) {
+        case OP_READ: {
+            char* data = gtfs_read_file64(gtfs, fl, offset, length);
+            ok = data != NULL;
+            bytes = ok && offset < fl->fileLength ? min<uint64_t>(length, fl->fileLength - offset) : 0;
+            free(data);
+            break;
+        }
+        case OP_WRITE:
+        case OP_ABORT:
+        case OP_PENDING: {
+            auto write = gtfs_write_file_handle(gtfs, fl, offset, length, payload.data());
+            ok = write.generation != 0;
+            if (ok && op == OP_PENDING) {
+                pending[fl].push_back(write);
+            } else if (ok) {
+                ok = (op == OP_WRITE ? gtfs_sync_write_handle(fl, write) : gtfs_abort_write_handle(fl, write)) == 0;
+                gtfs_release_write_handle(fl, write);
+            }
+            bytes = ok ? length : 0;
+            break;
+        }
+        case OP_SYNC:
+            ok = gtfs_sync_file(gtfs, fl) == 0;
+            releasePending(fl);
+            break;
+        case OP_CLEAN:
+            ok = gtfs_clean_n_bytes64(gtfs, length) == 0;
+            break;
+        default:
+            break;
+        }
+        record(op, ok, bytes, now_ns() - start);
+        if (!config.capturePath.empty()) {
+            capture += to_string(id) + " " + OP_NAMES[op] + " " + (op == OP_CLEAN ? "-" : name) + " " + to_string(offset) + " "
+                + to_string(length) + "\n";
+        }
+    }
+
+    void record(OpType op, bool ok, uint64_t bytes, int64_t latencyNs) {
+        auto& opStats = stats.ops[op];
+        opStats.count++;
+        opStats.errors += ok ? 0 : 1;
+        opStats.bytes += bytes;
+        int bucket = 0;
+        while (bucket + 1 < LATENCY_BUCKETS && (int64_t(1) << (bucket + 1)) <= latencyNs) {
+            bucket++;
+        }
+        opStats.latency[bucket]++;
+    }
+
+    void releasePending(file_t* fl) {
+        for (const auto& write: pending[fl]) {
+            gtfs_release_write_handle(fl, write);
+        }
+        pending[fl].clear();
+    }
+
+    void closeAll() {
+        for (auto& file: files) {
+            // Writes still pending get discarded with the file, like in any application that does not sync them
+            releasePending(file.second);
+            gtfs_close_file(gtfs, file.second);
+        }
+        files.clear();
+    }
+
+    const Config& config;
+    gtfs_t* gtfs;
+    int id;
+    int workers;
+    mt19937_64 rng;
+    map<string, file_t*> files;
+    map<file_t*, vector<gtfs_write_handle_t>> pending;
+    vector<char> payload;
+    RunStats stats;
+    string capture;
+};
+
+/** Body of one worker process: runs its threads and writes their combined stats to `statsFd` */
+static void run_process(const Config& config, int process, int threads, int statsFd) {
+    // The counters of the driver, inherited through the fork, are not part of the run
+    auto writesBefore = gtfs_get_write_stats();
+    gtfs_t* gtfs = gtfs_init(config.directory, config.verbose);
+    gtfs->options = config.options;
+    gtfs_set_buffer_cache_budget(config.bufferCacheBytes);
+    // Commits only hold off the cleaner of their own process, so a single one runs
+    if (config.backgroundCleaner && process == 0 && gtfs_start_cleaner(gtfs, config.cleaner) != 0) {
+        cerr << "Failed to start the background cleaner\n";
+    }
+    int workers = config.processes * threads;
+    vector<unique_ptr<Worker>> processWorkers;
+    vector<RunStats> threadStats(threads);
+    vector<thread> running;
+    for (int t = 0; t < threads; ++t) {
+        processWorkers.push_back(make_unique<Worker>(config, gtfs, process * threads + t, workers));
+    }
+    for (int t = 0; t < threads; ++t) {
+        running.emplace_back([&, t]() { threadStats[t] = processWorkers[t]->run(); });
+    }
+    RunStats stats;
+    for (int t = 0; t < threads; ++t) {
+        running[t].join();
+        stats.add(threadStats[t]);
+    }
+    if (config.backgroundCleaner && process == 0) {
+        gtfs_stop_cleaner(gtfs);
+    }
+    if (!config.capturePath.empty()) {
+        string capture;
+        for (const auto& worker: processWorkers) {
+            capture += worker->getCapture();
+        }
+        // One append per process, O_APPEND keeps the processes from overwriting each other
+        int fd = open(config.capturePath.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0644);
+        if (fd == -1 || write(fd, capture.data(), capture.size()) != static_cast<ssize_t>(capture.size())) {
+            cerr << "Failed to write capture " << config.capturePath << "\n";
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+    stats.addWrites(gtfs_get_write_stats(), 1);
+    stats.addWrites(writesBefore, -1);
+    if (write(statsFd, &stats, sizeof(stats)) != static_cast<ssize_t>(sizeof(stats))) {
+        cerr << "Failed to report stats of process " << process << "\n";
+    }
+}
+
+/** Runs one configuration of processes x threads and returns the stats of all its workers, or false if a process failed */
+static bool run_workload(const Config& config, int threads, RunStats& stats) {
+    vector<pair<pid_t, int>> children;
+    for (int p = 0; p < config.processes; ++p) {
+        int fds[2];
+        if (pipe(fds) == -1) {
+            return false;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fds[0]);
+            run_process(config, p, threads, fds[1]);
+            _exit(0);
+        }
+        close(fds[1]);
+        children.emplace_back(pid, fds[0]);
+    }
+    bool ok = true;
+    for (const auto& child: children) {
+        RunStats childStats;
+        size_t received = 0;
+        char* bytes = reinterpret_cast<char*>(&childStats);
+        ssize_t n;
+        while (received < sizeof(childStats) && (n = read(child.second, bytes + received, sizeof(childStats) - received)) > 0) {
+            received += n;
+        }
+        close(child.second);
+        int status;
+        waitpid(child.first, &status, 0);
+        if (received != sizeof(childStats) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            ok = false;
+            continue;
+        }
+        stats.add(childStats);
+    }
+    return ok;
+}
+
+/** Latency below which `fraction` of the operations completed, as the upper bound of its histogram bucket */
+static double percentile_us(const OpStats& opStats, double fraction) {
+    uint64_t target = static_cast<uint64_t>(ceil(opStats.count * fraction)), seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; ++i) {
+        seen += opStats.latency[i];
+        if (seen >= target && seen > 0) {
+            return (int64_t(1) << (i + 1)) / 1000.0;
+        }
+    }
+    return 0;
+}
+
+static void print_run(int processes, int threads, const RunStats& stats) {
+    double seconds = stats.endNs > stats.startNs ? (stats.endNs - stats.startNs) / 1e9 : 0;
+    uint64_t total = 0, errors = 0;
+    for (int op = 0; op < OP_COUNT; ++op) {
+        total += stats.ops[op].count;
+        errors += stats.ops[op].errors;
+    }
+    printf("%9d %7d %10lu %8.3f %12.0f %7lu\n", processes, threads, (unsigned long) total, seconds, seconds > 0 ? total / seconds : 0.0,
+        (unsigned long) errors);
+    for (int op = 0; op < OP_COUNT; ++op) {
+        const auto& opStats = stats.ops[op];
+        if (opStats.count == 0) {
+            continue;
+        }
+        printf("          %-8s ops=%-10lu errors=%-6lu MB/s=%-9.2f p50<%.1fus p99<%.1fus p99.9<%.1fus\n", OP_NAMES[op],
+            (unsigned long) opStats.count, (unsigned long) opStats.errors, seconds > 0 ? opStats.bytes / seconds / 1e6 : 0.0,
+            percentile_us(opStats, 0.5), percentile_us(opStats, 0.99), percentile_us(opStats, 0.999));
+    }
+    const auto& writes = stats.writes;
+    if (writes.committedBytes > 0) {
+        printf("          writes   committed=%.2fMB log=%.2fMB checkpoint=%.2fMB compacted=%.2fMB amplification=%.2f\n",
+            writes.committedBytes / 1e6, writes.logBytes / 1e6, writes.checkpointBytes / 1e6, writes.compactedBytes / 1e6,
+            static_cast<double>(writes.logBytes + writes.checkpointBytes) / writes.committedBytes);
+    }
+}
+
+/** Cleans all logs of the directory the run used, adding the bytes this writes to the stats of the run */
+static void clean_after_run(const Config& config, RunStats& stats) {
+    auto before = gtfs_get_write_stats();
+    gtfs_t* gtfs = gtfs_init(config.directory, config.verbose);
+    gtfs->options = config.options;
+    if (gtfs_clean(gtfs) != 0) {
+        cerr << "Final clean of " << config.directory << " failed\n";
+    }
+    stats.addWrites(gtfs_get_write_stats(), 1);
+    stats.addWrites(before, -1);
+}
+
+static bool parse_op(const string& name, OpType& op) {
+    for (int i = 0; i < OP_COUNT; ++i) {
+        if (name == OP_NAMES[i]) {
+            op = static_cast<OpType>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+/** Parses "read=50,write=30,..." into operation weights, operations not listed get 0 */
+static bool parse_mix(const string& mix, unsigned* weights) {
+    fill(weights, weights + OP_COUNT, 0);
+    stringstream entries(mix);
+    string entry;
+    unsigned total = 0;
+    while (getline(entries, entry, ',')) {
+        auto equals = entry.find('=');
+        OpType op;
+        if (equals == string::npos || !parse_op(entry.substr(0, equals), op)) {
+            return false;
+        }
+        weights[op] = strtoul(entry.c_str() + equals + 1, NULL, 10);
+        total += weights[op];
+    }
+    return total > 0;
+}
+
+static bool load_trace(const string& path, vector<TraceOp>& trace) {
+    ifstream traceFile(path);
+    if (!traceFile.is_open()) {
+        return false;
+    }
+    map<string, int> fileIndexes;
+    string line;
+    while (getline(traceFile, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        istringstream fields(line);
+        TraceOp traced;
+        string op;
+        if (!(fields >> traced.worker >> op >> traced.file >> traced.offset >> traced.length) || !parse_op(op, traced.op)
+            || traced.worker < 0 || traced.offset < 0 || (traced.op != OP_CLEAN && traced.length < 0)) {
+            cerr << "Bad trace line: " << line << "\n";
+            return false;
+        }
+        traced.fileIndex = fileIndexes.emplace(traced.file, fileIndexes.size()).first->second;
+        trace.push_back(traced);
+    }
+    return true;
+}
+
+static void usage() {
+    cout << "Usage: ./gtfs_bench directory [options]\n"
+        "  --processes N        worker processes (1)\n"
+        "  --threads N          worker threads per process (1)\n"
+        "  --files N            files, shared out among the workers (one per worker)\n"
+        "  --file-size BYTES    length the files are opened with (1 MiB)\n"
+        "  --size MIN[:MAX]     bytes per read or write, uniform in [MIN, MAX] (4096)\n"
+        "  --ops N              operations per worker (10000)\n"
+        "  --duration SECONDS   stop the workers after this long instead (0: no limit)\n"
+        "  --mix OP=W,...       weights of read, write, pending, sync, abort, clean (read=50,write=50)\n"
+        "                       write syncs each write, pending leaves it for the next sync of the file (gtfs_sync_file)\n"
+        "  --zipfian [THETA]    YCSB scrambled zipfian record popularity (0.99) instead of uniform\n"
+        "  --clean-bytes N      bytes per log for clean operations (-1: whole logs)\n"
+        "  --seed N             random seed (1)\n"
+        "  --scale              run with 1, 2, 4, ... up to --threads threads per process, one row each\n"
+        "  --trace FILE         replay a captured trace instead of generating operations\n"
+        "  --capture FILE       append the operations run to a trace file\n"
+        "  --delta --shared-log --direct-io --preallocate\n"
+        "  --segment-size BYTES --memory-budget BYTES --buffer-cache BYTES\n"
+        "  --log-structured --compaction-ratio RATIO --uncommitted-budget BYTES\n"
+        "                       library modes, see gtfs_options_t\n"
+        "  --final-clean        clean all logs after each run, counting the bytes it writes\n"
+        "  --cleaner            run the background cleaner in the first worker process while the workload runs\n"
+        "  --cleaner-rate BYTES --cleaner-chunk BYTES\n"
+        "                       its write rate cap per second (0: none) and chunk size, see gtfs_cleaner_options_t\n"
+        "  --compare-engines    run each configuration with the data file and the log-structured engines (implies --final-clean)\n"
+        "  --verbose\n";
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argv[1][0] == '-') {
+        usage();
+        return 2;
+    }
+    Config config;
+    config.directory = argv[1];
+    for (int i = 2; i < argc; ++i) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        string value = hasValue ? argv[i + 1] : "";
+        if (arg == "--processes" && hasValue) {
+            config.processes = stoi(value), ++i;
+        } else if (arg == "--threads" && hasValue) {
+            config.threads = stoi(value), ++i;
+        } else if (arg == "--files" && hasValue) {
+            config.files = stoi(value), ++i;
+        } else if (arg == "--file-size" && hasValue) {
+            config.fileSize = stoll(value), ++i;
+        } else if (arg == "--size" && hasValue) {
+            auto colon = value.find(':');
+            config.minSize = stoull(value.substr(0, colon));
+            config.maxSize = colon == string::npos ? config.minSize : stoull(value.substr(colon + 1));
+            ++i;
+        } else if (arg == "--ops" && hasValue) {
+            config.opsPerWorker = stoull(value), ++i;
+        } else if (arg == "--duration" && hasValue) {
+            config.duration = stod(value), ++i;
+        } else if (arg == "--mix" && hasValue) {
+            if (!parse_mix(value, config.weights)) {
+                cout << "Bad operation mix " << value << "\n";
+                return 2;
+            }
+            ++i;
+        } else if (arg == "--zipfian") {
+            config.zipfian = true;
+            if (hasValue && isdigit(static_cast<unsigned char>(value[0]))) {
+                config.theta = stod(value), ++i;
+            }
+        } else if (arg == "--clean-bytes" && hasValue) {
+            config.cleanBytes = stoll(value), ++i;
+        } else if (arg == "--seed" && hasValue) {
+            config.seed = stoull(value), ++i;
+        } else if (arg == "--scale") {
+            config.scale = true;
+        } else if (arg == "--trace" && hasValue) {
+            config.tracePath = value, ++i;
+        } else if (arg == "--capture" && hasValue) {
+            config.capturePath = value, ++i;
+        } else if (arg == "--delta") {
+            config.options.deltaEncoding = true;
+        } else if (arg == "--shared-log") {
+            config.options.sharedLog = true;
+        } else if (arg == "--direct-io") {
+            config.options.directIO = true;
+        } else if (arg == "--preallocate") {
+            config.options.preallocate = true;
+        } else if (arg == "--segment-size" && hasValue) {
+            config.options.logSegmentSize = stoull(value), ++i;
+        } else if (arg == "--memory-budget" && hasValue) {
+            config.options.memoryBudget = stoull(value), ++i;
+        } else if (arg == "--log-structured") {
+            config.options.logStructured = true;
+        } else if (arg == "--compaction-ratio" && hasValue) {
+            config.options.compactionLiveRatio = stod(value), ++i;
+        } else if (arg == "--uncommitted-budget" && hasValue) {
+            config.options.uncommittedBudget = stoull(value), ++i;
+        } else if (arg == "--cleaner") {
+            config.backgroundCleaner = true;
+        } else if (arg == "--cleaner-rate" && hasValue) {
+            config.cleaner.bytesPerSecond = stoull(value), ++i;
+            config.backgroundCleaner = true;
+        } else if (arg == "--cleaner-chunk" && hasValue) {
+            config.cleaner.chunkBytes = stoll(value), ++i;
+            config.backgroundCleaner = true;
+        } else if (arg == "--final-clean") {
+            config.finalClean = true;
+        } else if (arg == "--compare-engines") {
+            config.compareEngines = config.finalClean = true;
+        } else if (arg == "--buffer-cache" && hasValue) {
+            config.bufferCacheBytes = stoull(value), ++i;
+        } else if (arg == "--verbose") {
+            config.verbose = 1;
+        } else {
+            cout << "Unknown option " << arg << "\n";
+            usage();
+            return 2;
+        }
+    }
+    int maxWorkers = config.processes * config.threads;
+    if (config.files == 0) {
+        config.files = maxWorkers;
+    }
+    if (config.processes < 1 || config.threads < 1 || config.minSize == 0 || config.minSize > config.maxSize
+        || config.theta <= 0 || config.theta == 1.0) {
+        cout << "Invalid configuration\n";
+        return 2;
+    }
+    if (config.tracePath.empty() && config.files < maxWorkers) {
+        cout << "Need at least one file per worker (" << maxWorkers << ")\n";
+        return 2;
+    }
+    if (!config.tracePath.empty() && !load_trace(config.tracePath, config.trace)) {
+        cout << "Failed to load trace " << config.tracePath << "\n";
+        return 2;
+    }
+    error_code ec;
+    fs::create_directories(config.directory, ec);
+
+    printf("processes threads        ops  seconds        ops/s  errors\n");
+    // Flushed before forking, so that the worker processes do not inherit it
+    fflush(stdout);
+    bool ok = true;
+    vector<int> threadCounts;
+    for (int threads = config.scale ? 1 : config.threads; threads < config.threads; threads *= 2) {
+        threadCounts.push_back(threads);
+    }
+    threadCounts.push_back(config.threads);
+    vector<bool> engines = {config.options.logStructured};
+    if (config.compareEngines) {
+        engines = {false, true};
+    }
+    for (int threads: threadCounts) {
+        for (bool logStructured: engines) {
+            Config runConfig = config;
+            runConfig.options.logStructured = logStructured;
+            if (config.compareEngines) {
+                runConfig.directory = (fs::path(config.directory) / (logStructured ? "log-structured" : "data-file")).string();
+                fs::create_directories(runConfig.directory, ec);
+                printf("engine: %s\n", logStructured ? "log-structured" : "data file");
+                fflush(stdout);
+            }
+            RunStats stats;
+            if (!run_workload(runConfig, threads, stats)) {
+                cerr << "A worker process failed\n";
+                ok = false;
+            }
+            if (config.finalClean) {
+                clean_after_run(runConfig, stats);
+            }
+            print_run(config.processes, threads, stats);
+            fflush(stdout);
+        }
+    }
+    return ok ? 0 : 1;
+}
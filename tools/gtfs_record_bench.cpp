@@ -0,0 +1,139 @@
+#include "../src/gtfs_record.hpp"
+#include <cstring>
+#include <chrono>
+
+// Compares the typed record API (gtfs_record_file<T>) with the generic calls on fixed-size records: committed writes,
+// writes committed in batches with gtfs_sync_file(), and reads, for a few record sizes. Each size gets its own file in
+// the directory, the generic and the typed passes writing the same records in the same order.
+
+template <size_t Size>
+struct Record {
+    char bytes[Size];
+};
+
+static double seconds_since(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static void print_result(size_t recordSize, const char* op, const char* api, size_t records, double seconds) {
+    printf("%8zu %-8s %-8s %10zu %10.3f %12.0f\n", recordSize, op, api, records, seconds, records / seconds);
+}
+
+/** Runs the passes for records of `Size` bytes. Returns false if an operation failed or the APIs read different records */
+template <size_t Size>
+static bool run_size(gtfs_t* gtfs, size_t records, size_t batch) {
+    string filename = "records" + to_string(Size) + ".dat";
+    file_t* fl = gtfs_open_file64(gtfs, filename, records * Size);
+    if (!fl) {
+        fprintf(stderr, "Failed to open %s\n", filename.c_str());
+        return false;
+    }
+    gtfs_record_file<Record<Size>> typed(fl);
+    Record<Size> record;
+    bool ok = true;
+    auto fill = [&](size_t index, int pass) {
+        memset(record.bytes, 'a' + (index + pass) % 26, Size);
+    };
+
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < records && ok; ++i) {
+        fill(i, 0);
+        write_t* write = gtfs_write_file64(gtfs, fl, i * Size, Size, record.bytes);
+        ok = write && gtfs_sync_write_file(write) == 0;
+        gtfs_release_write_file(write);
+    }
+    print_result(Size, "write", "generic", records, seconds_since(start));
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < records && ok; ++i) {
+        fill(i, 0);
+        ok = typed.write(i, record) == 0;
+    }
+    print_result(Size, "write", "typed", records, seconds_since(start));
+
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < records && ok; ++i) {
+        fill(i, 1);
+        write_t* write = gtfs_write_file64(gtfs, fl, i * Size, Size, record.bytes);
+        ok = write != NULL;
+        gtfs_release_write_file(write);
+        if (ok && (i + 1) % batch == 0) {
+            ok = gtfs_sync_file(gtfs, fl) == 0;
+        }
+    }
+    ok = ok && gtfs_sync_file(gtfs, fl) == 0;
+    print_result(Size, "batched", "generic", records, seconds_since(start));
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < records && ok; ++i) {
+        fill(i, 1);
+        ok = typed.write_pending(i, record) == 0 && ((i + 1) % batch != 0 || typed.sync() == 0);
+    }
+    ok = ok && typed.sync() == 0;
+    print_result(Size, "batched", "typed", records, seconds_since(start));
+
+    // Both read what the batched passes wrote, which has no zero bytes for the generic read to stop at
+    uint64_t genericSum = 0, typedSum = 0;
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < records && ok; ++i) {
+        char* data = gtfs_read_file64(gtfs, fl, i * Size, Size);
+        ok = data && strlen(data) == Size;
+        if (ok) {
+            memcpy(record.bytes, data, Size);
+            genericSum += record.bytes[0] + record.bytes[Size - 1];
+        }
+        free(data);
+    }
+    print_result(Size, "read", "generic", records, seconds_since(start));
+    start = chrono::steady_clock::now();
+    for (size_t i = 0; i < records && ok; ++i) {
+        record = typed.read(i);
+        typedSum += record.bytes[0] + record.bytes[Size - 1];
+    }
+    print_result(Size, "read", "typed", records, seconds_since(start));
+
+    gtfs_close_file(gtfs, fl);
+    if (ok && genericSum != typedSum) {
+        fprintf(stderr, "Generic and typed reads of %s differ\n", filename.c_str());
+        ok = false;
+    }
+    return ok;
+}
+
+static void usage() {
+    cout << "Usage: ./gtfs_record_bench directory [options]\n"
+        "  --records N          records per record size (10000)\n"
+        "  --batch N            records per gtfs_sync_file() in the batched passes (100)\n"
+        "  --verbose\n";
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || argv[1][0] == '-') {
+        usage();
+        return 2;
+    }
+    string directory = argv[1];
+    size_t records = 10000, batch = 100;
+    int verbose = 0;
+    for (int i = 2; i < argc; ++i) {
+        string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--records" && hasValue) {
+            records = stoull(argv[++i]);
+        } else if (arg == "--batch" && hasValue) {
+            batch = max<size_t>(1, stoull(argv[++i]));
+        } else if (arg == "--verbose") {
+            verbose = 1;
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    gtfs_t* gtfs = gtfs_init(directory, verbose);
+    if (!gtfs) {
+        return 1;
+    }
+    printf("%8s %-8s %-8s %10s %10s %12s\n", "size", "op", "api", "records", "seconds", "records/s");
+    bool ok = run_size<16>(gtfs, records, batch) && run_size<64>(gtfs, records, batch) && run_size<256>(gtfs, records, batch)
+        && run_size<4096>(gtfs, records, batch);
+    gtfs_clean(gtfs);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,57 @@
+#include "../src/gtfs.hpp"
+#include <cstring>
+
+// Verifies (and optionally repairs torn log tails of) every log and data file in a GTFileSystem directory.
+// Exits with 0 if all files are intact, 1 if some are damaged and 2 on usage errors.
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        cout << "Usage: ./gtfs_verify directory [--repair] [--verbose]\n";
+        return 2;
+    }
+    string directory = argv[1];
+    bool repair = false;
+    int verbose = 0;
+    for (int i = 2; i < argc; ++i) {
+        if (strcmp(argv[i], "--repair") == 0) {
+            repair = true;
+        } else if (strcmp(argv[i], "--verbose") == 0) {
+            verbose = 1;
+        } else {
+            cout << "Unknown option " << argv[i] << "\n";
+            return 2;
+        }
+    }
+    // gtfs_init() would create a missing directory, which is never what a verification run wants
+    if (!fs::is_directory(directory)) {
+        cout << directory << " is not a directory\n";
+        return 2;
+    }
+
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    vector<gtfs_verify_result_t> results;
+    int damaged = gtfs_verify(gtfs, repair, results);
+    if (damaged < 0) {
+        cout << "Verification of " << directory << " failed\n";
+        return 2;
+    }
+
+    uint64_t totalBytes = 0;
+    for (const auto& result: results) {
+        totalBytes += result.size;
+        string status = "OK";
+        if (result.ioError) {
+            status = "IO ERROR";
+        } else if (result.corrupted) {
+            status = "CORRUPTED record at offset " + to_string(result.validBytes) + ", " + to_string(result.size - result.validBytes) + " bytes kept";
+        } else if (result.validBytes < result.size) {
+            status = (result.repaired ? "REPAIRED torn tail of " : "TORN tail of ") + to_string(result.size - result.validBytes) + " bytes";
+        }
+        printf("%-8s crc32c=%08x size=%-12lu %s", result.isLog ? "log" : "data", result.checksum, (unsigned long) result.size, result.filename.c_str());
+        if (result.isLog) {
+            printf(" records=%lu", (unsigned long) result.records);
+        }
+        printf(" %s\n", status.c_str());
+    }
+    cout << results.size() << " files, " << totalBytes << " bytes scanned, " << damaged << " damaged\n";
+    return damaged == 0 ? 0 : 1;
+}